@@ -222,7 +222,8 @@ const opcode BPF_LD_MAP = BPF_LD | BPF_IMM | BPF_DW | (BPF_PSEUDO_MAP_FD << 8);
   FN(get_procfs_value),           \
   FN(str_concat),                 \
   FN(text_str),                   \
-  FN(string_quoted),
+  FN(string_quoted),              \
+  FN(print_stackid),
  
 const bpf_func_id BPF_FUNC_map_get_next_key    = (bpf_func_id) -1;
 const bpf_func_id BPF_FUNC_sprintf             = (bpf_func_id) -2;
@@ -235,6 +236,7 @@ const bpf_func_id BPF_FUNC_get_procfs_value    = (bpf_func_id) -8;
 const bpf_func_id BPF_FUNC_str_concat          = (bpf_func_id) -9;
 const bpf_func_id BPF_FUNC_text_str            = (bpf_func_id) -10;
 const bpf_func_id BPF_FUNC_string_quoted       = (bpf_func_id) -11;
+const bpf_func_id BPF_FUNC_print_stackid       = (bpf_func_id) -12;
 
 struct insn
 {
@@ -549,6 +551,7 @@ struct globals
   {
     EXIT = 0,
     ERRORS, // Tracks the total number of errors.
+    DROPS, // Tracks transport messages lost to a full ring buffer.
     NUM_INTERNALS, // non-ABI
   };
 
@@ -561,6 +564,19 @@ struct globals
   // at translation time and must be determined by the stapbpf loader:
   static const int NUM_CPUS_PLACEHOLDER = 0;
 
+  // When the target kernel supports it, the perf_event_map is instead
+  // a BPF_MAP_TYPE_RINGBUF of this many bytes, shared by all CPUs.
+  // Each message sent through it is prefixed with the sending CPU:
+  bool ringbuf_transport = false;
+  static const unsigned RINGBUF_TRANSPORT_SIZE = 256 * 1024;
+
+  // Index into globals of the BPF_MAP_TYPE_STACK_TRACE map filled by
+  // backtrace() and ubacktrace(), or -1 until either is first used.
+  // stapbpf symbolizes the stacks when print_stack() is called:
+  map_idx stack_map_idx = -1;
+  static const unsigned STACK_MAP_DEPTH = 127; // PERF_MAX_STACK_DEPTH
+  static const unsigned STACK_MAP_ENTRIES = 16384;
+
   // Types of transport messages supported:
   enum perf_event_type
   {
@@ -241,8 +241,6 @@ struct bpf_unparser : public throwing_visitor
   // visit_perf_op -> ?? should already be handled in earlier pass
 
   // TODO: Other bpf functionality to take advantage of in tapsets, or as alternate implementations:
-  // - backtrace.stp :: BPF_MAP_TYPE_STACKTRACE + bpf_getstackid
-  // - BPF_MAP_TYPE_LRU_HASH :: for size-limited maps
   // - BPF_MAP_GET_NEXT_KEY :: for user-space iteration through maps
   // see https://ferrisellis.com/posts/ebpf_syscall_and_maps/#ebpf-map-types
 
@@ -262,6 +260,7 @@ struct bpf_unparser : public throwing_visitor
 
   void emit_transport_msg(globals::perf_event_type msg,
                           value *arg = NULL, exp_type format_type = pe_unknown);
+  void emit_transport_drop_count();
   value *emit_functioncall(functiondecl *f, const std::vector<value *> &args);
   value *emit_print_format(const std::string &format,
                            const std::vector<value *> &actual,
@@ -839,7 +838,9 @@ bpf_unparser::emit_store(expression *e, value *val)
    <optreg> ::= <reg> | -
    <reg>    ::= <register index> | r<register index> | $ctx
                 $<identifier> | $<integer constant> | $$ | <string constant>
-   <imm>    ::= <integer constant> | BPF_MAXSTRINGLEN | BPF_F_CURRENT_CPU | -
+                | BPF_STACK_MAP
+   <imm>    ::= <integer constant> | BPF_MAXSTRINGLEN | BPF_F_CURRENT_CPU
+                | BPF_F_USER_STACK | -
    <off>    ::= <imm> | <jump label>
 
 */
@@ -1486,7 +1487,8 @@ bpf_unparser::emit_asm_arg (const asm_stmt &stmt, const std::string &arg,
       std::string str = translate_escapes(escaped_str, stmt.tok);
       return emit_literal_string(str, stmt.tok);
     }
-  else if (arg == "BPF_MAXSTRINGLEN" || arg == "BPF_F_CURRENT_CPU")
+  else if (arg == "BPF_MAXSTRINGLEN" || arg == "BPF_F_CURRENT_CPU"
+           || arg == "BPF_F_USER_STACK")
     {
       /* arg is a system constant */
       if (!allow_imm)
@@ -1494,9 +1496,26 @@ bpf_unparser::emit_asm_arg (const asm_stmt &stmt, const std::string &arg,
                                  arg.c_str()), stmt.tok);
       if (arg == "BPF_MAXSTRINGLEN")
         return this_prog.new_imm(BPF_MAXSTRINGLEN);
+      else if (arg == "BPF_F_USER_STACK")
+        return this_prog.new_imm(BPF_F_USER_STACK);
       else // arg == "BPF_F_CURRENT_CPU"
         return this_prog.new_imm(BPF_F_CURRENT_CPU);
     }
+  else if (arg == "BPF_STACK_MAP")
+    {
+      if (!allow_emit)
+        throw SEMANTIC_ERROR (_F("invalid bpf argument %s "
+                                 "(map reference not allowed here)",
+                                 arg.c_str()), stmt.tok);
+
+      /* arg is the stack trace map, see translate_globals() */
+      if (glob.stack_map_idx < 0)
+        throw SEMANTIC_ERROR (_("BUG: bpf stack trace map was not allocated"),
+                              stmt.tok);
+      value *reg = this_prog.new_reg();
+      this_prog.load_map(this_ins, reg, glob.stack_map_idx);
+      return reg;
+    }
   else if (arg == "-")
     {
       /* arg is null a.k.a '0' */
@@ -3833,7 +3852,13 @@ bpf_unparser::emit_transport_msg (globals::perf_event_type msg,
   int msg_ofs = arg_ofs-sizeof(BPF_TRANSPORT_VAL);
   if (msg_ofs % 8 != 0)
     msg_ofs -= (8 - (-msg_ofs) % 8);
-  this_prog.use_tmp_space(-msg_ofs);
+
+  // Kernel-side messages sent through the shared ring buffer carry
+  // the sending CPU in the double word preceding the message type:
+  bool use_ringbuf = glob.ringbuf_transport
+    && this_prog.target == target_kernel_bpf;
+  int cpu_ofs = msg_ofs - 8;
+  this_prog.use_tmp_space(use_ringbuf ? -cpu_ofs : -msg_ofs);
 
   value *frame = this_prog.lookup_reg(BPF_REG_10);
 
@@ -3861,6 +3886,26 @@ bpf_unparser::emit_transport_msg (globals::perf_event_type msg,
   // double word -- XXX verifier forces aligned access
   this_prog.mk_st(this_ins, BPF_DW, frame, msg_ofs, this_prog.new_imm(msg));
 
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+  if (use_ringbuf)
+    {
+      this_prog.mk_call(this_ins, BPF_FUNC_get_smp_processor_id, 0);
+      this_prog.mk_st(this_ins, BPF_DW, frame, cpu_ofs,
+                      this_prog.lookup_reg(BPF_REG_0));
+
+      this_prog.load_map(this_ins, this_prog.lookup_reg(BPF_REG_1),
+                         globals::perf_event_map_idx);
+      this_prog.mk_binary(this_ins, BPF_ADD,
+                          this_prog.lookup_reg(BPF_REG_2),
+                          frame, this_prog.new_imm(cpu_ofs));
+      emit_mov(this_prog.lookup_reg(BPF_REG_3), this_prog.new_imm(-cpu_ofs));
+      emit_mov(this_prog.lookup_reg(BPF_REG_4), this_prog.new_imm(0)); // flags
+      this_prog.mk_call(this_ins, BPF_FUNC_ringbuf_output, 4);
+      emit_transport_drop_count();
+      return;
+    }
+#endif
+
   value *ctx = this_in_arg0 == NULL ? this_prog.new_imm(0) : this_in_arg0;
   emit_mov(this_prog.lookup_reg(BPF_REG_1), ctx); // ctx
   this_prog.load_map(this_ins, this_prog.lookup_reg(BPF_REG_2),
@@ -3874,6 +3919,53 @@ bpf_unparser::emit_transport_msg (globals::perf_event_type msg,
   this_prog.mk_call(this_ins, BPF_FUNC_perf_event_output, 5);
 }
 
+// Unlike perf_event_output, bpf_ringbuf_output fails outright when
+// the buffer is full. Count such lost messages in the DROPS internal
+// global so that stapbpf can report them.
+//
+// XXX: Like the error count, the increment is not atomic, so the
+// count may be low when several CPUs drop messages at once.
+void
+bpf_unparser::emit_transport_drop_count()
+{
+  value *i0 = this_prog.new_imm(0);
+  value *frame = this_prog.lookup_reg(BPF_REG_10);
+  value *r0 = this_prog.lookup_reg(BPF_REG_0);
+  int key_size = 4;
+
+  block *drop_block = this_prog.new_block();
+  block *join_block = this_prog.new_block();
+  this_prog.mk_jcond(this_ins, EQ, r0, i0, join_block, drop_block);
+  set_block(drop_block);
+
+  // Lookup the drop count.
+  this_prog.mk_st(this_ins, BPF_W, frame, -key_size,
+                  this_prog.new_imm(globals::DROPS));
+  this_prog.use_tmp_space(key_size);
+  this_prog.load_map(this_ins, this_prog.lookup_reg(BPF_REG_1),
+                     globals::internal_map_idx);
+  this_prog.mk_binary(this_ins, BPF_ADD, this_prog.lookup_reg(BPF_REG_2),
+                      frame, this_prog.new_imm(-key_size));
+  this_prog.mk_call(this_ins, BPF_FUNC_map_lookup_elem, 2);
+
+  block *increment_block = this_prog.new_block();
+
+  // Check if BPF_FUNC_map_lookup_elem returned nullptr.
+  this_prog.mk_jcond(this_ins, EQ, r0, i0, join_block, increment_block);
+  set_block(increment_block);
+
+  // Increment the drop count in place.
+  value *drops_ptr = this_prog.new_reg();
+  value *drops = this_prog.new_reg();
+  emit_mov(drops_ptr, r0);
+  this_prog.mk_ld(this_ins, BPF_DW, drops, drops_ptr, 0);
+  this_prog.mk_binary(this_ins, BPF_ADD, drops, drops, this_prog.new_imm(1));
+  this_prog.mk_st(this_ins, BPF_DW, drops_ptr, 0, drops);
+  emit_jmp(join_block);
+
+  set_block(join_block);
+}
+
 globals::perf_event_type
 printf_arg_type (value *arg, const print_format::format_component &c)
 {
@@ -4205,6 +4297,20 @@ build_internal_globals(globals& glob)
   glob.maps.push_back
     ({ BPF_MAP_TYPE_HASH, 4, /* NB: value_size */ 8, globals::NUM_INTERNALS, 0 });
 
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+  // Prefer a single ring buffer shared by all CPUs (Linux 5.8+) for
+  // message transport. This is more memory efficient than per-cpu
+  // buffers and lets stapbpf wait on a single fd:
+  systemtap_session &s = *glob.session;
+  if (strverscmp(s.kernel_base_release.c_str(), "5.8") >= 0)
+    {
+      glob.ringbuf_transport = true;
+      glob.maps.push_back
+        ({ BPF_MAP_TYPE_RINGBUF, 0, 0, globals::RINGBUF_TRANSPORT_SIZE, 0 });
+      return;
+    }
+#endif
+
   // PR22330: Use a PERF_EVENT_ARRAY map for message transport:
   glob.maps.push_back
     ({ BPF_MAP_TYPE_PERF_EVENT_ARRAY, 4, 4, globals::NUM_CPUS_PLACEHOLDER, 0 });
@@ -4323,6 +4429,11 @@ translate_globals (globals &glob, systemtap_session& s)
                     globals::bpf_map_def m = {
                       BPF_MAP_TYPE_PERCPU_HASH, 0, 0, 0, 0
                     };
+                    // A wrapping statistics array (global s%[N]) evicts
+                    // its least recently used elements; stapbpf sums the
+                    // per-cpu values of each field when reading them.
+                    if (v->wrap)
+                      m.type = BPF_MAP_TYPE_LRU_PERCPU_HASH;
                     m.key_size = key_size;
                     m.max_entries = max_entries;
                     m.value_size = 8; // XXX: for stat data, sizeof(uint64_t)
@@ -4344,6 +4455,10 @@ translate_globals (globals &glob, systemtap_session& s)
             else
               {
                 globals::bpf_map_def m = { BPF_MAP_TYPE_HASH, 0, 0, 0, 0 };
+                // A wrapping array (global a%[N]) evicts its least
+                // recently used element instead of failing on overflow.
+                if (v->wrap)
+                  m.type = BPF_MAP_TYPE_LRU_HASH;
                 m.key_size = key_size;
 
                 switch (v->type)
@@ -4374,6 +4489,24 @@ translate_globals (globals &glob, systemtap_session& s)
 		  (v, globals::map_slot(this_map, this_idx))));
       assert(ok.second);
     }
+
+  // backtrace() and ubacktrace() share a single stack trace map,
+  // allocated only if a function referring to it survived elaboration:
+  for (auto i = s.functions.begin(); i != s.functions.end(); ++i)
+    {
+      embeddedcode *e = dynamic_cast<embeddedcode *>(i->second->body);
+      if (e && e->code.find("BPF_STACK_MAP") != interned_string::npos)
+        {
+          globals::bpf_map_def m = {
+            BPF_MAP_TYPE_STACK_TRACE, sizeof(uint32_t),
+            globals::STACK_MAP_DEPTH * sizeof(uint64_t),
+            globals::STACK_MAP_ENTRIES, 0
+          };
+          glob.stack_map_idx = glob.maps.size();
+          glob.maps.push_back(m);
+          break;
+        }
+    }
 }
 
 struct BPF_Section
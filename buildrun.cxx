@@ -244,7 +244,8 @@ compile_dyninst (systemtap_session& s)
   vector<string> cmd
     {
       "gcc", "--std=gnu99", s.translated_source, s.symbols_source, "-o", module,
-      "-fvisibility=hidden", "-O2", "-I" + s.runtime_path, "-D__DYNINST__",
+      "-fvisibility=hidden", "-O2", "-I" + s.runtime_path, "-Wa,-I" + s.tmpdir,
+      "-D__DYNINST__",
       "-Wall", WERROR, "-Wno-unused", "-Wno-strict-aliasing",
       "-Wno-pointer-to-int-cast", "-Wno-int-to-pointer-cast",
       "-Wno-pragmas", "-Wno-pointer-sign", "-Wno-format",
@@ -374,6 +375,7 @@ compile_pass (systemtap_session& s)
   output_autoconf(s, o, cs, "autoconf-nameidata.c", "STAPCONF_NAMEIDATA_CLEANUP", NULL);
   output_dual_exportconf(s, o2, "unregister_kprobes", "unregister_kretprobes", "STAPCONF_UNREGISTER_KPROBES");
   output_autoconf(s, o, cs, "autoconf-kprobe-symbol-name.c", "STAPCONF_KPROBE_SYMBOL_NAME", NULL);
+  output_autoconf(s, o, cs, "autoconf-fprobe.c", "STAPCONF_FPROBE", NULL);
   output_autoconf(s, o, cs, "autoconf-real-parent.c", "STAPCONF_REAL_PARENT", NULL);
   output_autoconf(s, o, cs, "autoconf-uaccess.c", "STAPCONF_LINUX_UACCESS_H", NULL);
   output_autoconf(s, o, cs, "autoconf-oneachcpu-retry.c", "STAPCONF_ONEACHCPU_RETRY", NULL);
@@ -697,6 +699,8 @@ compile_pass (systemtap_session& s)
   o << " stap_symbols.o" << endl;
 
   o << s.tmpdir << "/stap_symbols.o: $(STAPCONF_HEADER)" << endl;
+  // stap_symbols.c .incbin's its unwind tables by name from the tmpdir.
+  o << "CFLAGS_stap_symbols.o += -Wa,-I" << s.tmpdir << endl;
 
   // add all stapconf dependencies
   string translated = s.translated_source;
@@ -55,7 +55,8 @@ public:
     s(s),
     curl(0),
     retry(0),
-    location(nullptr) { }
+    location(nullptr),
+    stream_fd(-1) { }
   ~http_client () {if (curl) curl_easy_cleanup(curl);
                    remove_file_or_dir (pem_cert_file.c_str());}
 
@@ -72,11 +73,13 @@ public:
   bool download_pem_cert (const std::string & url, std::string & certs);
   bool post (const string & url, vector<tuple<string, string>> & request_parameters);
   void add_file (std::string filename);
+  void add_zip_stream (const std::string & dir, const std::string & name);
   void add_module (std::string module);
   void get_header_field (const std::string & data, const std::string & field);
   static size_t get_data_shim (void *ptr, size_t size, size_t nitems, void *client);
   static size_t get_file (void *ptr, size_t size, size_t nitems, FILE * stream);
   static size_t get_header_shim (void *ptr, size_t size, size_t nitems, void *client);
+  static size_t read_stream_shim (char *ptr, size_t size, size_t nitems, void *client);
   std::string get_rpmname (std::string & pathname);
   void get_buildid (string fname);
   void get_kernel_buildid (void);
@@ -100,6 +103,10 @@ private:
   int retry;
   std::string *location;
   std::string buildid;
+  // A directory to zip up on the fly as the upload zip_name.
+  std::string zip_dir;
+  std::string zip_name;
+  int stream_fd;
 };
 
 // TODO is there a better way than making this static?
@@ -171,10 +178,22 @@ http_client::get_header (void *ptr, size_t size, size_t nitems)
 size_t
 http_client::get_file (void *ptr, size_t size, size_t nitems, std::FILE * stream)
 {
-  size_t written;
-  written = fwrite (ptr, size, nitems, stream);
-  std::fflush (stream);
-  return written;
+  return fwrite (ptr, size, nitems, stream) * size;
+}
+
+
+// Fill PTR with up to SIZE * NITEMS bytes of a streamed upload
+
+size_t
+http_client::read_stream_shim (char *ptr, size_t size, size_t nitems, void *client)
+{
+  http_client *http = static_cast<http_client *>(client);
+  ssize_t n;
+
+  do
+    n = read (http->stream_fd, ptr, size * nitems);
+  while (n < 0 && errno == EINTR);
+  return n < 0 ? CURL_READFUNC_ABORT : (size_t) n;
 }
 
 
@@ -349,7 +368,8 @@ http_client::download (const std::string & url, http_client::download_type type,
     }
   curl_easy_setopt (curl, CURLOPT_URL, url.c_str ());
   curl_easy_setopt (curl, CURLOPT_NOSIGNAL, 1); //Prevent "longjmp causes uninitialized stack frame" bug
-  curl_easy_setopt (curl, CURLOPT_ACCEPT_ENCODING, "deflate");
+  // Offer every encoding this libcurl can decode.
+  curl_easy_setopt (curl, CURLOPT_ACCEPT_ENCODING, "");
   headers = curl_slist_append (headers, "Accept: */*");
   headers = curl_slist_append (headers, "Content-Type: text/html");
   curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers);
@@ -361,6 +381,7 @@ http_client::download (const std::string & url, http_client::download_type type,
   curl_easy_setopt (curl, CURLOPT_SSL_VERIFYHOST, 0L);
   curl_easy_setopt (curl, CURLOPT_CAINFO, pem_cert_file.c_str());
 
+  std::FILE *File = NULL;
   if (type == json_type)
     {
       curl_easy_setopt (curl, CURLOPT_WRITEDATA, http);
@@ -378,7 +399,14 @@ http_client::download (const std::string & url, http_client::download_type type,
 
       if (s.verbose >= 3)
 	clog << "Downloaded " + filepath << endl;
-      std::FILE *File = std::fopen (filepath.c_str(), "wb");
+      File = std::fopen (filepath.c_str(), "wb");
+      if (File == NULL)
+        {
+          if (report_errors)
+            clog << _F("Unable to create %s: %s", filepath.c_str(), strerror (errno)) << endl;
+          curl_slist_free_all (headers);
+          return false;
+        }
       curl_easy_setopt (curl, CURLOPT_WRITEDATA, File);
       curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, http_client::get_file);
     }
@@ -386,6 +414,9 @@ http_client::download (const std::string & url, http_client::download_type type,
   curl_easy_setopt (curl, CURLOPT_HEADERFUNCTION, http_client::get_header_shim);
 
   CURLcode res = curl_easy_perform (curl);
+  curl_slist_free_all (headers);
+  if (File && std::fclose (File) != 0 && res == CURLE_OK)
+    res = CURLE_WRITE_ERROR;
 
   if (cleanup)
     {
@@ -713,6 +744,34 @@ http_client::post (const string & url,
                     CURLFORM_END);
     }
 
+  // Zip up zip_dir straight into the request, rather than into a
+  // file to be uploaded afterwards.
+  pid_t zip_pid = -1;
+  if (! zip_dir.empty ())
+    {
+      vector<string> zip_cmd { "sh", "-c", "cd " + cmdstr_quoted (zip_dir)
+                               + " && exec zip -qr - . -x 'pem*'" };
+      zip_pid = stap_spawn_piped (s.verbose, zip_cmd, NULL, &stream_fd);
+      if (zip_pid <= 0)
+        {
+          clog << _("Unable to start zip") << endl;
+          curl_formfree (formpost);
+          json_object_put (jobj);
+          return false;
+        }
+      curl_formadd (&formpost, &lastptr,
+                    CURLFORM_COPYNAME, zip_name.c_str(),
+                    CURLFORM_STREAM, this,
+                    CURLFORM_FILENAME, zip_name.c_str(),
+                    CURLFORM_CONTENTTYPE, "application/zip",
+                    CURLFORM_END);
+      curl_formadd (&formpost, &lastptr,
+                    CURLFORM_COPYNAME, "files",
+                    CURLFORM_COPYCONTENTS, zip_name.c_str(),
+                    CURLFORM_END);
+      curl_easy_setopt (curl, CURLOPT_READFUNCTION, read_stream_shim);
+    }
+
   // Add package info
   //   "file_info": [ { "file_pkg": "kernel-4.14.0-0.rc4.git4.1.fc28.x86_64",
   //                       "file_name": "kernel",
@@ -767,11 +826,15 @@ http_client::post (const string & url,
   json_object_put(jobj);
 
   headers = curl_slist_append (headers, "Expect:");
+  // The streamed zip's length isn't known up front.
+  if (zip_pid > 0)
+    headers = curl_slist_append (headers, "Transfer-Encoding: chunked");
 
   curl_easy_setopt (curl, CURLOPT_URL, url.c_str());
   curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers);
   curl_easy_setopt (curl, CURLOPT_HTTPPOST, formpost);
 
+  bool ok = true;
   CURLM *multi_handle = curl_multi_init();
   curl_multi_add_handle (multi_handle, curl);
   curl_multi_perform (multi_handle, &still_running);
@@ -811,7 +874,8 @@ http_client::post (const string & url,
       if (mc != CURLM_OK)
         {
           clog << "curl_multi_fdset() failed" << curl_multi_strerror (mc) << endl;
-          return false;
+          ok = false;
+          break;
         }
 
       /* On success the value of maxfd is guaranteed to be >= -1. We call
@@ -843,7 +907,18 @@ http_client::post (const string & url,
   curl_formfree (formpost);
   curl_slist_free_all (headers);
 
-  return true;
+  if (zip_pid > 0)
+    {
+      close (stream_fd);
+      stream_fd = -1;
+      if (stap_waitpid (s.verbose, zip_pid) != 0)
+        {
+          clog << _F("Unable to zip %s", zip_dir.c_str()) << endl;
+          ok = false;
+        }
+    }
+
+  return ok;
 }
 
 
@@ -855,6 +930,16 @@ http_client::add_file (std::string filename)
 }
 
 
+// Send DIR as a zip named NAME, created while the request is sent
+
+void
+http_client::add_zip_stream (const std::string & dir, const std::string & name)
+{
+  zip_dir = dir;
+  zip_name = name;
+}
+
+
 // Add MODULE to modules
 
 void
@@ -1129,18 +1214,10 @@ http_client_backend::package_request ()
 	}
     }
 
-  // Package up the temporary directory into a zip file, if needed.
+  // Package up the temporary directory, if needed.  It is zipped
+  // straight into the request as it is sent.
   if (files_seen)
-    {
-      string client_zipfile = client_tmpdir + ".zip";
-      string cmd = "cd " + cmdstr_quoted(client_tmpdir) + " && zip -qr "
-	  + cmdstr_quoted(client_zipfile) + " *";
-      vector<string> sh_cmd { "sh", "-c", cmd };
-      rc = stap_system (s.verbose, sh_cmd);
-
-      if (rc == 0)
-	http->add_file(client_zipfile);
-    }
+    http->add_zip_stream (client_tmpdir, "client.zip");
   return rc;
 }
 
@@ -1244,6 +1321,7 @@ http_client_backend::unpack_response ()
 
   if (s.verbose >= 2)
     clog << "Initial response code: " << http->get_response_code() << endl;
+  string progress;
   while (true)
     {
       auto it = http->header_values.find("Retry-After");
@@ -1264,7 +1342,25 @@ http_client_backend::unpack_response ()
 	  if (s.verbose >= 2)
 	    clog << "Response code: " << response_code << endl;
 	  if (response_code == 200)
-	    continue;
+	    {
+	      // Report how the build is getting on, if the server says.
+	      json_object *status_obj, *progress_obj;
+	      if (s.verbose >= 2
+		  && json_object_object_get_ex (http->root, "status", &status_obj))
+		{
+		  string p = json_object_get_string (status_obj);
+		  if (json_object_object_get_ex (http->root, "progress", &progress_obj))
+		    {
+		      string pass = json_object_get_string (progress_obj);
+		      if (! pass.empty ())
+			p += ": " + pass;
+		    }
+		  if (p != progress)
+		    clog << "Server build " << p << endl;
+		  progress = p;
+		}
+	      continue;
+	    }
 	  else if (response_code == 303)
 	    break;
 	  else
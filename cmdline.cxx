@@ -31,6 +31,7 @@ struct option stap_long_options[] = {
   { "sign-module",                 optional_argument, NULL, LONG_OPT_SIGN_MODULE },
   { "remote",                      required_argument, NULL, LONG_OPT_REMOTE },
   { "remote-prefix",               no_argument,       NULL, LONG_OPT_REMOTE_PREFIX },
+  { "remote-jobs",                 required_argument, NULL, LONG_OPT_REMOTE_JOBS },
   { "check-version",               no_argument,       NULL, LONG_OPT_CHECK_VERSION },
   { "version",                     no_argument,       NULL, LONG_OPT_VERSION },
   { "tmpdir",                      required_argument, NULL, LONG_OPT_TMPDIR },
@@ -38,6 +38,7 @@ enum {
   LONG_OPT_USE_SERVER_ON_ERROR,
   LONG_OPT_VERSION,
   LONG_OPT_REMOTE_PREFIX,
+  LONG_OPT_REMOTE_JOBS,
   LONG_OPT_TMPDIR,
   LONG_OPT_DOWNLOAD_DEBUGINFO,
   LONG_OPT_DUMP_PROBE_TYPES,
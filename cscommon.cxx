@@ -22,13 +22,16 @@
 #include <cstring>
 #include <cassert>
 #include <iomanip>
+#include <algorithm>
 
 extern "C"
 {
 #include <ssl.h>
+#include <sechash.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <utime.h>
 }
 
 using namespace std;
@@ -133,6 +136,85 @@ string get_cert_serial_number (const CERTCertificate *cert)
   return serialNumber.str ();
 }
 
+// sign-file appends the signature to the module, and the same module
+// signed with the same key always gets the same signature.  So each
+// MOK directory keeps the appended tails of recently signed modules,
+// named by the SHA256 of the unsigned module, and a module that comes
+// back (e.g. from the script cache) is signed by re-appending its tail.
+#define MOK_SIGNATURE_CACHE_DIR "/signatures"
+#define MOK_SIGNATURE_CACHE_MAX 256
+
+static string
+module_sha256 (const string &name, off_t &size)
+{
+  HASHContext *ctx = HASH_Create (HASH_AlgSHA256);
+  if (! ctx)
+    return "";
+  HASH_Begin (ctx);
+
+  ifstream f (name.c_str (), ios::binary);
+  char buf[65536];
+  size = 0;
+  while (f.read (buf, sizeof (buf)) || f.gcount () > 0)
+    {
+      HASH_Update (ctx, (const unsigned char *) buf, f.gcount ());
+      size += f.gcount ();
+    }
+  bool ok = f.eof ();
+
+  unsigned char digest[HASH_LENGTH_MAX];
+  unsigned len = 0;
+  HASH_End (ctx, digest, &len, sizeof (digest));
+  HASH_Destroy (ctx);
+  if (! ok)
+    return "";
+
+  ostringstream o;
+  o << hex << setfill ('0');
+  for (unsigned i = 0; i < len; i++)
+    o << setw (2) << (unsigned) digest[i];
+  return o.str ();
+}
+
+// Copy bytes [offset, EOF) of src to the end of dest.
+static bool
+append_file_tail (const string &src, off_t offset, const string &dest)
+{
+  ifstream in (src.c_str (), ios::binary);
+  ofstream out (dest.c_str (), ios::binary | ios::app);
+  if (! in.good () || ! out.good () || ! in.seekg (offset))
+    return false;
+  out << in.rdbuf ();
+  out.close ();
+  return ! out.fail ();
+}
+
+static void
+prune_signature_cache (const string &cache_dir)
+{
+  DIR *d = opendir (cache_dir.c_str ());
+  if (! d)
+    return;
+  vector<pair<time_t, string> > entries;
+  struct dirent *e;
+  while ((e = readdir (d)) != NULL)
+    {
+      if (e->d_name[0] == '.')
+        continue;
+      string path = cache_dir + "/" + e->d_name;
+      struct stat st;
+      if (stat (path.c_str (), &st) == 0)
+        entries.push_back (make_pair (st.st_mtime, path));
+    }
+  closedir (d);
+
+  if (entries.size () <= MOK_SIGNATURE_CACHE_MAX)
+    return;
+  sort (entries.begin (), entries.end ());
+  for (size_t i = 0; i < entries.size () - MOK_SIGNATURE_CACHE_MAX; i++)
+    unlink (entries[i].second.c_str ());
+}
+
 int
 mok_sign_file (const std::string &mok_fingerprint,
 	       const std::string &mok_path,
@@ -140,6 +222,27 @@ mok_sign_file (const std::string &mok_fingerprint,
 	       const std::string &name)
 {
   string mok_directory = mok_path + "/" + mok_fingerprint;
+  string cache_dir = mok_directory + MOK_SIGNATURE_CACHE_DIR;
+  string cached;
+  off_t unsigned_size = 0;
+
+  string digest = module_sha256 (name, unsigned_size);
+  if (! digest.empty ())
+    {
+      cached = cache_dir + "/" + digest;
+      if (file_exists (cached))
+        {
+          if (append_file_tail (cached, 0, name))
+            {
+              // Bump the mtime, which is what pruning goes by.
+              utime (cached.c_str (), NULL);
+              return 0;
+            }
+          // A failed append may have left part of a signature behind.
+          if (truncate (name.c_str (), unsigned_size) != 0)
+            return 1;
+        }
+    }
 
   vector<string> cmd
     {
@@ -150,7 +253,26 @@ mok_sign_file (const std::string &mok_fingerprint,
       name
     };
 
-  return stap_system (0, cmd);
+  int rc = stap_system (0, cmd);
+  if (rc != 0 || cached.empty ())
+    return rc;
+
+  // Save the new signature.  Concurrent signers may race to create
+  // the same entry, so write it privately and rename it into place.
+  if (! dir_exists (cache_dir) && create_dir (cache_dir.c_str (), 0700) != 0)
+    return rc;
+  string tmp = cached + ".XXXXXX";
+  int fd = mkstemp (&tmp[0]);
+  if (fd < 0)
+    return rc;
+  close (fd);
+  if (append_file_tail (name, unsigned_size, tmp)
+      && rename (tmp.c_str (), cached.c_str ()) == 0)
+    prune_signature_cache (cache_dir);
+  else
+    unlink (tmp.c_str ());
+
+  return rc;
 }
 
 
@@ -140,8 +140,13 @@ module_info
   std::set<interned_string> plt_funcs;
   std::set<std::pair<std::string,std::string> > marks; /* <provider,name> */
 
+  info_status ftrace_status;    // ftrace sites cached?
+  std::vector<Dwarf_Addr> ftrace_sites; // sorted __mcount_loc entries
+
   void get_symtab();
   void update_symtab(cu_function_cache_t *funcs);
+  void get_ftrace_sites();
+  bool ftrace_entry_p(Dwarf_Addr entrypc);
 
   module_info(const char *name) :
     mod(NULL),
@@ -150,7 +155,8 @@ module_info
     bias(0),
     sym_table(NULL),
     dwarf_status(info_unknown),
-    symtab_status(info_unknown)
+    symtab_status(info_unknown),
+    ftrace_status(info_unknown)
   {}
 
   ~module_info();
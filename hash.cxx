@@ -390,4 +390,31 @@ find_uprobes_hash (systemtap_session& s)
   return hashdir + "/uprobes_" + result;
 }
 
+
+string
+find_unwindsym_hash (systemtap_session& s, const string& modname,
+                     const string& build_id)
+{
+  stap_hash h(get_base_hash(s));
+
+  // The extracted data depends only on the module's contents, which
+  // the build-id identifies, and on what kinds of data are needed:
+  h.add("Unwindsym Module: ", modname);
+  h.add("Unwindsym Build-id: ", build_id);
+  h.add("Sysroot: ", s.sysroot);
+  h.add("Need symbols: ", s.need_symbols);
+  h.add("Need unwind: ", s.need_unwind);
+  h.add("Need lines: ", s.need_lines);
+
+  // Get the directory path to store our cached data
+  string result, hashdir;
+  h.result(result);
+  if (!create_hashdir(s, result, hashdir))
+    return "";
+
+  create_hash_log(string("unwindsym_hash"), h.get_parms(), result,
+                  hashdir + "/unwindsym_" + result + "_hash.log");
+  return hashdir + "/unwindsym_" + result + ".dat";
+}
+
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
@@ -10,5 +10,8 @@ std::string find_tracequery_hash (systemtap_session& s,
                                   const std::string& header);
 std::string find_typequery_hash (systemtap_session& s, const std::string& name);
 std::string find_uprobes_hash (systemtap_session& s);
+std::string find_unwindsym_hash (systemtap_session& s,
+                                 const std::string& modname,
+                                 const std::string& build_id);
 
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
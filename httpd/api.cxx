@@ -11,12 +11,19 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <deque>
+#include <thread>
+#include <condition_variable>
 #include "../util.h"
 #include "backends.h"
 #include "../cmdline.h"
 #include "utils.h"
+#include "nss_funcs.h"
 #include "../nsscommon.h"
 #include "../privilege.h"
+#include "../mdfour.h"
 
 extern "C" {
 #include <unistd.h>
@@ -29,12 +36,20 @@ extern "C" {
 #include <glob.h>
 #include <sched.h>
 #include <limits.h>
+#include <dirent.h>
+#include <utime.h>
 }
 
 using namespace std;
 
 static server *httpd = NULL;
 
+// Completed builds are kept in cache_dir, up to max_cache_entries.
+// Entries are keyed by server version too, so ones left over from an
+// older server are never served and just age out.
+static string cache_dir;
+static unsigned max_cache_entries;
+
 struct result_file_info
 {
     string path;
@@ -111,6 +126,12 @@ public:
     void generate_response(response &r);
     void generate_file_response(response &r, string &f);
 
+    bool succeeded()
+    {
+	lock_guard<mutex> lock(res_mutex);
+	return status_code == 0 && rc == 0;
+    }
+
     void add_file(string &path, mode_t mode)
     {
 	size_t found = path.find_last_of("/");
@@ -142,18 +163,34 @@ protected:
 
 static void result_infos_erase(result_info *r);
 
+// Builds are run by a fixed pool of worker threads, taking them from
+// build_queue in order.
+static mutex build_queue_mutex;
+static condition_variable build_queue_cv;
+static condition_variable build_done_cv;
+
+class build_info;
+static deque<build_info *> build_queue;
+static vector<thread> build_workers;
+static bool build_workers_stop = false;
+
 class build_info : public resource
 {
 public:
-    build_info(client_request_data *crd)
-	: resource("/builds/"), crd(crd), builder_thread_running(false),
-	  result(NULL) { }
+    build_info(client_request_data *crd, const string &key)
+	: resource("/builds/"), key(key), refs(1), crd(crd),
+	  build_started(false), build_running(false), result(NULL) { }
 
     ~build_info()
     {
-	if (builder_thread_running) {
-	    pthread_join(builder_tid, NULL);
-	    builder_thread_running = false;
+	{
+	    // Take this build off the queue, or wait for the worker
+	    // running it to finish.
+	    unique_lock<mutex> lock(build_queue_mutex);
+	    auto it = find(build_queue.begin(), build_queue.end(), this);
+	    if (it != build_queue.end())
+		build_queue.erase(it);
+	    build_done_cv.wait(lock, [this]{ return !build_running; });
 	}
 	if (result) {
 	    // If this build has an associated result, be sure to delete it
@@ -170,6 +207,8 @@ public:
 
     void generate_response(response &r);
     void start_module_build();
+    bool load_cached_result();
+    static void build_worker();
 
     bool is_build_finished()
     {
@@ -179,18 +218,35 @@ public:
 	return (result != NULL);
     }
 
+    // Can an identical request share this build?  Only if it is still
+    // in progress or went well; failures are retried.
+    bool is_reusable()
+    {
+	lock_guard<mutex> lock(res_mutex);
+	return result == NULL || result->succeeded();
+    }
+
+    // The request hash (empty if unknown), and how many clients are
+    // using this build.  Both are protected by builds_mutex.
+    const string key;
+    unsigned refs;
+
 private:
     client_request_data *crd;
 
-    bool builder_thread_running;
-    pthread_t builder_tid;
+    // Protected by build_queue_mutex.
+    bool build_started;
+    bool build_running;
 
     void parse_cmd_args(void);
-    static void *module_build_shim(void *arg);
-    void *module_build();
+    void module_build();
     result_info *result;
 
     void set_result(result_info *ri);
+    void store_cached_result(const string &stdout_path,
+			     const string &stderr_path,
+			     const string &module_path,
+			     const string &module_sign_path);
 };
 
 void result_info::generate_response(response &r)
@@ -284,9 +340,29 @@ void result_info::generate_file_response(response &r, string &file)
     }
 }
 
+// The last "Pass N: ..." line stap has written to PATH so far.
+static string
+get_pass_progress(const string &path)
+{
+    ifstream f(path);
+    string line, progress;
+    while (getline(f, line)) {
+	if (line.compare(0, 5, "Pass ") == 0)
+	    progress = line;
+    }
+    return progress;
+}
+
 void build_info::generate_response(response &r)
 {
     ostringstream os;
+    string status;
+    {
+	// Use a lock_guard to ensure the mutex gets released even if an
+	// exception is thrown.
+	lock_guard<mutex> lock(build_queue_mutex);
+	status = build_running ? "running" : "queued";
+    }
 
     r.content_type = "application/json";
     os << "{" << endl;
@@ -296,7 +372,10 @@ void build_info::generate_response(response &r)
 	lock_guard<mutex> lock(res_mutex);
 
 	if (result == NULL) {
+	    // Ask the client to check back soon; builds are often quick
+	    // (or cached).
 	    r.status_code = 200;
+	    r.headers["Retry-After"] = "1";
 	}
 	else {
 	    r.status_code = 303;
@@ -307,6 +386,17 @@ void build_info::generate_response(response &r)
 	os << "  \"uuid\": \"" << uuid_str << "\"," << endl;
 	os << "  \"kver\": \"" << crd->kver << "\"," << endl;
 	os << "  \"arch\": \"" << crd->arch << "\"," << endl;
+	if (result == NULL) {
+	    os << "  \"status\": \"" << status << "\"," << endl;
+	    struct json_object *j = json_object_new_string(
+		get_pass_progress(crd->server_dir + "/stderr").c_str());
+	    if (j) {
+		os << "  \"progress\": "
+		   << json_object_to_json_string_ext(j, JSON_C_TO_STRING_PLAIN)
+		   << "," << endl;
+		json_object_put(j);
+	    }
+	}
 
 	os << "  \"cmd_args\": [" << endl;
 	bool first = true;
@@ -331,22 +421,266 @@ void build_info::generate_response(response &r)
 
 void build_info::start_module_build()
 {
-    {
-	// Use a lock_guard to ensure the mutex gets released even if an
-	// exception is thrown.
-	lock_guard<mutex> lock(res_mutex);
-	if (builder_thread_running) {
-	    // This really shouldn't happen. Error out.
-	    server_error("Multiple attempts to build module.");
-	    return;
+    // Use a lock_guard to ensure the mutex gets released even if an
+    // exception is thrown.
+    lock_guard<mutex> lock(build_queue_mutex);
+    if (build_started) {
+	// This really shouldn't happen. Error out.
+	server_error("Multiple attempts to build module.");
+	return;
+    }
+    build_started = true;
+
+    // Hand the build to the worker pool.
+    build_queue.push_back(this);
+    server_error(_F("Build %s queued (%zu waiting)", uuid_str.c_str(),
+		    build_queue.size()));
+    build_queue_cv.notify_one();
+}
+
+void build_info::build_worker()
+{
+    unique_lock<mutex> lock(build_queue_mutex);
+    while (true) {
+	build_queue_cv.wait(lock, []{
+		return build_workers_stop || !build_queue.empty(); });
+	if (build_workers_stop)
+	    break;
+
+	build_info *b = build_queue.front();
+	build_queue.pop_front();
+	b->build_running = true;
+
+	lock.unlock();
+	b->module_build();
+	lock.lock();
+
+	b->build_running = false;
+	build_done_cv.notify_all();
+    }
+}
+
+static void
+hash_string(struct mdfour *md4, const string &str)
+{
+    // Include the NUL, so adjacent strings can't run together.
+    mdfour_update(md4, (const unsigned char *)str.c_str(), str.size() + 1);
+}
+
+static void
+hash_stat(struct mdfour *md4, const string &path)
+{
+    ostringstream os;
+    struct stat st;
+    os << path;
+    if (stat(path.c_str(), &st) == 0)
+	os << ':' << st.st_ino << ':' << st.st_size << ':' << st.st_mtime;
+    hash_string(md4, os.str());
+}
+
+// Hash the names of everything under dir, in a fixed order, along with
+// the contents of the regular files (or just their stat info, if
+// contents is false).
+static bool
+hash_tree(struct mdfour *md4, const string &dir, const string &prefix,
+	  bool contents)
+{
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+	return false;
+    vector<string> names;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+	if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+	    names.push_back(de->d_name);
+    }
+    closedir(d);
+    sort(names.begin(), names.end());
+
+    for (auto it = names.begin(); it != names.end(); ++it) {
+	string path = dir + "/" + *it;
+	struct stat st;
+	if (lstat(path.c_str(), &st) != 0)
+	    return false;
+	if (S_ISDIR(st.st_mode)) {
+	    if (!hash_tree(md4, path, prefix + *it + "/", contents))
+		return false;
+	}
+	else if (S_ISLNK(st.st_mode)) {
+	    char target[PATH_MAX];
+	    ssize_t len = readlink(path.c_str(), target, sizeof(target) - 1);
+	    target[len > 0 ? len : 0] = '\0';
+	    hash_string(md4, prefix + *it + " -> " + target);
+	}
+	else if (S_ISREG(st.st_mode) && !contents) {
+	    hash_stat(md4, path);
+	}
+	else if (S_ISREG(st.st_mode)) {
+	    hash_string(md4, prefix + *it);
+	    ifstream f(path.c_str(), ios::binary);
+	    if (!f)
+		return false;
+	    char buf[4096];
+	    while (f.read(buf, sizeof(buf)) || f.gcount() > 0)
+		mdfour_update(md4, (const unsigned char *)buf, f.gcount());
+	}
+    }
+    return true;
+}
+
+// Hash everything about a request that goes into its result: the
+// target, the stap command line and environment, the files sent along
+// (client.zip by what it unpacked to, since the zip itself carries
+// timestamps), and what the server brings: its version, translator,
+// tapsets and signing certificate.  Returns an empty string if the
+// request can't be hashed.
+static string
+get_request_key(const client_request_data *crd)
+{
+    struct mdfour md4;
+    mdfour_begin(&md4);
+
+    hash_string(&md4, "version:" VERSION);
+    hash_stat(&md4, BINDIR "/stap");
+    if (!hash_tree(&md4, PKGDATADIR "/tapset", "tapset/", false))
+	return "";
+    string cert_serial, cert_pem;
+    nss_get_server_cert_info(cert_serial, cert_pem);
+    hash_string(&md4, "cert:" + cert_serial);
+
+    hash_string(&md4, "kver:" + crd->kver);
+    hash_string(&md4, "arch:" + crd->arch);
+    hash_string(&md4, "distro:" + crd->distro_name + ' ' + crd->distro_version);
+    for (auto it = crd->cmd_args.begin(); it != crd->cmd_args.end(); ++it)
+	hash_string(&md4, "arg:" + *it);
+    for (auto it = crd->env_vars.begin(); it != crd->env_vars.end(); ++it)
+	hash_string(&md4, "env:" + *it);
+    for (auto it = crd->file_info.begin(); it != crd->file_info.end(); ++it)
+	hash_string(&md4, "file_info:" + (*it)->name + ' ' + (*it)->pkg + ' '
+		    + (*it)->build_id);
+    for (auto it = crd->files.begin(); it != crd->files.end(); ++it) {
+	if (*it == "client.zip") {
+	    if (!hash_tree(&md4, crd->client_dir, "client/", true))
+		return "";
+	    continue;
 	}
-	builder_thread_running = true;
+	string hash;
+	if (get_file_hash(crd->server_dir + "/" + *it, hash) != 0)
+	    return "";
+	hash_string(&md4, "file:" + *it + ' ' + hash);
     }
 
-    /* Create a thread to handle the module build. */
-    if (pthread_create(&builder_tid, NULL, module_build_shim, this) < 0) {
-	server_error(_F("Failed to create thread: %s", strerror(errno)));
-	exit(1);
+    unsigned char sum[16];
+    mdfour_update(&md4, NULL, 0);
+    mdfour_result(&md4, sum);
+
+    ostringstream key;
+    key << hex << setfill('0');
+    for (int i = 0; i < 16; i++)
+	key << setw(2) << (unsigned)sum[i];
+    return key.str();
+}
+
+// Serve this build from the on-disk cache, if we've done it before.
+bool
+build_info::load_cached_result()
+{
+    if (key.empty() || max_cache_entries == 0)
+	return false;
+    string entry = cache_dir + "/" + key;
+
+    glob_t globber;
+    string pattern = entry + "/*.ko";
+    if (glob(pattern.c_str(), GLOB_ERR, NULL, &globber) != 0)
+	return false;
+    vector<string> modules(globber.gl_pathv,
+			   globber.gl_pathv + globber.gl_pathc);
+    globfree(&globber);
+    if (modules.size() != 1)
+	return false;
+
+    // Copy the cached files, so they stay valid for as long as this
+    // build does even if the entry is evicted.
+    string module_name = modules[0].substr(entry.size() + 1);
+    string stdout_path = crd->server_dir + "/stdout";
+    string stderr_path = crd->server_dir + "/stderr";
+    string module_path = crd->client_dir + "/" + module_name;
+    string module_sign_path = module_path + ".sgn";
+    if (!copy_file(entry + "/stdout", stdout_path)
+	|| !copy_file(entry + "/stderr", stderr_path)
+	|| !copy_file(entry + "/" + module_name, module_path))
+	return false;
+    if (!copy_file(entry + "/" + module_name + ".sgn", module_sign_path))
+	module_sign_path.clear();
+
+    // Touch the entry, for eviction.
+    utime(entry.c_str(), NULL);
+
+    result_info *ri = new result_info(0, stdout_path, stderr_path);
+    struct stat stbuf;
+    if (stat(module_path.c_str(), &stbuf) == 0)
+	ri->add_file(module_path, stbuf.st_mode & 07777);
+    if (!module_sign_path.empty() && stat(module_sign_path.c_str(), &stbuf) == 0)
+	ri->add_file(module_sign_path, stbuf.st_mode & 07777);
+    server_error(_F("Build %s served from cache entry %s", uuid_str.c_str(),
+		    key.c_str()));
+    set_result(ri);
+    return true;
+}
+
+// Remember a successful build in the on-disk cache, and drop the least
+// recently used entries beyond max_cache_entries.
+void
+build_info::store_cached_result(const string &stdout_path,
+				const string &stderr_path,
+				const string &module_path,
+				const string &module_sign_path)
+{
+    if (key.empty() || max_cache_entries == 0)
+	return;
+
+    // Fill in a private directory, then rename it into place, so
+    // load_cached_result() never sees a partial entry.
+    string tmp = cache_dir + "/.tmp-" + get_uuid_str();
+    string entry = cache_dir + "/" + key;
+    string module_name = module_path.substr(module_path.find_last_of('/') + 1);
+    if (create_dir(tmp.c_str(), 0700) != 0)
+	return;
+    if (copy_file(stdout_path, tmp + "/stdout")
+	&& copy_file(stderr_path, tmp + "/stderr")
+	&& copy_file(module_path, tmp + "/" + module_name)
+	&& (module_sign_path.empty()
+	    || copy_file(module_sign_path, tmp + "/" + module_name + ".sgn"))
+	&& rename(tmp.c_str(), entry.c_str()) == 0) {
+	server_error(_F("Build %s stored as cache entry %s", uuid_str.c_str(),
+			key.c_str()));
+    }
+    else {
+	vector<string> cleanupcmd { "rm", "-rf", tmp };
+	(void)stap_system(0, cleanupcmd);
+	return;
+    }
+
+    // Evict.
+    DIR *d = opendir(cache_dir.c_str());
+    if (!d)
+	return;
+    vector<pair<time_t, string> > entries;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+	struct stat stbuf;
+	string path = cache_dir + "/" + de->d_name;
+	if (de->d_name[0] != '.' && stat(path.c_str(), &stbuf) == 0
+	    && S_ISDIR(stbuf.st_mode))
+	    entries.push_back(make_pair(stbuf.st_mtime, path));
+    }
+    closedir(d);
+    if (entries.size() <= max_cache_entries)
+	return;
+    sort(entries.begin(), entries.end());
+    for (size_t i = 0; i < entries.size() - max_cache_entries; i++) {
+	vector<string> cleanupcmd { "rm", "-rf", entries[i].second };
+	(void)stap_system(0, cleanupcmd);
     }
 }
 
@@ -503,23 +837,64 @@ response build_collection_rh::POST(const request &req)
 	return error400;
     }
 
-    // Create a build with the information we've gathered.
-    build_info *b = new build_info(crd);
-    {
+    // The client can optionally send over a "client.zip" file.  Unzip
+    // it now, so the request is keyed by what it holds.
+    if (find(crd->files.begin(), crd->files.end(), "client.zip")
+	!= crd->files.end()) {
+	string zip_path = crd->server_dir + "/client.zip";
+	vector<string> zip_argv = { "unzip", "-q", "-d", crd->client_dir,
+				    zip_path };
+	int rc = stap_system (2, zip_argv);
+	if (rc != 0) {
+	    // Return an error.
+	    server_error(_F("unzip failed: %d", rc));
+	    delete crd;
+	    response error400(400);
+	    error400.content = "<h1>Bad request</h1>";
+	    return error400;
+	}
+    }
+
+    // If an identical request is being built (or was built
+    // successfully) already, share that build.
+    string key = get_request_key(crd);
+    build_info *b = NULL;
+    if (!key.empty()) {
 	// Use a lock_guard to ensure the mutex gets released even if an
 	// exception is thrown.
 	lock_guard<mutex> lock(builds_mutex);
-	build_infos.push_back(b);
+	for (auto it = build_infos.begin(); it != build_infos.end(); it++) {
+	    if ((*it)->key == key && (*it)->is_reusable()) {
+		b = *it;
+		b->refs++;
+		break;
+	    }
+	}
+    }
+    if (b) {
+	server_error(_F("Request matches build %s", b->get_uuid_str().c_str()));
+	delete crd;
     }
+    else {
+	// Create a build with the information we've gathered.
+	b = new build_info(crd, key);
+	{
+	    // Use a lock_guard to ensure the mutex gets released even if an
+	    // exception is thrown.
+	    lock_guard<mutex> lock(builds_mutex);
+	    build_infos.push_back(b);
+	}
 
-    // Kick off the module build.
-    b->start_module_build();
+	// Kick off the module build, unless we have the result already.
+	if (!b->load_cached_result())
+	    b->start_module_build();
+    }
 
     // Return a 202 response.
     server_error("Returning a 202");
     response resp(202);
     resp.headers["Location"] = b->get_uri();
-    resp.headers["Retry-After"] = "10";
+    resp.headers["Retry-After"] = b->is_build_finished() ? "0" : "1";
     return resp;
 }
 
@@ -566,6 +941,7 @@ response individual_build_rh::DELETE(const request &req)
     // just the buildid 'XXXX'.
     string buildid = req.matches[1];
     build_info *b = NULL;
+    bool last = false;
     {
 	// Use a lock_guard to ensure the mutex gets released even if an
 	// exception is thrown.
@@ -573,7 +949,10 @@ response individual_build_rh::DELETE(const request &req)
 	for (auto it = build_infos.begin(); it != build_infos.end(); it++) {
 	    if (buildid == (*it)->get_uuid_str()) {
 		b = *it;
-		build_infos.erase(it);
+		// Other clients may still be using this build.
+		last = (--b->refs == 0);
+		if (last)
+		    build_infos.erase(it);
 		break;
 	    }
 	}
@@ -584,8 +963,10 @@ response individual_build_rh::DELETE(const request &req)
 	return get_404_response();
     }
 
-    // At this point we've found a matching build. Delete it.
-    delete b;
+    // At this point we've found a matching build. Delete it if it
+    // was the last reference.
+    if (last)
+	delete b;
     response rsp(300);
     rsp.content = "";
     return rsp;
@@ -687,14 +1068,6 @@ build_info::set_result(result_info *ri)
     }
 }
 
-void *
-build_info::module_build_shim(void *arg)
-{
-    build_info *bi = static_cast<build_info *>(arg);
-
-    return bi->module_build();
-}
-
 void
 build_info::parse_cmd_args(void)
 {
@@ -775,31 +1148,14 @@ build_info::parse_cmd_args(void)
     server_error(_F("Privilege: %d", crd->privilege));
 }
 
-void *
+void
 build_info::module_build()
 {
     vector<string> argv;
-    bool client_zip_exists = false;
-
-    // The client can optionally send over a "client.zip" file, which
-    // we automatically unzip here.
-    for (auto i = crd->files.begin(); i != crd->files.end(); i++) {
-	if (*i == "client.zip") {
-	    string zip_path = crd->server_dir + "/client.zip";
-	    vector<string> zip_argv = { "unzip", "-q", "-d", crd->client_dir,
-					zip_path };
-	    int rc = stap_system (2, zip_argv);
-	    if (rc != 0) {
-		// Return an error.
-		server_error(_F("unzip failed: %d", rc));
-		result_info *ri = new result_info(400,
-						  "<h1>Bad request</h1>");
-		set_result(ri);
-		return NULL;
-	    }
-	    client_zip_exists = true;
-	}
-    }
+    // Any "client.zip" was unzipped into client_dir when the request
+    // came in.
+    bool client_zip_exists = (find(crd->files.begin(), crd->files.end(),
+				   "client.zip") != crd->files.end());
 
     // Process the command arguments.
     argv.push_back("stap");
@@ -849,7 +1205,7 @@ build_info::module_build()
 	result_info *ri = new result_info(500,
 					  "<h1>Internal server error, unshare failed.</h1>");
 	set_result(ri);
-	return NULL;
+	return;
     }
     if (chdir(crd->client_dir.c_str()) < 0) {
 	// Return an error.
@@ -857,7 +1213,7 @@ build_info::module_build()
 	result_info *ri = new result_info(500,
 					  "<h1>Internal server error, chdir failed.</h1>");
 	set_result(ri);
-	return NULL;
+	return;
     }
 
     // Parse the client's command args.
@@ -892,7 +1248,7 @@ build_info::module_build()
 		     " returning a 501.");
 	result_info *ri = new result_info(501, "<h1>Not implemented.</h1>");
 	set_result(ri);
-	return NULL;
+	return;
     }
 
     // See if we built a module.
@@ -959,7 +1315,10 @@ build_info::module_build()
 	}
     }
     set_result(ri);
-    return NULL;
+
+    if (staprc == 0 && ! module_path.empty())
+	store_cached_result(stdout_path, stderr_path, module_path,
+			    module_sign_path);
 }
 
 client_request_data::~client_request_data()
@@ -1042,6 +1401,16 @@ client_request_data::get_json_object() const
 void api_cleanup()
 {    
     kill_stap_spawn(SIGTERM);
+    {
+	// Use a lock_guard to ensure the mutex gets released even if an
+	// exception is thrown.
+	lock_guard<mutex> lock(build_queue_mutex);
+	build_workers_stop = true;
+	build_queue_cv.notify_all();
+    }
+    for (auto it = build_workers.begin(); it != build_workers.end(); it++)
+	it->join();
+    build_workers.clear();
     {
 	// Use a lock_guard to ensure the mutex gets released even if an
 	// exception is thrown.
@@ -1053,10 +1422,28 @@ void api_cleanup()
     }
 }
 
-void api_add_request_handlers(server &http)
+void api_add_request_handlers(server &http, unsigned build_threads,
+			      unsigned cache_entries)
 {
     // Remember the server.
     httpd = &http;
+
+    // Set up the result cache.
+    max_cache_entries = cache_entries;
+    if (max_cache_entries > 0) {
+	cache_dir = string(get_home_directory()) + "/.systemtap/httpd-cache";
+	if (create_dir(cache_dir.c_str(), 0700) != 0) {
+	    server_error(_F("Unable to create build cache %s: %s",
+			    cache_dir.c_str(), strerror(errno)));
+	    max_cache_entries = 0;
+	}
+    }
+
+    // Start the build workers.
+    if (build_threads == 0)
+	build_threads = 1;
+    for (unsigned i = 0; i < build_threads; i++)
+	build_workers.push_back(thread(build_info::build_worker));
     
     // Add the request handlers.
     http.add_request_handler("/builds$", builds_rh);
@@ -51,7 +51,8 @@ public:
 //api_handler(const char *url, const map<string, string> &url_args,
 //	    const char *method, ostringstream &output);
 
-void api_add_request_handlers(server &httpd);
+void api_add_request_handlers(server &httpd, unsigned build_threads,
+			      unsigned max_cache_entries);
 void api_cleanup();
 
 #endif	/* __API_H__ */
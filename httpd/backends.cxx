@@ -9,6 +9,9 @@
 #include "backends.h"
 #include <iostream>
 #include <fstream>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
 #include "../util.h"
 #include "utils.h"
 
@@ -173,6 +176,43 @@ private:
 };
 
 
+// A pool of started containers for each image, so that most builds
+// can skip "buildah from".  A container runs at most max_builds
+// builds before being removed, and whenever one is taken from the
+// pool, a spare is started in the background to replace it.
+class container_pool
+{
+public:
+    container_pool() : hits(0), misses(0), total_ms(0) { }
+    ~container_pool();
+
+    void initialize(const string &buildah_path);
+    bool get(const string &hash, string &container);
+    void put(const string &hash, const string &container, bool reuse);
+    void set_image(const string &hash, const string &image);
+    void prestart(const string &hash);
+    bool create(const string &image, const string &container,
+		const string &stdout_path, const string &stderr_path);
+    void remove(const string &container);
+    void note_build(bool warm, long ms);
+
+private:
+    static const unsigned max_idle = 2;
+    static const unsigned max_builds = 10;
+
+    // The buildah executable path.
+    string buildah_path;
+
+    mutex pool_mutex;
+    condition_variable pool_cv;
+    map<string, string> images;		// hash -> image to start from
+    map<string, vector<string> > idle;	// hash -> containers
+    map<string, unsigned> starting;	// hash -> containers being started
+    map<string, unsigned> builds;	// container -> builds run
+    unsigned long hits, misses, total_ms;
+};
+
+
 class container_backend : public backend_base
 {
 public:
@@ -203,6 +243,8 @@ private:
 
     container_image_cache image_cache;
 
+    container_pool pool;
+
     // The current user's uid/gid.
     string uid_gid_str;
 };
@@ -226,6 +268,7 @@ container_backend::container_backend()
     }
     
     image_cache.initialize(buildah_path);
+    pool.initialize(buildah_path);
 
     build_docker_file_script_path = string(PKGLIBDIR)
 	+ "/httpd/docker/stap_build_docker_file.py";
@@ -301,9 +344,6 @@ container_backend::generate_module(const client_request_data *crd,
 				const string &stdout_path,
 				const string &stderr_path)
 {
-    vector<string> images_to_remove;
-    vector<string> containers_to_remove;
-
     // Handle capturing the container build and run stdout and stderr
     // (along with using /dev/null for stdin). If the client requested
     // it, just use stap's stdout/stderr files.
@@ -402,10 +442,19 @@ container_backend::generate_module(const client_request_data *crd,
     string stap_image_name = "sourceware.org/" + hash + "/" + uuid +
 	":" + datetime;
 
+    // If we've got a started container for this image, use it.
+    auto build_start = chrono::steady_clock::now();
+    string stap_container_uuid;
+    bool warm = pool.get(hash, stap_container_uuid);
+
     // If we can find an image with the same docker file hash, use it
     // instead of building a new image.
     string image_id;
-    if (image_cache.find(hash, image_id))
+    if (warm)
+    {
+	server_error(_F("Reusing container %s", stap_container_uuid.c_str()));
+    }
+    else if (image_cache.find(hash, image_id))
     {
 	// We're going to reuse an existing container. Tag the image
 	// with the new image name (to help keep track of the last
@@ -445,70 +494,56 @@ container_backend::generate_module(const client_request_data *crd,
 	image_cache.add(hash, stap_image_name);
     }
 
-    // We need a unique name for the container that "buildah run stap
-    // ..." will create, so grab another uuid.
-    string stap_container_uuid = get_uuid();
+    if (!warm) {
+	// We need a unique name for the container that "buildah run
+	// stap ..." will use, so grab another uuid.
+	stap_container_uuid = get_uuid();
 
-    // At this point, we've got an image. We need to convert it to a
-    // container. Note that instead of copying the user's file(s) into
-    // the container, running stap, then copying the resulting file(s)
-    // out of the container, we're just going to bind mount the temp
-    // directory into the container.
-    cmd_args.clear();
-    cmd_args.push_back("sudo");
-    cmd_args.push_back(buildah_path);
-    cmd_args.push_back("from");
-    cmd_args.push_back("--name");
-    cmd_args.push_back(stap_container_uuid);
-    cmd_args.push_back("--volume");
+	// At this point, we've got an image. We need to convert it to
+	// a container.
+	if (!pool.create(stap_image_name, stap_container_uuid,
+			 stdout_path, stderr_path))
+	    return -1;
+
+	// Spares get started from this image. (On a warm start, no
+	// image was tagged for this request, so keep the last one.)
+	pool.set_image(hash, stap_image_name);
+    }
+
+    // Get a spare container started for the next build of this image.
+    pool.prestart(hash);
+
+    // Now run stap in the container.  Instead of copying the user's
+    // file(s) into the container, running stap, then copying the
+    // resulting file(s) out of the container, we're just going to
+    // bind mount the temp directory into the container for this run.
     // The mount options are:
     //    rw: read-write mode
     //    Z: private unshared selinux label (so the host os and
     //       container can privately share the directory)
-    cmd_args.push_back(crd->client_dir + ":" + crd->client_dir + ":rw,Z");
-    cmd_args.push_back(stap_image_name);
-    rc = execute_and_capture(2, cmd_args, vector<std::string> (),
-			     stdout_path, stderr_path);
-    server_error(_F("Spawned process returned %d", rc));
-    if (rc != 0) {
-	server_error("buildah from failed.");
-	return -1;
-    }
-
-    // If we're here, we built the image and converted it into a
-    // container successfully. Now configure the container with
-    // environment variables that were sent over from the client (if
-    // any) and the right working directory.
     //
-    // When running "stap --tmpdir=/tmp/FOO", your current directory
-    // needs to be /tmp/FOO for stap to run successfully (for some odd
-    // reason).
+    // The environment variables that were sent over from the client
+    // (if any) and the working directory are set for this run only,
+    // since the container may be reused.  When running "stap
+    // --tmpdir=/tmp/FOO", your current directory needs to be /tmp/FOO
+    // for stap to run successfully (for some odd reason).
+    string volume = crd->client_dir + ":" + crd->client_dir + ":rw,Z";
     cmd_args.clear();
     cmd_args.push_back("sudo");
     cmd_args.push_back(buildah_path);
-    cmd_args.push_back("config");
-    for (auto i = crd->env_vars.begin(); i < crd->env_vars.end(); ++i) {
-	cmd_args.push_back("--env");
-	cmd_args.push_back(*i);
-    }
+    cmd_args.push_back("run");
+    cmd_args.push_back("--volume");
+    cmd_args.push_back(volume);
     cmd_args.push_back("--workingdir");
     cmd_args.push_back(crd->client_dir);
     cmd_args.push_back(stap_container_uuid);
-    rc = execute_and_capture(2, cmd_args, vector<std::string> (),
-			     stdout_path, stderr_path);
-    server_error(_F("Spawned process returned %d", rc));
-    if (rc != 0) {
-	server_error("buildah config failed.");
-	return -1;
-    }
-
-    // Now start the container and run stap.
-    cmd_args.clear();
-    cmd_args.push_back("sudo");
-    cmd_args.push_back(buildah_path);
-    cmd_args.push_back("run");
-    cmd_args.push_back(stap_container_uuid);
     cmd_args.push_back("--");
+    if (!crd->env_vars.empty()) {
+	cmd_args.push_back("env");
+	for (auto i = crd->env_vars.begin(); i < crd->env_vars.end(); ++i) {
+	    cmd_args.push_back(*i);
+	}
+    }
     for (auto it = argv.begin(); it != argv.end(); it++) {
 	cmd_args.push_back(*it);
     }
@@ -527,6 +562,8 @@ container_backend::generate_module(const client_request_data *crd,
     cmd_args.push_back("sudo");
     cmd_args.push_back(buildah_path);
     cmd_args.push_back("run");
+    cmd_args.push_back("--volume");
+    cmd_args.push_back(volume);
     cmd_args.push_back(stap_container_uuid);
     cmd_args.push_back("--");
     cmd_args.push_back("chown");
@@ -540,21 +577,14 @@ container_backend::generate_module(const client_request_data *crd,
 	server_error("buildah run failed.");
     }
 
-    // At this point we've built the container and run stap
-    // (successfully or unsuccessfully). We're finished with the
-    // container.
-    containers_to_remove.push_back(stap_container_uuid);
+    // At this point we've run stap (successfully or unsuccessfully)
+    // in the container. Give it back to the pool, unless it looks
+    // broken (we couldn't run anything in it).
+    pool.put(hash, stap_container_uuid, saved_rc >= 0 && rc == 0);
 
-    // OK, at this point we've created a container, run stap, and
-    // copied out any result. Let's do a little cleanup and delete the
-    // last layer. We'll leave (for now) the container with all the
-    // files, but delete the layer that got created as stap was run
-    // (since there is no reuse there).
-    //
-    // buildah rm/rmi stap_container_uuid
-    //
-    // Note that we have to remove the containers first, because they
-    // depend on the images.
+    long ms = chrono::duration_cast<chrono::milliseconds>
+	(chrono::steady_clock::now() - build_start).count();
+    pool.note_build(warm, ms);
 
     // FIXME: MORE CLEANUP NEEDED!
     //
@@ -564,52 +594,7 @@ container_backend::generate_module(const client_request_data *crd,
     // image never gets deleted currently. The "buildah images" command
     // knows when an image was created, but not the last time it was
     // used.
-    //
-    // We might be able to tie in the information from "buildah
-    // containers", which lists all containers, and when they were
-    // created. Since the containers are short-lived (they just exist
-    // to run "stap"), their creation date is really the last used
-    // date of the related image. But, of course we delete that
-    // container at the end of every run so that info gets deleted. In
-    // theory we could leave that container around and every so often
-    // run a python script that puts the two bits of information
-    // together and deletes images and containers that haven't been
-    // used in a while.
-
-    if (! containers_to_remove.empty()) {
-	cmd_args.clear();
-	cmd_args.push_back("sudo");
-	cmd_args.push_back(buildah_path);
-	cmd_args.push_back("rm");
-	for (auto i = containers_to_remove.begin();
-	     i != containers_to_remove.end(); i++) {
-	    cmd_args.push_back(*i);
-	}
-	rc = execute_and_capture(2, cmd_args, vector<std::string> (),
-				 container_stdout_path, container_stderr_path);
-	// Note that we're ignoring any errors here.
-	server_error(_F("Spawned process returned %d", rc));
-	if (rc != 0) {
-	    server_error("buildah rm failed.");
-	}
-    }
-    if (! images_to_remove.empty()) {
-	cmd_args.clear();
-	cmd_args.push_back("sudo");
-	cmd_args.push_back(buildah_path);
-	cmd_args.push_back("rmi");
-	for (auto i = images_to_remove.begin(); i != images_to_remove.end();
-	     i++) {
-	    cmd_args.push_back(*i);
-	}
-	rc = execute_and_capture(2, cmd_args, vector<std::string> (),
-				 container_stdout_path, container_stderr_path);
-	// Note that we're ignoring any errors here.
-	server_error(_F("Spawned process returned %d", rc));
-	if (rc != 0) {
-	    server_error("buildah rmi failed.");
-	}
-    }
+
     return saved_rc;
 }
 
@@ -772,6 +757,178 @@ container_image_cache::find(const string &hash, string &id)
 }
 
 
+void
+container_pool::initialize(const string &bp)
+{
+    buildah_path = bp;
+}
+
+
+container_pool::~container_pool()
+{
+    // Wait for any spares still being started, then remove all the
+    // idle containers.
+    unique_lock<mutex> lock(pool_mutex);
+    pool_cv.wait(lock, [this]{
+	    for (auto it = starting.begin(); it != starting.end(); it++)
+		if (it->second)
+		    return false;
+	    return true;
+	});
+    for (auto it = idle.begin(); it != idle.end(); it++) {
+	for (auto c = it->second.begin(); c != it->second.end(); c++)
+	    remove(*c);
+    }
+    idle.clear();
+}
+
+
+// Take a started container for the image with this docker file hash,
+// if there is one.
+bool
+container_pool::get(const string &hash, string &container)
+{
+    // Use a lock_guard to ensure the mutex gets released even if an
+    // exception is thrown.
+    lock_guard<mutex> lock(pool_mutex);
+    auto it = idle.find(hash);
+    if (it == idle.end() || it->second.empty()) {
+	container.clear();
+	return false;
+    }
+    container = it->second.back();
+    it->second.pop_back();
+    return true;
+}
+
+
+// Give back a container after a build. It is removed if it has done
+// enough builds already, or if there are enough spares.
+void
+container_pool::put(const string &hash, const string &container, bool reuse)
+{
+    {
+	// Use a lock_guard to ensure the mutex gets released even if
+	// an exception is thrown.
+	lock_guard<mutex> lock(pool_mutex);
+	unsigned n = ++builds[container];
+	vector<string> &containers = idle[hash];
+	if (reuse && n < max_builds && containers.size() < max_idle) {
+	    containers.push_back(container);
+	    return;
+	}
+	builds.erase(container);
+    }
+    remove(container);
+}
+
+
+// Remember the image that spare containers for this docker file hash
+// should be started from.
+void
+container_pool::set_image(const string &hash, const string &image)
+{
+    // Use a lock_guard to ensure the mutex gets released even if an
+    // exception is thrown.
+    lock_guard<mutex> lock(pool_mutex);
+    images[hash] = image;
+}
+
+
+// Start a spare container for the image in the background, if we
+// don't have enough already.
+void
+container_pool::prestart(const string &hash)
+{
+    string image;
+    {
+	// Use a lock_guard to ensure the mutex gets released even if
+	// an exception is thrown.
+	lock_guard<mutex> lock(pool_mutex);
+	auto it = images.find(hash);
+	if (it == images.end())
+	    return;
+	image = it->second;
+	if (idle[hash].size() + starting[hash] >= max_idle)
+	    return;
+	starting[hash]++;
+    }
+
+    thread([this, hash, image]() {
+	    string container = get_uuid();
+	    bool ok = create(image, container, "/dev/null", "/dev/null");
+
+	    lock_guard<mutex> lock(pool_mutex);
+	    if (ok) {
+		idle[hash].push_back(container);
+		server_error(_F("Started spare container %s", container.c_str()));
+	    }
+	    else
+		server_error(_F("Could not start a spare container from image %s",
+				image.c_str()));
+	    starting[hash]--;
+	    pool_cv.notify_all();
+	}).detach();
+}
+
+
+bool
+container_pool::create(const string &image, const string &container,
+		       const string &stdout_path, const string &stderr_path)
+{
+    vector<string> cmd_args;
+    cmd_args.push_back("sudo");
+    cmd_args.push_back(buildah_path);
+    cmd_args.push_back("from");
+    cmd_args.push_back("--name");
+    cmd_args.push_back(container);
+    cmd_args.push_back(image);
+    int rc = execute_and_capture(2, cmd_args, vector<std::string> (),
+				 stdout_path, stderr_path);
+    server_error(_F("Spawned process returned %d", rc));
+    if (rc != 0) {
+	server_error("buildah from failed.");
+	return false;
+    }
+    return true;
+}
+
+
+void
+container_pool::remove(const string &container)
+{
+    vector<string> cmd_args;
+    cmd_args.push_back("sudo");
+    cmd_args.push_back(buildah_path);
+    cmd_args.push_back("rm");
+    cmd_args.push_back(container);
+    int rc = execute_and_capture(2, cmd_args, vector<std::string> (),
+				 "/dev/null", "/dev/null");
+    // Note that we're ignoring any errors here.
+    server_error(_F("Spawned process returned %d", rc));
+    if (rc != 0) {
+	server_error("buildah rm failed.");
+    }
+}
+
+
+void
+container_pool::note_build(bool warm, long ms)
+{
+    // Use a lock_guard to ensure the mutex gets released even if an
+    // exception is thrown.
+    lock_guard<mutex> lock(pool_mutex);
+    if (warm)
+	hits++;
+    else
+	misses++;
+    total_ms += ms;
+    server_error(_F("Container build took %ld ms (%s container); pool hit rate %lu/%lu, average %lu ms",
+		    ms, warm ? "warm" : "cold", hits, hits + misses,
+		    total_ms / (hits + misses)));
+}
+
+
 static vector<backend_base *>saved_backends;
 static void backends_atexit_handler()
 {
@@ -9,6 +9,7 @@
 #include "server.h"
 #include "api.h"
 #include <iostream>
+#include <thread>
 #include "../util.h"
 #include "nss_funcs.h"
 #include "utils.h"
@@ -20,6 +21,7 @@ extern "C" {
 #include <errno.h>
 #include <sys/signalfd.h>
 #include <getopt.h>
+#include <limits.h>
 }
 
 server *httpd = NULL;
@@ -97,6 +99,8 @@ setup_main_signals(pthread_t *tid)
 // port default needs to be chosen.
 static uint16_t port = 1234;
 static string cert_db_path;
+static unsigned build_threads = thread::hardware_concurrency();
+static unsigned max_cache_entries = 100;
 
 void
 parse_cmdline(int argc, char *const argv[])
@@ -105,17 +109,22 @@ parse_cmdline(int argc, char *const argv[])
 	LONG_OPT_PORT = 256,
 	LONG_OPT_SSL,
 	LONG_OPT_LOG,
+	LONG_OPT_BUILD_THREADS,
+	LONG_OPT_MAX_CACHE_ENTRIES,
     };
     static struct option long_options[] = {
         { "port", 1, NULL, LONG_OPT_PORT },
         { "ssl", 1, NULL, LONG_OPT_SSL },
         { "log", 1, NULL, LONG_OPT_LOG },
+        { "build-threads", 1, NULL, LONG_OPT_BUILD_THREADS },
+        { "max-cache-entries", 1, NULL, LONG_OPT_MAX_CACHE_ENTRIES },
         { NULL, 0, NULL, 0 }
     };
     while (true) {
 	int grc = getopt_long(argc, argv, "", long_options, NULL);
 	char *num_endptr;
 	unsigned long port_tmp;
+	unsigned long num_tmp;
 	if (grc < 0)
 	    break;
 	switch (grc) {
@@ -140,6 +149,22 @@ parse_cmdline(int argc, char *const argv[])
 	  case LONG_OPT_LOG:
 	    start_log(optarg, true);
 	    break;
+	  case LONG_OPT_BUILD_THREADS:
+	  case LONG_OPT_MAX_CACHE_ENTRIES:
+	    errno = 0;
+	    num_tmp = strtoul(optarg, &num_endptr, 10);
+	    if (*num_endptr != '\0' || errno != 0 || num_tmp > UINT_MAX) {
+		server_error(_F("%s: cannot parse number '--%s=%s'", argv[0],
+				(grc == LONG_OPT_BUILD_THREADS
+				 ? "build-threads" : "max-cache-entries"),
+				optarg));
+		exit(1);
+	    }
+	    if (grc == LONG_OPT_BUILD_THREADS)
+		build_threads = num_tmp;
+	    else
+		max_cache_entries = num_tmp;
+	    break;
 	  default:
 	    break;
 	}
@@ -180,7 +205,7 @@ main(int argc, char *const argv[])
 
     // Create the server and ask the api to register its handlers.
     httpd = new server(port, cert_db_path);
-    api_add_request_handlers(*httpd);
+    api_add_request_handlers(*httpd, build_threads, max_cache_entries);
 
     // Wait for the server to shut itself down.
     httpd->wait();
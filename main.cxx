@@ -1452,6 +1452,220 @@ passes_0_4_again_with_server (systemtap_session &s)
   return rc;
 }
 
+// Run passes 0-4 for one of the unique sessions, either locally or
+// using a compile-server.
+static int
+session_passes_0_4 (systemtap_session &ss)
+{
+  ss.init_try_server ();
+  int rc = passes_0_4 (ss);
+  if (rc)
+    {
+      // Compilation failed.
+      // Try again using a server if appropriate.
+      if (ss.try_server ())
+        rc = passes_0_4_again_with_server (ss);
+    }
+  return rc;
+}
+
+static void
+print_session_header (systemtap_session &ss)
+{
+  if (ss.verbose > 1)
+    clog << _F("Session arch: %s release: %s",
+               ss.architecture.c_str(), ss.kernel_release.c_str())
+         << endl
+         << _F("Build tree: \"%s\"",
+               ss.kernel_build_tree.c_str())
+         << endl;
+}
+
+// A session whose passes 0-4 run in a forked child, see
+// concurrent_passes_0_4.
+struct session_build
+{
+  systemtap_session *ss;
+  pid_t pid;
+  int fd;               // read end of the child's result pipe
+  string result;
+  int rc;
+
+  session_build (systemtap_session *ss): ss(ss), pid(-1), fd(-1), rc(1) {}
+};
+
+static void
+start_session_build (session_build &b)
+{
+  systemtap_session &ss = *b.ss;
+  print_session_header (ss);
+#if HAVE_NSS
+  // These may prompt, so do them here rather than in the child.
+  nss_client_query_server_status (ss);
+  nss_client_manage_server_trust (ss);
+#endif
+  if (! ss.have_script && ! ss.dump_mode)
+    {
+      b.rc = 0;
+      return;
+    }
+
+  clog.flush(); cerr.flush();
+  pair<bool,int> ret = stap_fork_pipe (ss.verbose, b.pid);
+  if (! ret.first)
+    {
+      b.fd = ret.second;
+      if (b.fd < 0)
+        cerr << _F("ERROR: could not fork a build for kernel %s",
+                   ss.kernel_release.c_str()) << endl;
+      return;
+    }
+
+  // Child fork: capture the output for the parent to replay once this
+  // build's turn comes, so builds never interleave their messages.
+  int rc = 1;
+  int out = open ((ss.tmpdir + "/passes.out").c_str(),
+                  O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+  int err = open ((ss.tmpdir + "/passes.err").c_str(),
+                  O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+  if (out < 0 || err < 0
+      || dup2 (out, STDOUT_FILENO) < 0 || dup2 (err, STDERR_FILENO) < 0)
+    _exit (EXIT_FAILURE);
+  close (out);
+  close (err);
+
+  try
+    {
+      rc = session_passes_0_4 (ss);
+    }
+  catch (const exit_exception& e)
+    {
+      rc = e.rc;
+    }
+  catch (...)
+    {
+      // NB: no cleanup from the fork!
+    }
+
+  // For pass 5, we need the module and maybe uprobes for staprun.
+  ostringstream o;
+  o << ss.module_name << endl
+    << ss.uprobes_path << endl
+    << ss.need_uprobes << endl;
+  string result = o.str();
+  if (write (ret.second, result.data(), result.size()) != (ssize_t) result.size())
+    rc = 1;
+  close (ret.second);
+  exit (rc ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static void
+finish_session_build (session_build &b)
+{
+  systemtap_session &ss = *b.ss;
+  b.rc = stap_waitpid (ss.verbose, b.pid);
+  close (b.fd);
+  b.fd = -1;
+
+  if (b.rc == 0)
+    {
+      istringstream i (b.result);
+      getline (i, ss.module_name);
+      getline (i, ss.uprobes_path);
+      i >> ss.need_uprobes;
+    }
+}
+
+static void
+replay_session_output (const string& path, ostream& o)
+{
+  ifstream f (path.c_str());
+  o << f.rdbuf();
+  o.flush();
+}
+
+// Run passes 0-4 for the unique remote sessions in parallel, at most
+// --remote-jobs at a time.  Each build's output is replayed in session
+// order once it completes and, as in a serial run, nothing is reported
+// past the first failure.
+static int
+concurrent_passes_0_4 (systemtap_session &s, const set<systemtap_session*>& sessions)
+{
+  size_t jobs = s.remote_jobs ?: thread::hardware_concurrency();
+  if (jobs < 1)
+    jobs = 1;
+
+  vector<session_build> builds (sessions.begin(), sessions.end());
+  size_t next = 0, running = 0, reported = 0;
+  int rc = 0;
+
+  while (true)
+    {
+      while (rc == 0 && ! pending_interrupts
+             && next < builds.size() && running < jobs)
+        {
+          start_session_build (builds[next]);
+          if (builds[next++].fd >= 0)
+            running++;
+        }
+
+      // Replay everything that's finished, in order.
+      for (; reported < next && builds[reported].fd < 0; reported++)
+        {
+          session_build &b = builds[reported];
+          if (rc)
+            continue;
+          if (b.pid > 0)
+            {
+              replay_session_output (b.ss->tmpdir + "/passes.out", cout);
+              replay_session_output (b.ss->tmpdir + "/passes.err", cerr);
+            }
+          if (b.rc || s.perpass_verbose[0] >= 1)
+            s.explain_auto_options ();
+          if ((rc = b.rc))
+            {
+              // Don't wait for builds we won't report.
+              for (size_t i = reported + 1; i < next; i++)
+                if (builds[i].fd >= 0)
+                  kill (builds[i].pid, SIGTERM);
+            }
+        }
+
+      if (running == 0)
+        break;
+
+      vector<pollfd> fds;
+      vector<session_build*> polled;
+      for (size_t i = reported; i < next; i++)
+        if (builds[i].fd >= 0)
+          {
+            pollfd pfd = { builds[i].fd, POLLIN, 0 };
+            fds.push_back (pfd);
+            polled.push_back (&builds[i]);
+          }
+      if (poll (fds.data(), fds.size(), -1) < 0 && errno != EINTR)
+        throw runtime_error (_F("poll error: %s", strerror (errno)));
+
+      for (size_t i = 0; i < fds.size(); i++)
+        if (fds[i].revents)
+          {
+            char buf[4096];
+            ssize_t n = read (fds[i].fd, buf, sizeof(buf));
+            if (n > 0)
+              polled[i]->result.append (buf, n);
+            else if (n == 0 || errno != EINTR)
+              {
+                finish_session_build (*polled[i]);
+                running--;
+              }
+          }
+    }
+
+  if (rc == 0 && next < builds.size())
+    rc = 1;
+  return rc;
+}
+
 int
 main (int argc, char * const argv [])
 {
@@ -1585,48 +1799,36 @@ main (int argc, char * const argv [])
       }
     else
       {
-	for (set<systemtap_session*>::iterator it = sessions.begin();
-	     rc == 0 && !pending_interrupts && it != sessions.end(); ++it)
-	  {
-	    systemtap_session& ss = **it;
-            if (ss.verbose > 1)
-	      clog << _F("Session arch: %s release: %s",
-			 ss.architecture.c_str(), ss.kernel_release.c_str())
-		   << endl
-                   << _F("Build tree: \"%s\"",
-			 ss.kernel_build_tree.c_str())
-		   << endl;
+	if (rc == 0 && sessions.size() > 1 && s.remote_jobs != 1)
+	  rc = concurrent_passes_0_4 (s, sessions);
+	else
+	  for (set<systemtap_session*>::iterator it = sessions.begin();
+	       rc == 0 && !pending_interrupts && it != sessions.end(); ++it)
+	    {
+	      systemtap_session& ss = **it;
+	      print_session_header (ss);
 
 #if HAVE_NSS
-	    // If requested, query server status. This is independent
-	    // of other tasks.
-	    nss_client_query_server_status (ss);
+	      // If requested, query server status. This is independent
+	      // of other tasks.
+	      nss_client_query_server_status (ss);
 
-	    // If requested, manage trust of servers. This is
-	    // independent of other tasks.
-	    nss_client_manage_server_trust (ss);
+	      // If requested, manage trust of servers. This is
+	      // independent of other tasks.
+	      nss_client_manage_server_trust (ss);
 #endif
 
-	    // Run the passes only if a script has been specified or
-	    // if we're dumping something. The requirement for a
-	    // script has already been checked in
-	    // systemtap_session::check_options.
-	    if (ss.have_script || ss.dump_mode)
-	      {
-		// Run passes 0-4 for each unique session, either
-		// locally or using a compile-server.
-		ss.init_try_server ();
-		if ((rc = passes_0_4 (ss)))
-		  {
-		    // Compilation failed.
-		    // Try again using a server if appropriate.
-		    if (ss.try_server ())
-		      rc = passes_0_4_again_with_server (ss);
-		  }
-		if (rc || s.perpass_verbose[0] >= 1)
-		  s.explain_auto_options ();
-	      }
-	  }
+	      // Run the passes only if a script has been specified or
+	      // if we're dumping something. The requirement for a
+	      // script has already been checked in
+	      // systemtap_session::check_options.
+	      if (ss.have_script || ss.dump_mode)
+		{
+		  rc = session_passes_0_4 (ss);
+		  if (rc || s.perpass_verbose[0] >= 1)
+		    s.explain_auto_options ();
+		}
+	    }
 
 	// Run pass 5, if requested
 	if (rc == 0 && s.have_script && s.last_pass >= 5 && ! pending_interrupts)
@@ -13,18 +13,23 @@ extern "C" {
 #include <poll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <libgen.h>
 }
 
+#include <atomic>
 #include <cstdio>
+#include <functional>
 #include <iomanip>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "buildrun.h"
@@ -1245,29 +1250,119 @@ remote::create(systemtap_session& s, const string& uri, int idx)
   return it;
 }
 
+// Call fn(i) for each of n remotes, on at most jobs threads at once,
+// and return the results by index.  Once stop_on_error sees a failure,
+// or on an interrupt, no further remotes are started; those are left 0.
+static vector<int>
+for_each_remote(size_t n, size_t jobs, bool stop_on_error,
+                const function<int(unsigned)>& fn)
+{
+  vector<int> results(n, 0);
+  atomic<unsigned> next(0);
+  atomic<bool> failed(false);
+
+  auto worker = [&]()
+    {
+      unsigned i;
+      while (!(stop_on_error && failed) && !pending_interrupts
+             && (i = next++) < n)
+        {
+          try
+            {
+              results[i] = fn(i);
+            }
+          catch (const exception& e)
+            {
+              cerr << e.what() << endl;
+              results[i] = 1;
+            }
+          if (results[i])
+            failed = true;
+        }
+    };
+
+  jobs = min(jobs, n);
+  if (jobs <= 1)
+    worker();
+  else
+    {
+      vector<thread> workers;
+      for (size_t j = 0; j < jobs; ++j)
+        workers.push_back(thread(worker));
+      for (size_t j = 0; j < jobs; ++j)
+        workers[j].join();
+    }
+
+  return results;
+}
+
 int
 remote::run(const vector<remote*>& remotes)
 {
   // NB: the first failure "wins"
   int ret = 0, rc = 0;
 
-  for (unsigned i = 0; i < remotes.size() && !pending_interrupts; ++i)
+  if (remotes.empty())
+    return 0;
+
+  for (unsigned i = 0; i < remotes.size(); ++i)
     {
       remote *r = remotes[i];
       r->s->verbose = r->s->perpass_verbose[4];
       if (r->s->use_remote_prefix)
         r->prefix = lex_cast(i) + ": ";
-      rc = r->prepare();
-      if (rc)
-        return rc;
     }
 
-  for (unsigned i = 0; i < remotes.size() && !pending_interrupts; ++i)
+  // Uploads are bound by the network rather than local cpus, so allow
+  // more of them at once than builds by default.
+  size_t jobs = remotes[0]->s->remote_jobs ?: 16;
+  mutex progress_lock;
+
+  auto progress = [&](unsigned i, const char *what, int rc,
+                      const struct timeval& start)
     {
-      rc = remotes[i]->start();
-      if (!ret)
-        ret = rc;
-    }
+      remote *r = remotes[i];
+      if (r->s->verbose < 2)
+        return;
+
+      struct timeval now;
+      gettimeofday(&now, NULL);
+      long ms = (now.tv_sec - start.tv_sec) * 1000
+                + (now.tv_usec - start.tv_usec) / 1000;
+      string host = r->staprun_r_arg.empty() ? lex_cast(i) : r->staprun_r_arg;
+
+      lock_guard<mutex> guard(progress_lock);
+      if (rc)
+        clog << _F("Remote %s: %s failed after %ld ms", host.c_str(), what, ms) << endl;
+      else
+        clog << _F("Remote %s: %s took %ld ms", host.c_str(), what, ms) << endl;
+    };
+
+  vector<int> results = for_each_remote(remotes.size(), jobs, true,
+    [&](unsigned i)
+      {
+        struct timeval start;
+        gettimeofday(&start, NULL);
+        int rc = remotes[i]->prepare();
+        progress(i, "prepare", rc, start);
+        return rc;
+      });
+  for (unsigned i = 0; i < results.size(); ++i)
+    if (results[i])
+      return results[i];
+
+  // Start them all close together, so they see the same events.
+  results = for_each_remote(remotes.size(), jobs, false,
+    [&](unsigned i)
+      {
+        struct timeval start;
+        gettimeofday(&start, NULL);
+        int rc = remotes[i]->start();
+        progress(i, "start", rc, start);
+        return rc;
+      });
+  for (unsigned i = 0; i < results.size() && !ret; ++i)
+    ret = results[i];
 
   // mask signals while we're preparing to poll
   {
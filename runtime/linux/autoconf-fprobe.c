@@ -0,0 +1,23 @@
+#include <linux/fprobe.h>
+
+// Check for the fprobe API of kernels 6.5 and later, with ret_ip and
+// pt_regs passed to the entry handler.
+
+static int
+stp_fprobe_entry(struct fprobe *fp, unsigned long entry_ip,
+		 unsigned long ret_ip, struct pt_regs *regs,
+		 void *entry_data)
+{
+  return 0;
+}
+
+static struct fprobe stp_fp = {
+  .entry_handler = stp_fprobe_entry,
+};
+
+int stp_register_fprobe(unsigned long *addrs, int num);
+
+int stp_register_fprobe(unsigned long *addrs, int num)
+{
+  return register_fprobe_ips(&stp_fp, addrs, num);
+}
@@ -43,6 +43,16 @@ extern void *_stp_module_kallsyms_on_each_symbol;
 #include <linux/kprobes.h>
 #include <linux/module.h>
 
+// Function-entry probes on kernel functions with an ftrace site are
+// attached as fprobes where the kernel supports them, saving the
+// breakpoint trap on each hit.  -DSTP_NO_FPROBE turns this off.
+#if defined(STAPCONF_FPROBE) && defined(CONFIG_FPROBE) \
+      && !defined(__ia64__) && !defined(STP_NO_FPROBE)
+#define STP_USE_FPROBE
+#include <linux/fprobe.h>
+#include <linux/sort.h>
+#endif
+
 #ifdef DEBUG_KPROBES
 #define dbug_stapkp(args...) do {					\
 		_stp_dbug(__FUNCTION__, __LINE__, args);		\
@@ -86,7 +96,9 @@ struct stap_kprobe_probe {
    const unsigned return_p:1;
    const unsigned maxactive_p:1;
    const unsigned optional_p:1;
+   const unsigned ftrace_p:1;	// address is a function's ftrace entry
    unsigned registered_p:1;
+   unsigned fprobe_p:1;		// attached as an fprobe, not registered
    const unsigned short maxactive_val;
 
    // data saved in the kretprobe_instance packet
@@ -118,6 +130,9 @@ struct stap_kprobe_probe {
 
 // Forward declare the main entry functions (stap-generated)
 static int
+enter_kprobe_common(struct stap_kprobe_probe *skp, unsigned long addr,
+                    struct pt_regs *regs);
+static int
 enter_kprobe_probe(struct kprobe *inst,
                    struct pt_regs *regs);
 static int
@@ -370,7 +385,7 @@ stapkp_register_probe(struct stap_kprobe_probe *skp)
                skp->module, (unsigned long)skp->address,
                skp->registered_p);
 
-   if (skp->registered_p)
+   if (skp->registered_p || skp->fprobe_p)
       return 0;
 
    return skp->return_p ? stapkp_register_kretprobe(skp)
@@ -565,6 +580,203 @@ stapkp_batch_unregister_probes(struct stap_kprobe_probe *probes,
 #endif /* STAPCONF_UNREGISTER_KPROBES */
 
 
+#ifdef STP_USE_FPROBE
+
+// The ftrace_p probes, sorted by address.  Each stapkp_fprobe attaches
+// a range of this table, and its handler runs the probes at the address
+// that was hit.
+struct stapkp_fentry {
+   unsigned long addr;
+   struct stap_kprobe_probe *skp;
+};
+
+struct stapkp_fprobe {
+   struct fprobe fp;
+   size_t first, last;		// range of stapkp_fentries
+   struct stapkp_fprobe *next;
+};
+
+static struct stapkp_fentry *stapkp_fentries;
+static struct stapkp_fprobe *stapkp_fprobes;
+
+
+static int
+stapkp_fentry_cmp(const void *a, const void *b)
+{
+   const struct stapkp_fentry *x = a, *y = b;
+   return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+
+static int
+stapkp_fprobe_handler(struct fprobe *fp, unsigned long entry_ip,
+                      unsigned long ret_ip, struct pt_regs *regs,
+                      void *entry_data)
+{
+   struct stapkp_fprobe *sf = container_of(fp, struct stapkp_fprobe, fp);
+   size_t lo = sf->first, hi = sf->last, i;
+   unsigned long addr;
+
+   // The ftrace site may be a little past the function's address (e.g.
+   // after an endbr), so find the last probe address <= entry_ip.
+   while (hi - lo > 1) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (stapkp_fentries[mid].addr <= entry_ip)
+         lo = mid;
+      else
+         hi = mid;
+   }
+   addr = stapkp_fentries[lo].addr;
+   if (addr > entry_ip)
+      return 0;
+   while (lo > sf->first && stapkp_fentries[lo - 1].addr == addr)
+      lo--;
+
+   for (i = lo; i < sf->last && stapkp_fentries[i].addr == addr; i++) {
+      struct stap_kprobe_probe *skp = stapkp_fentries[i].skp;
+
+      // Stands in for KPROBE_FLAG_DISABLED.
+      if (skp->probe->cond_enabled)
+         enter_kprobe_common(skp, addr, regs);
+   }
+   return 0;
+}
+
+
+// Attach stapkp_fentries[first,last) as one fprobe.  If the kernel
+// refuses any of its addresses, split the range in halves and try
+// again, down to single addresses, which are left for kprobes.  ips
+// is scratch space for as many addresses.
+static size_t
+stapkp_register_fprobes(size_t first, size_t last, unsigned long *ips)
+{
+   struct stapkp_fprobe *sf;
+   size_t i, n = 0, mid;
+   int ret;
+
+   if (first == last)
+      return 0;
+
+   for (i = first; i < last; i++)
+      if (n == 0 || ips[n - 1] != stapkp_fentries[i].addr)
+         ips[n++] = stapkp_fentries[i].addr;
+
+   sf = _stp_kzalloc(sizeof(struct stapkp_fprobe));
+   if (sf == NULL)
+      return 0;
+   sf->fp.entry_handler = &stapkp_fprobe_handler;
+   sf->first = first;
+   sf->last = last;
+
+   ret = register_fprobe_ips(&sf->fp, ips, n);
+   dbug_stapkp("+fprobe * %zd rc %d\n", n, ret);
+   if (ret == 0) {
+      for (i = first; i < last; i++)
+         stapkp_fentries[i].skp->fprobe_p = 1;
+      sf->next = stapkp_fprobes;
+      stapkp_fprobes = sf;
+      return last - first;
+   }
+   _stp_kfree(sf);
+   if (n == 1)
+      return 0;
+
+   // Split between two different addresses, near the middle.
+   mid = first + (last - first) / 2;
+   while (mid > first
+          && stapkp_fentries[mid - 1].addr == stapkp_fentries[mid].addr)
+      mid--;
+   if (mid == first) {
+      mid = first + (last - first) / 2;
+      while (stapkp_fentries[mid - 1].addr == stapkp_fentries[mid].addr)
+         mid++;
+   }
+   return stapkp_register_fprobes(first, mid, ips)
+          + stapkp_register_fprobes(mid, last, ips);
+}
+
+
+static void
+stapkp_init_fprobes(struct stap_kprobe_probe *probes, size_t nprobes)
+{
+   unsigned long *ips = NULL;
+   size_t i, n = 0;
+
+   for (i = 0; i < nprobes; i++)
+      if (probes[i].ftrace_p && !probes[i].return_p)
+         n++;
+   if (n == 0)
+      return;
+
+   stapkp_fentries = _stp_vzalloc(n * sizeof(struct stapkp_fentry));
+   ips = _stp_vzalloc(n * sizeof(unsigned long));
+   if (stapkp_fentries == NULL || ips == NULL)
+      goto out;
+
+   n = 0;
+   for (i = 0; i < nprobes; i++) {
+      struct stap_kprobe_probe *skp = &probes[i];
+      unsigned long addr;
+
+      if (!skp->ftrace_p || skp->return_p)
+         continue;
+      addr = stapkp_relocate_addr(skp);
+      if (addr == 0)
+         continue;
+      stapkp_fentries[n].addr = addr;
+      stapkp_fentries[n].skp = skp;
+      n++;
+   }
+   sort(stapkp_fentries, n, sizeof(struct stapkp_fentry),
+        stapkp_fentry_cmp, NULL);
+
+   i = stapkp_register_fprobes(0, n, ips);
+   dbug_stapkp("attached %zd of %zd probes as fprobes\n", i, n);
+
+out:
+   if (ips)
+      _stp_vfree(ips);
+   if (stapkp_fprobes == NULL && stapkp_fentries != NULL) {
+      _stp_vfree(stapkp_fentries);
+      stapkp_fentries = NULL;
+   }
+}
+
+
+static void
+stapkp_exit_fprobes(void)
+{
+   size_t i;
+
+   while (stapkp_fprobes != NULL) {
+      struct stapkp_fprobe *sf = stapkp_fprobes;
+
+      unregister_fprobe(&sf->fp);
+      dbug_stapkp("-fprobe %zd probes\n", sf->last - sf->first);
+
+      atomic_add(sf->fp.nmissed, skipped_count());
+#ifdef STP_TIMING
+      if (sf->fp.nmissed)
+         _stp_warn ("Skipped due to missed fprobe on '%s' and others: %lu\n",
+                    stapkp_fentries[sf->first].skp->probe->pp,
+                    sf->fp.nmissed);
+#endif
+      for (i = sf->first; i < sf->last; i++)
+         stapkp_fentries[i].skp->fprobe_p = 0;
+
+      stapkp_fprobes = sf->next;
+      _stp_kfree(sf);
+   }
+
+   if (stapkp_fentries != NULL) {
+      _stp_vfree(stapkp_fentries);
+      stapkp_fentries = NULL;
+   }
+}
+
+#endif /* STP_USE_FPROBE */
+
+
 static void
 stapkp_unregister_probes(struct stap_kprobe_probe *probes,
                          size_t nprobes)
@@ -792,6 +1004,10 @@ stapkp_init(struct stap_kprobe_probe *probes,
      }
    }
 
+#ifdef STP_USE_FPROBE
+   stapkp_init_fprobes(probes, nprobes);
+#endif
+
    for (i = 0; i < nprobes; i++) {
       struct stap_kprobe_probe *skp = &probes[i];
       int rc = 0;
@@ -900,6 +1116,9 @@ static void
 stapkp_exit(struct stap_kprobe_probe *probes,
             size_t nprobes)
 {
+#ifdef STP_USE_FPROBE
+   stapkp_exit_fprobes();
+#endif
    stapkp_unregister_probes(probes, nprobes);
 }
 
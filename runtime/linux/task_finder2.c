@@ -4,6 +4,8 @@
 #include "stp_utrace.c"
 
 #include <linux/list.h>
+#include <linux/jhash.h>
+#include <linux/percpu.h>
 #include <linux/binfmts.h>
 #include <linux/mount.h>
 #include "stap_mmap_lock.h"
@@ -25,6 +27,15 @@
 
 static LIST_HEAD(__stp_task_finder_list);
 
+/* The same targets, indexed for matching a newly exec'd task: the
+ * procname-based ones hashed by path, and all the others (which may
+ * match any path) on a separate list.  Like __stp_task_finder_list,
+ * these are only written before the task finder is started. */
+#define __STP_TF_PATH_TABLE_BITS 8
+#define __STP_TF_PATH_TABLE_SIZE (1 << __STP_TF_PATH_TABLE_BITS)
+static struct hlist_head __stp_tf_path_table[__STP_TF_PATH_TABLE_SIZE];
+static LIST_HEAD(__stp_tf_any_path_list);
+
 struct stap_task_finder_target;
 
 #define __STP_TF_UNITIALIZED	0
@@ -34,10 +45,42 @@ struct stap_task_finder_target;
 #define __STP_TF_STOPPED	4
 static atomic_t __stp_task_finder_state = ATOMIC_INIT(__STP_TF_UNITIALIZED);
 static atomic_t __stp_task_finder_complete = ATOMIC_INIT(0);
-static atomic_t __stp_inuse_count = ATOMIC_INIT (0);
 
-#define __stp_tf_handler_start() (atomic_inc(&__stp_inuse_count))
-#define __stp_tf_handler_end() (atomic_dec(&__stp_inuse_count))
+/* Handlers in progress are counted per-cpu, so that fork/exec/mmap
+ * heavy workloads don't all bounce one cache line.  A handler may
+ * sleep and end on another cpu than it started on, so starts and
+ * ends are counted separately and only their totals are compared,
+ * see __stp_tf_handlers_inuse(). */
+static DEFINE_PER_CPU(unsigned long, __stp_tf_handler_starts);
+static DEFINE_PER_CPU(unsigned long, __stp_tf_handler_ends);
+
+static inline void __stp_tf_handler_start(void)
+{
+	this_cpu_inc(__stp_tf_handler_starts);
+	smp_mb();
+}
+
+static inline void __stp_tf_handler_end(void)
+{
+	smp_mb();
+	this_cpu_inc(__stp_tf_handler_ends);
+}
+
+/* Returns the number of handlers in progress, or 0 once every handler
+ * that had started is finished.  Ends are summed before starts, so a
+ * handler racing with the summing is counted as still in progress. */
+static long __stp_tf_handlers_inuse(void)
+{
+	unsigned long starts = 0, ends = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		ends += per_cpu(__stp_tf_handler_ends, cpu);
+	smp_mb();
+	for_each_possible_cpu(cpu)
+		starts += per_cpu(__stp_tf_handler_starts, cpu);
+	return (long)(starts - ends);
+}
 
 #ifdef DEBUG_TASK_FINDER
 static atomic_t __stp_attach_count = ATOMIC_INIT (0);
@@ -47,7 +90,7 @@ static atomic_t __stp_attach_count = ATOMIC_INIT (0);
 #define debug_task_finder_report()			  \
     dbug_task(1, "attach count: %d, inuse count: %d\n",	  \
 	    atomic_read(&__stp_attach_count),		  \
-	    atomic_read(&__stp_inuse_count))
+	    (int)__stp_tf_handlers_inuse())
 #else
 #define debug_task_finder_attach()	/* empty */
 #define debug_task_finder_detach()	/* empty */
@@ -84,6 +127,8 @@ typedef int
 struct stap_task_finder_target {
 /* private: */
 	struct list_head list;		/* __stp_task_finder_list linkage */
+	struct hlist_node path_hlist;	/* __stp_tf_path_table linkage */
+	struct list_head any_path_list;	/* __stp_tf_any_path_list linkage */
 	struct list_head callback_list_head;
 	struct list_head callback_list;
 	struct utrace_engine_ops ops;
@@ -305,6 +350,13 @@ static void
 __stp_call_mmap_callbacks_for_task(struct stap_task_finder_target *tgt,
 				   struct task_struct *tsk);
 
+static inline struct hlist_head *
+__stp_tf_path_bucket(const char *path, size_t pathlen)
+{
+	u32 hash = jhash(path, pathlen, 0);
+	return &__stp_tf_path_table[hash & (__STP_TF_PATH_TABLE_SIZE - 1)];
+}
+
 static void
 stap_cleanup_task_finder_target(struct stap_task_finder_target *tgt)
 {
@@ -408,6 +460,13 @@ stap_register_task_finder_target(struct stap_task_finder_target *new_tgt)
 	if (! found_node) {
 		INIT_LIST_HEAD(&new_tgt->callback_list_head);
 		list_add_tail(&new_tgt->list, &__stp_task_finder_list);
+		if (new_tgt->pathlen > 0)
+			hlist_add_head(&new_tgt->path_hlist,
+				       __stp_tf_path_bucket(new_tgt->procname,
+							    new_tgt->pathlen));
+		else
+			list_add_tail(&new_tgt->any_path_list,
+				      &__stp_tf_any_path_list);
 		tgt = new_tgt;
 	}
 
@@ -924,14 +983,46 @@ __stp_call_mprotect_callbacks(struct stap_task_finder_target *tgt,
 	}
 }
 
+/* Attach the task to an exec'd-task target that matched it.  Returns
+ * nonzero if no further targets should be tried. */
+static inline int
+__stp_utrace_attach_match_target(struct task_struct *tsk, uid_t tsk_euid,
+				 struct stap_task_finder_target *tgt)
+{
+	int rc;
+
+#if ! STP_PRIVILEGE_CONTAINS (STP_PRIVILEGE, STP_PR_STAPDEV) && \
+    ! STP_PRIVILEGE_CONTAINS (STP_PRIVILEGE, STP_PR_STAPSYS)
+	/* Make sure unprivileged users only probe their own threads. */
+	if (_stp_uid != tsk_euid) {
+		if (tgt->pid != 0) {
+			_stp_warn("Process %d does not belong to unprivileged user %d",
+				  tsk->pid, _stp_uid);
+		}
+		return 0;
+	}
+#endif
+
+	// Set up events we need for attached tasks. We won't
+	// actually call the callbacks here - we'll call them
+	// when the thread gets quiesced.
+	rc = __stp_utrace_attach(tsk, &tgt->ops, tgt,
+				 __STP_ATTACHED_TASK_EVENTS,
+				 UTRACE_INTERRUPT);
+	if (rc != 0 && rc != EPERM)
+		return 1;
+	tgt->engine_attached = 1;
+	return 0;
+}
+
 static inline void
 __stp_utrace_attach_match_filename(struct task_struct *tsk,
 				   const char * const filename,
 				   int process_p)
 {
 	size_t filelen;
-	struct list_head *tgt_node;
 	struct stap_task_finder_target *tgt;
+	struct hlist_node *node;
 	uid_t tsk_euid;
 
 #ifdef STAPCONF_TASK_UID
@@ -944,55 +1035,37 @@ __stp_utrace_attach_match_filename(struct task_struct *tsk,
 #endif
 #endif
 	filelen = strlen(filename);
-	list_for_each(tgt_node, &__stp_task_finder_list) {
-		int rc;
 
-		tgt = list_entry(tgt_node, struct stap_task_finder_target,
-				 list);
-		// If we've got a matching procname or a matching build-id
-		// or we're probing all threads, we've got a match.  We've
-		// got to keep matching since a single thread could match a
-		// procname/build-id and match an "all thread" probe.
-		if (tgt == NULL)
-			continue;
-                /* buildid-based target ... gets checked in __stp_tf_quiesce_worker */
-                /* procname-based target */
-		else if (tgt->pathlen > 0
-			 && (tgt->pathlen != filelen
-			     || strcmp(tgt->procname, filename) != 0))
-		{
-			dbug_task(2, "target path NOT matched: [%s] != [%s]",
-			          tgt->procname, filename);
+	// If we've got a matching procname or a matching build-id
+	// or we're probing all threads, we've got a match.  We've
+	// got to keep matching since a single thread could match a
+	// procname/build-id and match an "all thread" probe.
+
+	/* procname-based target: registration merged any duplicates,
+	 * so at most one matches. */
+	stap_hlist_for_each_entry(tgt, node,
+				  __stp_tf_path_bucket(filename, filelen),
+				  path_hlist) {
+		if (tgt->pathlen != filelen
+		    || strcmp(tgt->procname, filename) != 0)
 			continue;
-		}
 		/* Ignore pid-based target, they were handled at startup. */
-		else if (tgt->pid != 0)
+		if (tgt->pid != 0)
+			break;
+		if (__stp_utrace_attach_match_target(tsk, tsk_euid, tgt))
+			return;
+		break;
+	}
+
+	list_for_each_entry(tgt, &__stp_tf_any_path_list, any_path_list) {
+		/* buildid-based target ... gets checked in __stp_tf_quiesce_worker */
+		/* Ignore pid-based target, they were handled at startup. */
+		if (tgt->pid != 0)
 			continue;
 		/* Notice that "pid == 0" (which means to probe all
 		 * threads) falls through. */
-
-#if ! STP_PRIVILEGE_CONTAINS (STP_PRIVILEGE, STP_PR_STAPDEV) && \
-    ! STP_PRIVILEGE_CONTAINS (STP_PRIVILEGE, STP_PR_STAPSYS)
-		/* Make sure unprivileged users only probe their own threads. */
-		if (_stp_uid != tsk_euid) {
-			if (tgt->pid != 0) {
-				_stp_warn("Process %d does not belong to unprivileged user %d",
-					  tsk->pid, _stp_uid);
-			}
-			continue;
-		}
-#endif
-
-
-		// Set up events we need for attached tasks. We won't
-		// actually call the callbacks here - we'll call them
-		// when the thread gets quiesced.
-		rc = __stp_utrace_attach(tsk, &tgt->ops, tgt,
-					 __STP_ATTACHED_TASK_EVENTS,
-					 UTRACE_INTERRUPT);
-		if (rc != 0 && rc != EPERM)
-			break;
-		tgt->engine_attached = 1;
+		if (__stp_utrace_attach_match_target(tsk, tsk_euid, tgt))
+			return;
 	}
 }
 
@@ -2012,7 +2085,7 @@ stap_stop_task_finder(void)
 	/* Now that all the engines are detached, make sure
 	 * all the callbacks are finished.  If they aren't, we'll
 	 * crash the kernel when the module is removed. */
-	while (atomic_read(&__stp_inuse_count) != 0) {
+	while (__stp_tf_handlers_inuse() != 0) {
 		schedule();
 #ifdef DEBUG_TASK_FINDER
 		i++;
@@ -13,6 +13,7 @@
 
 #include <linux/fs.h>
 #include <linux/list.h>
+#include <linux/hash.h>
 #include <linux/namei.h>
 #include <linux/mutex.h>
 #include <linux/spinlock.h>
@@ -96,6 +97,7 @@ struct stapiu_instance {
 */
 struct stapiu_process {
   struct list_head process_list;    // to find other processes
+  struct hlist_node process_hlist;  // to find the same process
 
   struct inode *inode;              // the inode* for solib or executable
   unsigned long relocation;         // the mmap'ed .text address
@@ -104,6 +106,11 @@ struct stapiu_process {
 };
 
 
+/* Each consumer's processes are also hashed by tgid, since uprobe
+   hits and mmaps need to find the records of one particular process. */
+#define STAPIU_PROCESS_TABLE_BITS 4
+#define STAPIU_PROCESS_TABLE_SIZE (1 << STAPIU_PROCESS_TABLE_BITS)
+
 /* A consumer is a declaration of a family of uprobes we want to
    place, on one or more IDENTICAL files specified by name or buildid.
    When a matching binaries are found, new stapiu_instances are
@@ -151,6 +158,7 @@ struct stapiu_consumer {
   struct list_head instance_list_head; // the resulting uprobe instances for this consumer
 
   struct list_head process_list_head; // the processes for this consumer
+  struct hlist_head process_table[STAPIU_PROCESS_TABLE_SIZE]; // ditto, by tgid
   spinlock_t process_list_lock; // protect list; used briefly from even atomic contexts
         
   // List of perf counters used by each probe
@@ -169,6 +177,28 @@ struct stapiu_consumer {
 static int
 stapiu_probe_handler (struct stapiu_consumer *c, struct pt_regs *regs);
 
+static inline struct hlist_head *
+stapiu_process_bucket(struct stapiu_consumer *c, pid_t tgid)
+{
+  return &c->process_table[hash_32((u32) tgid, STAPIU_PROCESS_TABLE_BITS)];
+}
+
+/* Add a process record to the consumer; process_list_lock held. */
+static inline void
+stapiu_process_add(struct stapiu_consumer *c, struct stapiu_process *p)
+{
+  list_add(&p->process_list, &c->process_list_head);
+  hlist_add_head(&p->process_hlist, stapiu_process_bucket(c, p->tgid));
+}
+
+/* Remove a process record from the consumer; process_list_lock held. */
+static inline void
+stapiu_process_del(struct stapiu_process *p)
+{
+  list_del(&p->process_list);
+  hlist_del(&p->process_hlist);
+}
+
 static inline struct inode *
 stap_get_real_inode(struct dentry *dentry)
 {
@@ -200,17 +230,16 @@ stapiu_probe_prehandler (struct uprobe_consumer *inst, struct pt_regs *regs)
   if (_stp_target) // need we filter by pid at all?
     {
       struct stapiu_process *p, *process = NULL;
+      struct hlist_node *node;
       unsigned long flags;
 
       // First find the related process, set by stapiu_change_plus.
-      // NB: This is a linear search performed for every probe hit!
-      // This could be an algorithmic problem if the list gets large,
-      // but we'll wait until this is demonstratedly a hotspot before
-      // optimizing.  NB: on rhel7 sometimes we're invoked from atomic
-      // context, so must be careful to use the spinlock, not the
-      // mutex.
+      // NB: on rhel7 sometimes we're invoked from atomic context, so
+      // must be careful to use the spinlock, not the mutex.
       spin_lock_irqsave(&c->process_list_lock, flags);
-      list_for_each_entry(p, &c->process_list_head, process_list) {
+      stap_hlist_for_each_entry(p, node,
+                                stapiu_process_bucket(c, current->tgid),
+                                process_hlist) {
 	if (p->tgid == current->tgid) {
 	  process = p;
 	  break;
@@ -415,7 +444,7 @@ stapiu_consumer_unreg(struct stapiu_consumer *c)
   // NB: it's hypothetically possible for the same process to show up
   // multiple times in the list.  Don't break after the first.
   list_for_each_entry_safe(p, tmp, &c->process_list_head, process_list) {
-    list_del(&p->process_list);
+    stapiu_process_del(p);
     // no refcount used for the inode field
     _stp_kfree (p);
   }
@@ -465,7 +494,7 @@ static int
 stapiu_init(struct stapiu_consumer *consumers, size_t nconsumers)
 {
   int ret = 0;
-  size_t i;
+  size_t i, j;
   bool mnt_ns_switched = false;
 
   might_sleep();
@@ -474,6 +503,8 @@ stapiu_init(struct stapiu_consumer *consumers, size_t nconsumers)
     struct stapiu_consumer *c = &consumers[i];
     INIT_LIST_HEAD(&c->instance_list_head);
     INIT_LIST_HEAD(&c->process_list_head);
+    for (j = 0; j < STAPIU_PROCESS_TABLE_SIZE; ++j)
+      INIT_HLIST_HEAD(&c->process_table[j]);
     mutex_init(&c->consumer_lock);
     spin_lock_init(&c->process_list_lock);
 
@@ -742,6 +773,7 @@ stapiu_change_semaphore_plus(struct stapiu_consumer* c, struct task_struct *task
 {
   int rc = 0;
   struct stapiu_process *p;
+  struct hlist_node *node;
   int any_found;
   unsigned long flags;
   
@@ -766,8 +798,9 @@ stapiu_change_semaphore_plus(struct stapiu_consumer* c, struct task_struct *task
   // call within the loop.  So we will hit only the first copy in our list.
   any_found = 0;
   spin_lock_irqsave(&c->process_list_lock, flags);
-  /* Look through all the consumer's processes and increment semaphores.  */
-  list_for_each_entry(p, &c->process_list_head, process_list) {
+  /* Look through the task's records and increment semaphores.  */
+  stap_hlist_for_each_entry(p, node, stapiu_process_bucket(c, task->tgid),
+                            process_hlist) {
     unsigned long addr = p->base + c->sdt_sem_offset;
     int rc2;
     if (p->tgid != task->tgid) continue; // skip other processes in the list
@@ -831,18 +864,21 @@ stapiu_change_minus(struct stapiu_consumer* c, struct task_struct *task,
   // But as an optimization - to avoid having them build up indefinitely,
   // and make semaphore operations go slowly, we will nuke matching entries anyway.
   unsigned long flags;
-  struct stapiu_process *p, *tmp;
+  struct stapiu_process *p;
+  struct hlist_node *node, *tmp;
   unsigned nmatch=0;
   
   spin_lock_irqsave(&c->process_list_lock, flags);
-  list_for_each_entry_safe(p, tmp, &c->process_list_head, process_list) {
+  stap_hlist_for_each_entry_safe(p, node, tmp,
+                                 stapiu_process_bucket(c, task->tgid),
+                                 process_hlist) {
     // we nuke by matching semaphore address (where ..._semaphore_plus wrote)
     // against the address range being unmapped
     unsigned long semaddr = p->base + c->sdt_sem_offset;
     if (p->tgid != task->tgid) // skip other processes in the list
       continue;
     if (semaddr >= addr && semaddr < addr + length) {
-      list_del(&p->process_list);
+      stapiu_process_del(p);
       _stp_kfree (p);
       nmatch ++;
     }
@@ -928,7 +964,7 @@ stapiu_process_found(struct stap_task_finder_target *tf_target,
         p->inode = inode;
         p->base = 0;
         spin_lock_irqsave (&c->process_list_lock, flags);
-        list_add(&p->process_list, &c->process_list_head);
+        stapiu_process_add(c, p);
         spin_unlock_irqrestore (&c->process_list_lock, flags);
       } else {
          _stp_warn("out of memory tracking executable in process %ld\n",
@@ -966,6 +1002,7 @@ stapiu_mmap_found(struct stap_task_finder_target *tf_target,
     container_of(tf_target, struct stapiu_consumer, finder);
   int rc = 0;
   struct stapiu_process* p;
+  struct hlist_node *node;
   int known_mapping_p;
   unsigned long flags;
   struct inode *real_inode = stap_get_real_inode(dentry);
@@ -1015,7 +1052,8 @@ stapiu_mmap_found(struct stap_task_finder_target *tf_target,
   
   known_mapping_p = 0;
   spin_lock_irqsave(&c->process_list_lock, flags);
-  list_for_each_entry(p, &c->process_list_head, process_list) {
+  stap_hlist_for_each_entry(p, node, stapiu_process_bucket(c, task->tgid),
+                            process_hlist) {
     if (p->tgid != task->tgid) continue;
     if (p->inode != real_inode) continue;
     known_mapping_p = 1;
@@ -1073,7 +1111,7 @@ stapiu_mmap_found(struct stap_task_finder_target *tf_target,
       p->inode = real_inode;
       p->base = addr-offset; // ... in case caught this during the second mmap
       spin_lock_irqsave (&c->process_list_lock, flags);
-      list_add(&p->process_list, &c->process_list_head);
+      stapiu_process_add(c, p);
       spin_unlock_irqrestore (&c->process_list_lock, flags);
     } else
       _stp_warn("out of memory tracking solib %s in process %ld\n",
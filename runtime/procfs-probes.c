@@ -30,6 +30,15 @@ struct stap_procfs_probe {
 	int needs_fill;
 	const int permissions;
 
+	/* A paged read probe is run again for each page of output,
+	 * rather than once per open.  fill_pos is the file offset of
+	 * the page currently in the buffer, and cursor is the script's
+	 * $cursor, which persists across the pages of one open. */
+	const int paged;
+	int eof;
+	loff_t fill_pos;
+	int64_t cursor;
+
 	struct mutex lock;
 	int opencount;
 	wait_queue_head_t waitq;
@@ -106,6 +115,9 @@ _stp_proc_open_file(struct inode *inode, struct file *filp)
 			spp->buffer[0] = '\0';
 			spp->count = 0;
 			spp->needs_fill = 1;
+			spp->eof = 0;
+			spp->fill_pos = 0;
+			spp->cursor = 0;
 		}
 	}
 
@@ -131,6 +143,54 @@ _stp_proc_release_file(struct inode *inode, struct file *filp)
 	return 0;
 }
 
+static ssize_t
+_stp_proc_read_paged(struct stap_procfs_probe *spp, char __user *buf,
+		     size_t count, loff_t *ppos)
+{
+	loff_t pos;
+	ssize_t retval;
+
+	_spp_lock(spp);
+
+	/* Only the current page is kept, so the only way back is a
+	 * rewind to the start, which restarts the script's cursor. */
+	if (*ppos < spp->fill_pos) {
+		if (*ppos != 0) {
+			retval = -ESPIPE;
+			goto out;
+		}
+		spp->fill_pos = 0;
+		spp->count = 0;
+		spp->cursor = 0;
+		spp->eof = 0;
+		spp->needs_fill = 1;
+	}
+
+	/* Once the current page has been consumed, ask for the next
+	 * one.  An empty page marks the end of the file. */
+	if (!spp->eof && *ppos >= spp->fill_pos + (loff_t)spp->count) {
+		spp->fill_pos = *ppos;
+		spp->count = 0;
+		spp->needs_fill = 1;
+	}
+	if (spp->needs_fill) {
+		spp->buffer[0] = '\0';
+		if ((retval = _stp_proc_fill_read_buffer(spp)))
+			goto out;
+		if (spp->count == 0)
+			spp->eof = 1;
+	}
+
+	pos = *ppos - spp->fill_pos;
+	retval = simple_read_from_buffer(buf, count, &pos, spp->buffer,
+					 spp->count);
+	if (retval > 0)
+		*ppos += retval;
+out:
+	_spp_unlock(spp);
+	return retval;
+}
+
 static ssize_t
 _stp_proc_read_file(struct file *file, char __user *buf, size_t count,
 		    loff_t *ppos) 
@@ -142,6 +202,9 @@ _stp_proc_read_file(struct file *file, char __user *buf, size_t count,
 		goto out;
 	}
 
+	if (spp->paged)
+		return _stp_proc_read_paged(spp, buf, count, ppos);
+
 	/* If needed, fill up the buffer.*/
 	if (spp->needs_fill) {
 		if ((retval = _stp_proc_fill_read_buffer(spp))) {
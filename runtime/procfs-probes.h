@@ -18,6 +18,7 @@ struct _stp_procfs_data {
 	char *buffer;
 	size_t bufsize;
 	size_t count;
+	int64_t *cursor;	/* paged read probes only, else NULL */
 };
 
 #ifndef STP_PROCFS_BUFSIZE
@@ -20,6 +20,7 @@
 #include "stp_utrace.h"
 #include <linux/bitmap.h>
 #include <linux/list.h>
+#include <linux/log2.h>
 #include <linux/sched.h>
 #include <linux/freezer.h>
 #include <linux/slab.h>
@@ -134,17 +135,69 @@ struct utrace {
 	struct task_work report_work;
 };
 
+/*
+ * The task table is sized by utrace_init() from the number of threads
+ * running at startup, so that chains stay short on hosts with very many
+ * threads.  TASK_UTRACE_HASH_BITS is the lower bound,
+ * TASK_UTRACE_HASH_BITS_MAX the upper one.
+ */
 #ifndef TASK_UTRACE_HASH_BITS
 #define TASK_UTRACE_HASH_BITS 8
 #endif
-#define TASK_UTRACE_TABLE_SIZE (1 << TASK_UTRACE_HASH_BITS)
+#ifndef TASK_UTRACE_HASH_BITS_MAX
+#define TASK_UTRACE_HASH_BITS_MAX 17
+#endif
+#if TASK_UTRACE_HASH_BITS_MAX < TASK_UTRACE_HASH_BITS
+#error "TASK_UTRACE_HASH_BITS_MAX must be >= TASK_UTRACE_HASH_BITS"
+#endif
+#define TASK_UTRACE_TABLE_SIZE (1U << task_utrace_hash_bits)
 
 struct utrace_bucket {
 	struct hlist_head head;
 	stp_spinlock_t lock;
 };
 
-static struct utrace_bucket task_utrace_table[TASK_UTRACE_TABLE_SIZE];
+static struct utrace_bucket *task_utrace_table;
+static unsigned int task_utrace_hash_bits;
+
+#ifdef STP_TIMING
+/* Table instrumentation, reported by utrace_exit(). */
+static atomic_t task_utrace_lookups = ATOMIC_INIT(0);
+static atomic_long_t task_utrace_lookup_steps = ATOMIC_LONG_INIT(0);
+static atomic_t task_utrace_max_chain = ATOMIC_INIT(0);
+static atomic_t task_utrace_lock_contended = ATOMIC_INIT(0);
+
+static void utrace_bucket_note_chain(int len)
+{
+	int max;
+
+	atomic_inc(&task_utrace_lookups);
+	atomic_long_add(len, &task_utrace_lookup_steps);
+	while ((max = atomic_read(&task_utrace_max_chain)) < len
+	       && atomic_cmpxchg(&task_utrace_max_chain, max, len) != max)
+		;
+}
+
+#define utrace_bucket_lock_irqsave(bucket, flags)			\
+	do {								\
+		local_irq_save(flags);					\
+		if (!stp_spin_trylock(&(bucket)->lock)) {		\
+			atomic_inc(&task_utrace_lock_contended);	\
+			stp_spin_lock(&(bucket)->lock);			\
+		}							\
+	} while (0)
+#define utrace_bucket_unlock_irqrestore(bucket, flags)			\
+	do {								\
+		stp_spin_unlock(&(bucket)->lock);			\
+		local_irq_restore(flags);				\
+	} while (0)
+#else
+#define utrace_bucket_note_chain(len) ((void)(len))
+#define utrace_bucket_lock_irqsave(bucket, flags)			\
+	stp_spin_lock_irqsave(&(bucket)->lock, flags)
+#define utrace_bucket_unlock_irqrestore(bucket, flags)			\
+	stp_spin_unlock_irqrestore(&(bucket)->lock, flags)
+#endif
 
 /* Tracepoint reporting is delayed using task_work structures stored
    in the following linked list: */
@@ -354,14 +407,42 @@ stp_signal_wake_up(struct task_struct *t, bool resume)
 }
 
 
+/*
+ * Pick the table size for the threads currently on the system, leaving
+ * room for them to double before chains average more than one entry.
+ */
+static unsigned int utrace_table_bits(void)
+{
+	struct task_struct *grp, *tsk;
+	unsigned long nr_tasks = 0;
+	unsigned int bits;
+
+	rcu_read_lock();
+	for_each_process_thread(grp, tsk)
+		nr_tasks++;
+	rcu_read_unlock();
+
+	bits = nr_tasks ? ilog2(nr_tasks) + 2 : 0;
+	return clamp_t(unsigned int, bits,
+		       TASK_UTRACE_HASH_BITS, TASK_UTRACE_HASH_BITS_MAX);
+}
+
 static int utrace_init(void)
 {
-	int i;
+	unsigned int i;
 	int rc = -1;
 
 	if (unlikely(stp_task_work_init() != 0))
 		goto error;
 
+	task_utrace_hash_bits = utrace_table_bits();
+	task_utrace_table = _stp_vzalloc(TASK_UTRACE_TABLE_SIZE
+					 * sizeof(struct utrace_bucket));
+	if (unlikely(task_utrace_table == NULL)) {
+		_stp_error("Can't allocate the utrace task table!");
+		goto error;
+	}
+
 	/* initialize the list heads */
 	for (i = 0; i < TASK_UTRACE_TABLE_SIZE; i++) {
 		struct utrace_bucket *bucket = &task_utrace_table[i];
@@ -447,6 +528,10 @@ error2:
 	STP_TRACE_UNREGISTER(sched_process_fork, utrace_report_clone);
 	tracepoint_synchronize_unregister();
 error:
+	if (task_utrace_table) {
+		_stp_vfree(task_utrace_table);
+		task_utrace_table = NULL;
+	}
 	return rc;
 }
 
@@ -454,7 +539,7 @@ static void utrace_cleanup(struct utrace_bucket *bucket, struct utrace *utrace);
 
 static int utrace_exit(void)
 {
-	int i;
+	unsigned int i;
 	struct utrace *utrace;
 	struct hlist_head *head;
 	struct hlist_node *node;
@@ -479,7 +564,7 @@ static int utrace_exit(void)
 #ifdef STP_TF_DEBUG
 	printk(KERN_ERR "%s:%d - freeing task-specific\n", __FUNCTION__, __LINE__);
 #endif
-	for (i = 0; i < TASK_UTRACE_TABLE_SIZE; i++) {
+	for (i = 0; task_utrace_table && i < TASK_UTRACE_TABLE_SIZE; i++) {
 		struct utrace_bucket *bucket = &task_utrace_table[i];
 
 		rcu_read_lock();
@@ -490,6 +575,29 @@ static int utrace_exit(void)
 		rcu_read_unlock();
 	}
 
+#if !defined(STP_STDOUT_NOT_ATTY) && defined(STP_TIMING)
+	/* PR13386: _stp_printf() needs preemption off, as for the
+	 * other timing reports. */
+	preempt_disable();
+	_stp_printf("----- utrace task table report:\n");
+	_stp_printf("buckets: %u, lookups: %d, avg chain: %ld, max chain: %d, "
+		    "contended bucket locks: %d\n", TASK_UTRACE_TABLE_SIZE,
+		    atomic_read(&task_utrace_lookups),
+		    atomic_read(&task_utrace_lookups)
+		    ? atomic_long_read(&task_utrace_lookup_steps)
+		      / atomic_read(&task_utrace_lookups) : 0L,
+		    atomic_read(&task_utrace_max_chain),
+		    atomic_read(&task_utrace_lock_contended));
+	preempt_enable();
+#endif
+	/* Wait for the RCU readers of the table before freeing it;
+	 * kfree_rcu() callbacks only touch the utrace structs. */
+	if (task_utrace_table) {
+		synchronize_rcu();
+		_stp_vfree(task_utrace_table);
+		task_utrace_table = NULL;
+	}
+
 	/* Likewise, free any task_work_list item(s). */
 	stp_spin_lock_irqsave(&__stp_utrace_task_work_list_lock, flags);
 	list_for_each_entry_safe(task_node, task_node2, &__stp_utrace_task_work_list, list) {
@@ -545,9 +653,9 @@ static void utrace_cleanup(struct utrace_bucket *bucket, struct utrace *utrace)
 	unsigned long flags;
 
 	/* Remove this utrace from the mapping list of tasks to struct utrace */
-	stp_spin_lock_irqsave(&bucket->lock, flags);
+	utrace_bucket_lock_irqsave(bucket, flags);
 	hlist_del_rcu(&utrace->hlist);
-	stp_spin_unlock_irqrestore(&bucket->lock, flags);
+	utrace_bucket_unlock_irqrestore(bucket, flags);
 
 	/* Put the reference on the task struct */
 	put_task_struct(utrace->task);
@@ -612,7 +720,7 @@ static void utrace_cancel_workers(struct utrace_bucket *bucket,
 
 static void utrace_cancel_all_task_work(void)
 {
-	int i;
+	unsigned int i;
 	struct utrace *utrace;
 	struct hlist_head *head;
 	struct hlist_node *utrace_node;
@@ -664,7 +772,7 @@ static void utrace_shutdown(void)
 
 static struct utrace_bucket *find_utrace_bucket(struct task_struct *task)
 {
-	return &task_utrace_table[hash_ptr(task, TASK_UTRACE_HASH_BITS)];
+	return &task_utrace_table[hash_ptr(task, task_utrace_hash_bits)];
 }
 
 static struct utrace *get_utrace_struct(struct utrace_bucket *bucket,
@@ -672,9 +780,11 @@ static struct utrace *get_utrace_struct(struct utrace_bucket *bucket,
 {
 	struct utrace *utrace, *found = NULL;
 	struct hlist_node *node;
+	int chain = 0;
 
 	rcu_read_lock();
 	stap_hlist_for_each_entry_rcu(utrace, node, &bucket->head, hlist) {
+		chain++;
 		if (utrace->task == task) {
 			if (atomic_add_unless(&utrace->refcount, 1, 0))
 				found = utrace;
@@ -682,6 +792,7 @@ static struct utrace *get_utrace_struct(struct utrace_bucket *bucket,
 		}
 	}
 	rcu_read_unlock();
+	utrace_bucket_note_chain(chain);
 
 	return found;
 }
@@ -718,9 +829,9 @@ static struct utrace *utrace_task_alloc(struct utrace_bucket *bucket,
 	atomic_set(&utrace->report_work_added, 0);
 	atomic_set(&utrace->refcount, 1);
 
-	stp_spin_lock_irqsave(&bucket->lock, flags);
+	utrace_bucket_lock_irqsave(bucket, flags);
 	hlist_add_head_rcu(&utrace->hlist, &bucket->head);
-	stp_spin_unlock_irqrestore(&bucket->lock, flags);
+	utrace_bucket_unlock_irqrestore(bucket, flags);
 	return utrace;
 }
 
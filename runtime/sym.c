@@ -22,9 +22,181 @@
 #include <asm/uaccess.h>
 #include <linux/list.h>
 #include <linux/module.h>
+#include <linux/sort.h>
 #ifdef STAPCONF_PROBE_KERNEL
 #include <linux/uaccess.h>
 #endif
+#include <linux/mutex.h>
+
+/* Sorted indexes over _stp_modules, so that address and name lookups
+   in probe context don't need to walk every module and section.  The
+   translator reserves two copies of each index; a rebuild sorts into
+   the unpublished copy and then publishes it by flipping
+   _stp_section_index_cur.  Readers note _stp_section_index_seq first
+   and fall back to a linear search if it moved underneath them, so
+   they never wait on a writer.  Until the first build (cur < 0) all
+   lookups are linear. */
+static atomic_t _stp_section_index_cur = ATOMIC_INIT(-1);
+static atomic_t _stp_section_index_seq = ATOMIC_INIT(0);
+static unsigned _stp_section_index_num[2];
+static int _stp_section_index_live;
+static DEFINE_MUTEX(_stp_section_index_mutex);
+
+static int _stp_section_ref_cmp(const void *a, const void *b)
+{
+  const struct _stp_section_ref *x = a, *y = b;
+  if (x->addr != y->addr)
+    return x->addr < y->addr ? -1 : 1;
+  return 0;
+}
+
+static int _stp_module_name_cmp(const void *a, const void *b)
+{
+  return strcmp((*(struct _stp_module * const *) a)->name,
+		(*(struct _stp_module * const *) b)->name);
+}
+
+static int _stp_section_index_begin(unsigned *seq)
+{
+  *seq = atomic_read(&_stp_section_index_seq);
+  smp_rmb();
+  return atomic_read(&_stp_section_index_cur);
+}
+
+static int _stp_section_index_retry(unsigned seq)
+{
+  smp_rmb();
+  return (unsigned) atomic_read(&_stp_section_index_seq) != seq;
+}
+
+/* Sort every module's sections into the unpublished copy, then
+   publish it.  Writers all run in process context (the control
+   channel, the module notifier, module init) and are serialized by
+   _stp_section_index_mutex, so the sort runs with interrupts on. */
+static void _stp_section_index_build(void)
+{
+  struct _stp_section_ref *idx;
+  struct _stp_module **names;
+  unsigned i, j, n = 0;
+  int cur, next;
+
+  might_sleep();
+  mutex_lock(&_stp_section_index_mutex);
+  cur = atomic_read(&_stp_section_index_cur);
+  next = (cur == 0) ? 1 : 0;
+  idx = &_stp_section_index[next * _stp_section_index_max];
+  names = &_stp_modules_by_name[next * _stp_num_modules];
+
+  /* Readers of the copy we're about to overwrite must retry. */
+  atomic_inc(&_stp_section_index_seq);
+  smp_wmb();
+
+  for (i = 0; i < _stp_num_modules; i++) {
+    struct _stp_module *mi = _stp_modules[i];
+    for (j = 0; j < mi->num_sections; j++) {
+      struct _stp_section *s = &mi->sections[j];
+      if (s->size == 0 || n == _stp_section_index_max)
+	continue;
+      idx[n].addr = s->static_addr;
+      idx[n].size = s->size;
+      idx[n].mod = mi;
+      idx[n].sec = s;
+      n++;
+    }
+    names[i] = mi;
+  }
+  sort(idx, n, sizeof(idx[0]), _stp_section_ref_cmp, NULL);
+  sort(names, _stp_num_modules, sizeof(names[0]),
+       _stp_module_name_cmp, NULL);
+
+  for (i = 0; i < n; i++) {
+    unsigned long end = idx[i].addr + idx[i].size;
+    idx[i].max_end = (i > 0 && idx[i-1].max_end > end) ? idx[i-1].max_end : end;
+  }
+  _stp_section_index_num[next] = n;
+
+  smp_wmb();
+  atomic_set(&_stp_section_index_cur, next);
+  mutex_unlock(&_stp_section_index_mutex);
+}
+
+/* Build the indexes once, after staprun's initial batch of
+   relocations, just before the probes start. */
+static void _stp_section_index_init(void)
+{
+  _stp_section_index_live = 1;
+  _stp_section_index_build();
+}
+
+/* Refresh the indexes after a batch of section moves (a module coming
+   or going, or _stp_module_self's name being filled in).  Moves before
+   _stp_section_index_init() are picked up by its build instead. */
+static void _stp_section_index_update(void)
+{
+  if (_stp_section_index_live)
+    _stp_section_index_build();
+}
+
+/* Look up a kernel module by name in the sorted name index.  Returns
+   NULL if there is no such module, or if the index can't be used and
+   the caller should search _stp_modules itself (*linear set). */
+static struct _stp_module *_stp_kmodule_by_name(const char *module,
+						 int *linear)
+{
+  struct _stp_module **names, *m = NULL;
+  unsigned seq, lo = 0, hi = _stp_num_modules;
+  int cur = _stp_section_index_begin(&seq);
+
+  *linear = 1;
+  if (cur < 0)
+    return NULL;
+
+  names = &_stp_modules_by_name[cur * _stp_num_modules];
+  while (lo < hi) {
+    unsigned mid = lo + (hi - lo) / 2;
+    int rc = strcmp(module, names[mid]->name);
+    if (rc == 0) {
+      m = names[mid];
+      break;
+    }
+    if (rc < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+
+  if (_stp_section_index_retry(seq))
+    return NULL;
+  *linear = 0;
+  return m;
+}
+
+/* Returns absolute address of offset into the named section of kernel
+   module m, or zero if there is no such section or it isn't in memory. */
+static unsigned long _stp_ksection_relocate(struct _stp_module *m,
+					    const char *section,
+					    unsigned long offset)
+{
+  unsigned j;
+
+  for (j = 0; j < m->num_sections; j++) {
+    struct _stp_section *s = &m->sections[j];
+    if (!strcmp(section, s->name)) {
+      /* mod and sec name match. tsk should match dynamic/static. */
+      if (s->static_addr != 0) {
+	unsigned long addr = offset + s->static_addr;
+	dbug_sym(1, "address=%lx\n", addr);
+	return addr;
+      } else {
+	/* static section, not in memory yet? */
+	dbug_sym(1, "section %s, not in memory yet?", s->name);
+	return 0;
+      }
+    }
+  }
+
+  return 0;
+}
 
 /* Returns absolute address of offset into kernel module/section.
    Returns zero when module and section couldn't be found
@@ -33,7 +205,9 @@ static unsigned long _stp_kmodule_relocate(const char *module,
 					   const char *section,
 					   unsigned long offset)
 {
-  unsigned i, j;
+  struct _stp_module *m;
+  unsigned i;
+  int linear;
 
   dbug_sym(1, "%s, %s, %lx\n", module, section, offset);
 
@@ -43,26 +217,16 @@ static unsigned long _stp_kmodule_relocate(const char *module,
     return offset;
   }
 
-  for (i = 0; i < _stp_num_modules; i++) {
-    struct _stp_module *m = _stp_modules[i];
-    if (strcmp(module, m->name)) /* duplication apprx. not possible for kernel */
-      continue;
+  /* duplication apprx. not possible for kernel, so the first match
+     is the only one. */
+  m = _stp_kmodule_by_name(module, &linear);
+  if (!linear)
+    return m ? _stp_ksection_relocate(m, section, offset) : 0;
 
-    for (j = 0; j < m->num_sections; j++) {
-      struct _stp_section *s = &m->sections[j];
-      if (!strcmp(section, s->name)) {
-	/* mod and sec name match. tsk should match dynamic/static. */
-	if (s->static_addr != 0) {
-	  unsigned long addr = offset + s->static_addr;
-	  dbug_sym(1, "address=%lx\n", addr);
-	  return addr;
-	} else {
-	  /* static section, not in memory yet? */
-	  dbug_sym(1, "section %s, not in memory yet?", s->name);
-	  return 0;
-	}
-      }
-    }
+  for (i = 0; i < _stp_num_modules; i++) {
+    m = _stp_modules[i];
+    if (!strcmp(module, m->name))
+      return _stp_ksection_relocate(m, section, offset);
   }
 
   return 0;
@@ -107,6 +271,44 @@ static struct _stp_module *_stp_kmod_sec_lookup(unsigned long addr,
 						struct _stp_section **sec)
 {
   unsigned midx = 0;
+  unsigned seq;
+  int cur = _stp_section_index_begin(&seq);
+
+  if (cur >= 0)
+    {
+      const struct _stp_section_ref *idx
+	= &_stp_section_index[cur * _stp_section_index_max];
+      struct _stp_module *m = NULL;
+      struct _stp_section *s = NULL;
+      unsigned lo = 0, hi = _stp_section_index_num[cur];
+
+      /* Find the last section starting at or below addr, then walk
+	 back over any earlier ones that still reach past it. */
+      while (lo < hi)
+	{
+	  unsigned mid = lo + (hi - lo) / 2;
+	  if (idx[mid].addr <= addr)
+	    lo = mid + 1;
+	  else
+	    hi = mid;
+	}
+      while (lo-- > 0 && idx[lo].max_end > addr)
+	{
+	  if (addr < idx[lo].addr + idx[lo].size)
+	    {
+	      m = idx[lo].mod;
+	      s = idx[lo].sec;
+	      break;
+	    }
+	}
+
+      if (! _stp_section_index_retry(seq))
+	{
+	  if (m && sec)
+	    *sec = s;
+	  return m;
+	}
+    }
 
   for (midx = 0; midx < _stp_num_modules; midx++)
     {
@@ -366,6 +568,65 @@ static void _stp_filename_lookup_5(struct _stp_module *mod, char ** filename,
                                    unsigned fileidx, int user, int compat_task,
                                    struct context *c);
 
+/* Look up addr in the line index precomputed by the translator.  A
+   row covers the addresses up to the next row, line 0 marks a gap.
+   After the first row of a block, each row is stored as a uleb128
+   (address delta << 1 | file changed), a sleb128 line delta, and the
+   uleb128 file index if it changed. */
+static unsigned long _stp_line_index_lookup(struct _stp_module *m,
+                                            unsigned long addr,
+                                            char ** filename, int need_filename)
+{
+  const struct _stp_line_block *b;
+  const u8 *linep, *endp;
+  unsigned long row_addr, row_linenum;
+  unsigned row_file_idx;
+  unsigned lo = 0, hi = m->num_line_blocks;
+
+  // find the last block starting at or below addr
+  while (lo < hi)
+    {
+      unsigned mid = lo + (hi - lo) / 2;
+      if (m->line_blocks[mid].addr <= addr)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  if (lo == 0)
+    return 0;
+
+  b = &m->line_blocks[lo - 1];
+  row_addr = b->addr;
+  row_linenum = b->line;
+  row_file_idx = b->file;
+  linep = m->line_deltas + b->offset;
+  endp = m->line_deltas + (lo < m->num_line_blocks
+                           ? m->line_blocks[lo].offset : m->line_deltas_len);
+  if (endp > m->line_deltas + m->line_deltas_len)
+    return 0;
+
+  while (linep < endp)
+    {
+      uleb128_t addr_adv = get_uleb128(&linep, endp);
+      unsigned long linenum = row_linenum + get_sleb128(&linep, endp);
+      unsigned file_idx = (addr_adv & 1) ? get_uleb128(&linep, endp) : row_file_idx;
+
+      if (linep > endp) // reading in the leb128 failed
+        return 0;
+      if (row_addr + (addr_adv >> 1) > addr)
+        break;
+      row_addr += addr_adv >> 1;
+      row_linenum = linenum;
+      row_file_idx = file_idx;
+    }
+
+  if (row_linenum == 0)
+    return 0;
+  if (need_filename && row_file_idx < m->num_line_files)
+    *filename = (char *) m->line_files[row_file_idx];
+  return row_linenum;
+}
+
 #endif /* STP_NEED_LINE_DATA */
 
 static unsigned long _stp_linenumber_lookup(unsigned long addr, struct task_struct *task,
@@ -403,7 +664,7 @@ static unsigned long _stp_linenumber_lookup(unsigned long addr, struct task_stru
   else
     m = _stp_kmod_sec_lookup(addr, &sec);
 
-  if (m == NULL || m->debug_line == NULL)
+  if (m == NULL || (m->debug_line == NULL && m->line_blocks == NULL))
     return 0;
 
   // if addr is a kernel address, it will need to be adjusted
@@ -424,6 +685,9 @@ static unsigned long _stp_linenumber_lookup(unsigned long addr, struct task_stru
       addr = addr - offset;
     }
 
+  if (m->line_blocks != NULL)
+    return _stp_line_index_lookup(m, addr, filename, need_filename);
+
   // The .debug_line section
   linep = m->debug_line;
   enddatap = m->debug_line + m->debug_line_len;
@@ -1111,12 +1375,13 @@ static void _stp_print_addr(unsigned long address, int flags,
 
 
 
-/* Update the given module/section's offset value.  Assume that there
-   is no need for locking or for super performance.  NB: this is only
-   for kernel modules, which exist singly at run time.  User-space
-   modules (executables, shared libraries) exist at different
-   addresses in different processes, so are tracked in the
-   _stp_tf_vma_map. */
+/* Update the given module/section's offset value.  Callers refresh
+   the sorted section index with _stp_section_index_update() once
+   they're done with a batch.  Assume that there is no need for
+   super performance.  NB: this is only for kernel modules, which
+   exist singly at run time.  User-space modules (executables, shared
+   libraries) exist at different addresses in different processes, so
+   are tracked in the _stp_tf_vma_map. */
 static void _stp_kmodule_update_address(const char* module,
                                         const char* reloc, /* NULL="all" */
                                         unsigned long address)
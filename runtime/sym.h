@@ -106,6 +106,16 @@ struct _stp_section {
 	unsigned long sec_load_offset;
 };
 
+/* A block of the translator's precomputed line index.  The block's
+   first row is stored here, the rest are delta-encoded at offset in
+   the module's line_deltas, see _stp_line_index_lookup. */
+struct _stp_line_block {
+	unsigned long addr;
+	uint32_t line;
+	uint32_t file;
+	uint32_t offset;
+};
+
 struct _stp_module {
         const char* name; /* module name (kernel) or /canonical/path for userspace*/
         const char* path; /* canonical filesystem path (kernel .ko or user) */
@@ -124,6 +134,15 @@ struct _stp_module {
 	uint32_t unwind_hdr_len;
 	uint32_t debug_line_len;
 	uint32_t debug_line_str_len;
+	/* Line index, sorted by address; used instead of debug_line
+	   when present. */
+	struct _stp_line_block *line_blocks;
+	uint8_t *line_deltas;
+	const char **line_files;
+	uint32_t num_line_blocks;
+	uint32_t line_deltas_len;
+	uint32_t num_line_files;
+
 	unsigned long eh_frame_addr; /* Orig load address (offset) .eh_frame */
 	unsigned long unwind_hdr_addr; /* same for .eh_frame_hdr */
 
@@ -134,10 +153,25 @@ struct _stp_module {
 	int build_id_len;
 };
 
+/* An entry of the address-sorted section index, see _stp_kmod_sec_lookup. */
+struct _stp_section_ref {
+	unsigned long addr;
+	unsigned long size;
+	unsigned long max_end; /* highest addr+size of this and earlier entries */
+	struct _stp_module *mod;
+	struct _stp_section *sec;
+};
+
 /* Defined by translator-generated stap-symbols.h. */
 extern struct _stp_module *_stp_modules [];
 extern const unsigned _stp_num_modules;
 
+/* Storage for the runtime's sorted lookup indexes, two copies each (see
+   _stp_section_index_build).  Also defined in stap-symbols.h. */
+extern struct _stp_section_ref _stp_section_index [];
+extern const unsigned _stp_section_index_max;
+extern struct _stp_module *_stp_modules_by_name [];
+
 /* Used in the unwinder to special case unwinding through kretprobes. */
 /* Initialized through translator (stap-symbols.h) relative to kernel */
 /* load address, fixup by transport symbols _stp_do_relocation */
@@ -160,6 +194,8 @@ static struct _stp_module *_stp_get_unwind_info (unsigned long addr);
 static void _stp_kmodule_update_address(const char* module,
                                         const char* section,
                                         unsigned long offset);
+static void _stp_section_index_init(void);
+static void _stp_section_index_update(void);
 
 #if (defined(STP_USE_DWARF_UNWINDER) && defined(STP_NEED_UNWIND_DATA)) \
     || defined(STP_NEED_LINE_DATA)
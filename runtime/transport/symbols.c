@@ -125,6 +125,7 @@ static void _stp_do_relocation(const char __user *buf, size_t count)
   }
 
   _stp_kmodule_update_address(msg.module, msg.reloc, msg.address);
+  _stp_section_index_update();
 }
 
 
@@ -284,6 +285,7 @@ static int _stp_module_notifier (struct notifier_block * nb,
 		/* Unregister all sections. */
 		dbug_sym(2, "unregister sections\n");
 		_stp_kmodule_update_address(mod->name, NULL, 0);
+		_stp_section_index_update();
         }
         else if (val != MODULE_STATE_GOING) {
 		return NOTIFY_DONE;
@@ -314,10 +316,12 @@ static int _stp_module_notifier (struct notifier_block * nb,
                 /* Verify build-id. */
                 if (_stp_kmodule_check (mod->name))
                    _stp_kmodule_update_address(mod->name, NULL, 0); /* Pretend it was never here. */
+                _stp_section_index_update();
         }
         else if (val == MODULE_STATE_GOING) {
                 /* Unregister all sections. */
                 _stp_kmodule_update_address(mod->name, NULL, 0);
+                _stp_section_index_update();
         }
 	else
 		return NOTIFY_DONE;
@@ -426,6 +430,8 @@ static int _stp_module_update_self (void)
 	}
 
         put_module_sect_attrs (&attrs);
+
+	_stp_section_index_update();
         
 #endif /* defined(CONFIG_KALLSYMS) */
 #endif /* (defined(STP_USE_DWARF_UNWINDER) && defined(STP_NEED_UNWIND_DATA))
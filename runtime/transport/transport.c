@@ -262,6 +262,9 @@ static void _stp_handle_start(struct _stp_msg_start *st)
                 rcu_read_unlock();
 #endif
 
+		/* All the startup relocations are in; index them. */
+		_stp_section_index_init();
+
 		st->res = systemtap_module_init();
 		if (st->res == 0) {
 			_stp_probes_started = 1;
@@ -1163,13 +1163,31 @@ divzero:
 #undef	POP
 }
 
+#if STP_UNWIND_CACHE_SIZE > 0
+/* Returns the rule cache slot for the pc (relative to the load address
+   of section sec) in the given unwind table.  All sections of a kernel
+   module share one table, and their pcs are section offsets, so the
+   section is part of the key.  The contexts holding the
+   cache are per-cpu and never used reentrantly, so no locking is
+   needed.  Hot call paths, e.g. under timer.profile, then skip the
+   FDE search and CFI interpretation entirely. */
+static struct unwind_rule_cache *
+unwind_rule_cache_slot(struct unwind_context *context, const void *table,
+		       const void *sec, unsigned long pc)
+{
+	unsigned long hash = pc ^ (pc >> 9) ^ ((unsigned long) table >> 4)
+			     ^ ((unsigned long) sec >> 6);
+	return &context->rule_cache[hash % STP_UNWIND_CACHE_SIZE];
+}
+#endif
+
 /* Unwind to previous to frame.  Returns 0 if successful, negative
  * number in case of an error.  A positive return means unwinding is finished;
  * don't try to fallback to dumping addresses on the stack. */
 static int unwind_frame(struct unwind_context *context,
 			struct _stp_module *m, struct _stp_section *s,
 			void *table, uint32_t table_len, int is_ehframe,
-			int user, int compat_task)
+			unsigned long load_base, int user, int compat_task)
 {
 	const u32 *fde = NULL, *cie = NULL;
 	/* The start and end of the CIE CFI instructions. */
@@ -1184,6 +1202,9 @@ static int unwind_frame(struct unwind_context *context,
 	uleb128_t retAddrReg = 0;
 	struct uw_state *state = &context->state;
 	unsigned long addr;
+#if STP_UNWIND_CACHE_SIZE > 0
+	struct unwind_rule_cache *cached = NULL;
+#endif
 
 	if (unlikely(table_len == 0)) {
 		// Don't _stp_warn about this, debug_frame and/or eh_frame
@@ -1196,6 +1217,20 @@ static int unwind_frame(struct unwind_context *context,
 		goto err;
 	}
 
+#if STP_UNWIND_CACHE_SIZE > 0
+	cached = unwind_rule_cache_slot(context, table, s, pc - load_base);
+	if (cached->table == table && cached->sec == s
+	    && cached->pc == pc - load_base
+	    && cached->compat_task == compat_task) {
+		dbug_unwind(1, "%s: cached rules for pc=%lx\n", m->path, pc);
+		state->stackDepth = 0;
+		memcpy(&REG_STATE, &cached->rules, sizeof(REG_STATE));
+		retAddrReg = cached->retAddrReg;
+		frame->call_frame = cached->call_frame;
+		goto apply_rules;
+	}
+#endif
+
 	/* Sets all rules to default Same value. */
 	memset(state, 0, sizeof(*state));
 
@@ -1307,6 +1342,18 @@ static int unwind_frame(struct unwind_context *context,
 	    || REG_STATE.regs[retAddrReg].where == Nowhere)
 		goto err;
 
+#if STP_UNWIND_CACHE_SIZE > 0
+	/* Remember the rules before the loops below resolve them. */
+	cached->table = table;
+	cached->sec = s;
+	cached->pc = pc - load_base;
+	cached->retAddrReg = retAddrReg;
+	cached->call_frame = call_frame;
+	cached->compat_task = compat_task;
+	memcpy(&cached->rules, &REG_STATE, sizeof(REG_STATE));
+
+apply_rules:
+#endif
 	/* update frame */
 	if (REG_STATE.cfa_is_expr) {
 		if (compute_expr(REG_STATE.cfa_expr, frame, &cfa, user, compat_task))
@@ -1481,6 +1528,7 @@ static int unwind(struct unwind_context *context, int user)
 	unsigned long pc = UNW_PC(frame) - frame->call_frame;
 	int res;
         const char *module_name = 0;
+	unsigned long load_base = 0, vm_offset = 0;
 	/* compat_task is a flag for 32bit process unwinding on a 64-bit
 	   architecture.  If this flag is set, it means a mapping of
 	   register numbers is required, as well as being aware of 32-bit
@@ -1495,14 +1543,20 @@ static int unwind(struct unwind_context *context, int user)
 
 	if (user)
 	  {
-	    m = _stp_umod_lookup (pc, current, & module_name, NULL, NULL, NULL);
+	    m = _stp_umod_lookup (pc, current, & module_name, & vm_offset,
+				  & load_base, NULL);
 	    if (m)
 	      s = &m->sections[0];
+	    /* Keys the rule cache by file offset, whichever mapping
+	       of the module pc is in. */
+	    load_base -= vm_offset;
 	  }
 	else
           {
             m = _stp_kmod_sec_lookup (pc, &s);
-            if (!m) {
+            if (m)
+              load_base = s->static_addr;
+            else {
 #ifdef STAPCONF_MODULE_TEXT_ADDRESS
                 struct module *ko;
                 preempt_disable();
@@ -1533,11 +1587,11 @@ static int unwind(struct unwind_context *context, int user)
 
 	dbug_unwind(1, "trying debug_frame\n");
 	res = unwind_frame (context, m, s, m->debug_frame,
-			    m->debug_frame_len, 0, user, compat_task);
+			    m->debug_frame_len, 0, load_base, user, compat_task);
 	if (res != 0) {
 	  dbug_unwind(1, "debug_frame failed: %d, trying eh_frame\n", res);
 	  res = unwind_frame (context, m, s, m->eh_frame,
-			      m->eh_frame_len, 1, user, compat_task);
+			      m->eh_frame_len, 1, load_base, user, compat_task);
 	}
 
         /* This situation occurs where some unwind data was found, but
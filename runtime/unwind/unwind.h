@@ -511,9 +511,30 @@ struct uw_state {
 	struct unwind_item cie_regs[ARRAY_SIZE(reg_info)];
 };
 
+/* Number of CFA rule sets remembered per unwind_context, i.e. per cpu
+   for each of kernel and user space.  Zero disables the cache. */
+#ifndef STP_UNWIND_CACHE_SIZE
+#define STP_UNWIND_CACHE_SIZE 64
+#endif
+
+/* The rules unwind_frame() derived from the CIE and FDE for one pc,
+   before they are applied to any registers. */
+struct unwind_rule_cache {
+	const void *table; /* debug_frame or eh_frame, NULL if unused */
+	const void *sec;   /* the section pc is relative to */
+	unsigned long pc;  /* relative to the section's load address */
+	uleb128_t retAddrReg;
+	signed call_frame;
+	int compat_task;
+	struct unwind_reg_state rules;
+};
+
 struct unwind_context {
     struct unwind_frame_info info;
     struct uw_state state;
+#if STP_UNWIND_CACHE_SIZE > 0
+    struct unwind_rule_cache rule_cache[STP_UNWIND_CACHE_SIZE];
+#endif
 };
 
 static const struct cfa badCFA = { ARRAY_SIZE(reg_info), 1 };
@@ -173,6 +173,7 @@ systemtap_session::systemtap_session ():
   use_server_on_error = false;
   try_server_status = try_server_unset;
   use_remote_prefix = false;
+  remote_jobs = 0;
   systemtap_v_check = false;
   download_dbinfo = 0;
   suppress_handler_errors = false;
@@ -371,6 +372,7 @@ systemtap_session::systemtap_session (const systemtap_session& other,
   use_server_on_error = other.use_server_on_error;
   try_server_status = other.try_server_status;
   use_remote_prefix = other.use_remote_prefix;
+  remote_jobs = other.remote_jobs;
   systemtap_v_check = other.systemtap_v_check;
   download_dbinfo = other.download_dbinfo;
   suppress_handler_errors = other.suppress_handler_errors;
@@ -729,6 +731,8 @@ systemtap_session::usage (int exitcode)
     "              may be repeated for targeting multiple hosts.\n"
     "   --remote-prefix\n"
     "              prefix each line of remote output with a host index.\n"
+    "   --remote-jobs=NUM\n"
+    "              build for, or upload to, at most NUM remotes at once.\n"
     "   --tmpdir=NAME\n"
     "              specify name of temporary directory to be used.\n"
     "   --download-debuginfo[=OPTION]\n"
@@ -1372,6 +1376,20 @@ systemtap_session::parse_cmdline (int argc, char * const argv [])
 	  use_remote_prefix = true;
 	  break;
 
+	case LONG_OPT_REMOTE_JOBS:
+	  if (client_options) {
+	    cerr << _F("ERROR: %s is invalid with %s", "--remote-jobs", "--client-options") << endl;
+	    return 1;
+	  }
+
+	  remote_jobs = strtoul(optarg, &num_endptr, 10);
+	  if (*num_endptr != '\0' || remote_jobs < 1)
+	    {
+	      cerr << _("Invalid number of remote jobs.") << endl;
+	      return 1;
+	    }
+	  break;
+
 	case LONG_OPT_CHECK_VERSION:
 	  server_args.push_back ("--check-version");
 	  systemtap_v_check = true;
@@ -326,6 +326,7 @@ public:
   // Remote execution
   std::vector<std::string> remote_uris;
   bool use_remote_prefix;
+  unsigned remote_jobs; // 0: automatic
   typedef std::map<std::pair<std::string, std::string>, systemtap_session*> session_map_t;
   session_map_t subsessions;
   systemtap_session* clone(const std::string& arch, const std::string& release);
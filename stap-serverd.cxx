@@ -28,6 +28,14 @@
 #include <iostream>
 #include <map>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <chrono>
+#include <limits>
 
 extern "C" {
 #include <unistd.h>
@@ -36,6 +44,7 @@ extern "C" {
 #include <glob.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/utsname.h>
 #include <sys/types.h>
 #include <pwd.h>
@@ -45,6 +54,7 @@ extern "C" {
 #include <ssl.h>
 #include <nss.h>
 #include <keyhi.h>
+#include <sechash.h>
 #include <regex.h>
 #include <dirent.h>
 #include <string.h>
@@ -81,6 +91,7 @@ extern int optind;
 static bool use_db_password;
 static unsigned short port;
 static long max_threads;
+static long max_queue;
 static size_t max_uncompressed_req_size;
 static size_t max_compressed_req_size;
 static string cert_db_path;
@@ -94,6 +105,8 @@ static string R_option;
 static string D_options;
 static bool   keep_temp;
 static string mok_path;
+static string response_cache_path;
+static long max_cache_entries;
 
 sem_t sem_client;
 static int pending_interrupts;
@@ -187,6 +200,8 @@ parse_options (int argc, char **argv)
 	LONG_OPT_SSL,
 	LONG_OPT_LOG,
 	LONG_OPT_MAXTHREADS,
+	LONG_OPT_MAXQUEUE,
+	LONG_OPT_MAXCACHE,
         LONG_OPT_MAXREQSIZE = 254,
         LONG_OPT_MAXCOMPRESSEDREQ = 255 /* need to set a value otherwise there are conflicts */
       };
@@ -195,6 +210,8 @@ parse_options (int argc, char **argv)
         { "ssl", 1, NULL, LONG_OPT_SSL },
         { "log", 1, NULL, LONG_OPT_LOG },
         { "max-threads", 1, NULL, LONG_OPT_MAXTHREADS },
+        { "max-queue", 1, NULL, LONG_OPT_MAXQUEUE },
+        { "max-cache-entries", 1, NULL, LONG_OPT_MAXCACHE },
         { "max-request-size", 1, NULL, LONG_OPT_MAXREQSIZE},
         { "max-compressed-request", 1, NULL, LONG_OPT_MAXCOMPRESSEDREQ},
         { NULL, 0, NULL, 0 }
@@ -256,6 +273,22 @@ parse_options (int argc, char **argv)
 	    fatal (_F("%s: invalid entry: max threads must not be negative '--max-threads=%s'",
 		      argv[0], optarg));
 	  break;
+	case LONG_OPT_MAXQUEUE:
+	  max_queue = strtol (optarg, &num_endptr, 0);
+	  if (*num_endptr != '\0')
+	    fatal (_F("%s: cannot parse number '--max-queue=%s'", argv[0], optarg));
+	  else if (max_queue < 0)
+	    fatal (_F("%s: invalid entry: max queue must not be negative '--max-queue=%s'",
+		      argv[0], optarg));
+	  break;
+	case LONG_OPT_MAXCACHE:
+	  max_cache_entries = strtol (optarg, &num_endptr, 0);
+	  if (*num_endptr != '\0')
+	    fatal (_F("%s: cannot parse number '--max-cache-entries=%s'", argv[0], optarg));
+	  else if (max_cache_entries < 0)
+	    fatal (_F("%s: invalid entry: max cache entries must not be negative '--max-cache-entries=%s'",
+		      argv[0], optarg));
+	  break;
         case LONG_OPT_MAXREQSIZE:
           maxsize_tmp =  strtoul(optarg, &num_endptr, 0); // store as a long for now
 	  if (*num_endptr != '\0')
@@ -882,6 +915,8 @@ initialize (int argc, char **argv) {
   use_db_password = false;
   port = 0;
   max_threads = thread::hardware_concurrency(); // Default to number of processors
+  max_queue = -1; // Default to 4 * max_threads, once that is known
+  max_cache_entries = 100;
   max_uncompressed_req_size = 50000; // 50 KB: default max uncompressed request size
   max_compressed_req_size = 5000; // 5 KB: default max compressed request size
   keep_temp = false;
@@ -893,6 +928,8 @@ initialize (int argc, char **argv) {
   // Parse the arguments. This also starts the server log, if any, and should be done before
   // any messages are issued.
   parse_options (argc, argv);
+  if (max_queue < 0 || max_threads == 0)
+    max_queue = 4 * max_threads;
 
   // PR11197: security prophylactics.
   // Reject use as root, except via a special environment variable.
@@ -920,6 +957,18 @@ initialize (int argc, char **argv) {
   // Where are the optional machine owner keys (MOK) this server
   // knows about?
   mok_path = server_cert_db_path() + "/moks";
+
+  // Where are complete responses cached?
+  if (max_cache_entries > 0)
+    {
+      response_cache_path = string (get_home_directory ()) + "/.systemtap/server-cache";
+      if (create_dir (response_cache_path.c_str (), 0700) != 0)
+        {
+          server_error (_F("Unable to create response cache %s: %s",
+                           response_cache_path.c_str (), strerror (errno)));
+          max_cache_entries = 0;
+        }
+    }
 }
 
 static void
@@ -1956,6 +2005,368 @@ check_uncompressed_request_size (const char * zip_file)
   return 0; // If it got to this point, everthing went well.
 }
 
+/* The response cache.  Many clients sending the identical request for
+ * the same kernel get one build: the response zip is kept under a hash
+ * of the unpacked request and of the server state that goes into the
+ * build, and concurrent requests for a key being built wait for it.  */
+struct response_build
+{
+  bool done;
+  condition_variable cv;
+  response_build (): done (false) {}
+};
+static mutex response_cache_mutex;
+static map<string, shared_ptr<response_build> > response_builds;
+
+static void
+hash_string (HASHContext *ctx, const string &str)
+{
+  // Include the NUL, so adjacent strings can't run together.
+  HASH_Update (ctx, (const unsigned char *) str.c_str (), str.size () + 1);
+}
+
+static void
+hash_stat (HASHContext *ctx, const string &path)
+{
+  ostringstream o;
+  struct stat st;
+  o << path;
+  if (stat (path.c_str (), &st) == 0)
+    o << ':' << st.st_ino << ':' << st.st_size << ':' << st.st_mtime;
+  hash_string (ctx, o.str ());
+}
+
+// Hash the names and contents of everything under dir, in a fixed order.
+static void
+hash_tree (HASHContext *ctx, const string &dir, const string &prefix)
+{
+  DIR *d = opendir (dir.c_str ());
+  if (! d)
+    return;
+  vector<string> names;
+  struct dirent *e;
+  while ((e = readdir (d)) != NULL)
+    if (strcmp (e->d_name, ".") != 0 && strcmp (e->d_name, "..") != 0)
+      names.push_back (e->d_name);
+  closedir (d);
+  sort (names.begin (), names.end ());
+
+  for (const string &name : names)
+    {
+      string path = dir + "/" + name;
+      struct stat st;
+      if (lstat (path.c_str (), &st) != 0)
+        continue;
+      if (S_ISDIR (st.st_mode))
+        hash_tree (ctx, path, prefix + name + "/");
+      else if (S_ISLNK (st.st_mode))
+        {
+          char target[PATH_MAX];
+          ssize_t len = readlink (path.c_str (), target, sizeof (target) - 1);
+          target[len > 0 ? len : 0] = '\0';
+          hash_string (ctx, prefix + name + " -> " + target);
+        }
+      else if (S_ISREG (st.st_mode))
+        {
+          hash_string (ctx, prefix + name);
+          ifstream f (path.c_str (), ios::binary);
+          char buf[4096];
+          while (f.read (buf, sizeof (buf)) || f.gcount () > 0)
+            HASH_Update (ctx, (const unsigned char *) buf, f.gcount ());
+        }
+    }
+}
+
+// The request carries the script, options, target kernel release,
+// privilege, locale and MOK fingerprints.  Add what the server brings:
+// its options, translator, kernel build trees, signing cert and MOKs.
+static string
+request_hash (const string &requestDirName, CERTCertificate *cert)
+{
+  HASHContext *ctx = HASH_Create (HASH_AlgSHA256);
+  if (! ctx)
+    return "";
+  HASH_Begin (ctx);
+
+  hash_string (ctx, stap_options);
+  hash_stat (ctx, getenv ("SYSTEMTAP_STAP") ?: STAP_PREFIX "/bin/stap");
+  for (const auto &kbt : kernel_build_tree)
+    {
+      hash_string (ctx, kbt.first);
+      hash_stat (ctx, kbt.second + "/.config");
+      hash_stat (ctx, kbt.second + "/Module.symvers");
+    }
+  hash_string (ctx, get_cert_serial_number (cert));
+  hash_stat (ctx, mok_path);
+  hash_tree (ctx, requestDirName, "");
+
+  unsigned char digest[HASH_LENGTH_MAX];
+  unsigned len = 0;
+  HASH_End (ctx, digest, &len, sizeof (digest));
+  HASH_Destroy (ctx);
+
+  ostringstream o;
+  o << hex << setfill ('0');
+  for (unsigned i = 0; i < len; i++)
+    o << setw (2) << (unsigned) digest[i];
+  return o.str ();
+}
+
+/* Answer the request from the cache if we can.  Otherwise, key is set
+ * to the cache key this thread is now building, and must be passed to
+ * response_cache_put once done.  */
+static bool
+response_cache_get (const string &requestDirName, const string &responseFileName,
+                    CERTCertificate *cert, string &key)
+{
+  key.clear ();
+  if (max_cache_entries <= 0)
+    return false;
+
+  string hash = request_hash (requestDirName, cert);
+  if (hash.empty ())
+    return false;
+  string cached = response_cache_path + "/" + hash + ".zip";
+
+  unique_lock<mutex> lock (response_cache_mutex);
+  map<string, shared_ptr<response_build> >::iterator it;
+  while ((it = response_builds.find (hash)) != response_builds.end ())
+    {
+      log (_F("Waiting for an identical request in progress (%s)", hash.c_str ()));
+      shared_ptr<response_build> b = it->second;
+      b->cv.wait (lock, [&]{ return b->done; });
+    }
+
+  if (file_exists (cached))
+    {
+      lock.unlock ();
+      utimes (cached.c_str (), NULL); // for LRU eviction
+      if (copy_file (cached, responseFileName))
+        {
+          log (_F("Serving cached response %s", hash.c_str ()));
+          return true;
+        }
+      // Evicted underneath us?  Just build it.
+      return false;
+    }
+
+  response_builds[hash] = make_shared<response_build> ();
+  key = hash;
+  return false;
+}
+
+static void
+response_cache_evict ()
+{
+  glob_t globber;
+  string pattern = response_cache_path + "/*.zip";
+  if (glob (pattern.c_str (), GLOB_ERR, NULL, &globber) != 0)
+    return;
+
+  vector<pair<time_t, string> > entries;
+  for (size_t i = 0; i < globber.gl_pathc; i++)
+    {
+      struct stat st;
+      if (stat (globber.gl_pathv[i], &st) == 0)
+        entries.push_back (make_pair (st.st_mtime, string (globber.gl_pathv[i])));
+    }
+  globfree (&globber);
+
+  if (entries.size () <= (size_t) max_cache_entries)
+    return;
+  sort (entries.begin (), entries.end ());
+  for (size_t i = 0; i < entries.size () - max_cache_entries; i++)
+    unlink (entries[i].second.c_str ());
+}
+
+/* Finish the build of key, started by response_cache_get.  Successful
+ * responses are cached; either way, anyone waiting is released.  */
+static void
+response_cache_put (string &key, const string &responseDirName,
+                    const string &responseFileName, bool ok)
+{
+  if (key.empty ())
+    return;
+
+  int staprc = 1;
+  if (ok && read_from_file (responseDirName + "/rc", staprc) == 0 && staprc == 0)
+    {
+      string cached = response_cache_path + "/" + key + ".zip";
+      string tmp = responseFileName + ".cache";
+      if (copy_file (responseFileName, tmp)
+          && rename (tmp.c_str (), cached.c_str ()) != 0)
+        unlink (tmp.c_str ());
+    }
+
+  lock_guard<mutex> lock (response_cache_mutex);
+  auto it = response_builds.find (key);
+  if (it != response_builds.end ())
+    {
+      it->second->done = true;
+      it->second->cv.notify_all ();
+      response_builds.erase (it);
+    }
+  if (staprc == 0)
+    response_cache_evict ();
+  key.clear ();
+}
+
+/* The build scheduler.  Up to --max-threads plus --max-queue connections
+ * are accepted and read concurrently, but only --max-threads stap builds
+ * run at once, and fewer if the host is short of memory or very loaded.
+ * Waiting builds are started by, in order: fewest builds already running
+ * for the same client, then shortest expected build time (from the time
+ * the same request, or else the client's requests, took before) less the
+ * time waited so far, so that long jobs don't starve.  */
+struct build_job
+{
+  string client;
+  string key;
+  double expected; // seconds
+  unsigned long seq;
+  chrono::steady_clock::time_point queued;
+  chrono::steady_clock::time_point started;
+};
+static mutex build_mutex;
+static condition_variable build_cv;
+static vector<build_job *> build_queue;
+static map<string, unsigned> builds_by_client;
+static long builds_running;
+static unsigned long build_seq;
+static map<string, double> build_times;        // request hash -> seconds
+static map<string, double> client_build_times; // client -> seconds
+#define BUILD_TIMES_MAX 1000
+#define BUILD_DEFAULT_TIME_S 30.0
+#define BUILD_MIN_AVAIL_KB (512 * 1024)
+
+// Fold a new sample into a running estimate.
+static void
+note_build_time (map<string, double> &times, const string &key, double secs)
+{
+  if (times.size () >= BUILD_TIMES_MAX && times.find (key) == times.end ())
+    times.clear ();
+  auto it = times.find (key);
+  if (it == times.end ())
+    times[key] = secs;
+  else
+    it->second = (it->second * 3 + secs) / 4;
+}
+
+static long
+mem_available_kb ()
+{
+  ifstream meminfo ("/proc/meminfo");
+  string name;
+  long kb;
+  while (meminfo >> name >> kb)
+    {
+      if (name == "MemAvailable:")
+        return kb;
+      meminfo.ignore (numeric_limits<streamsize>::max (), '\n');
+    }
+  return -1;
+}
+
+// Can another build start now?  Called with build_mutex held.
+static bool
+build_resources_available ()
+{
+  if (builds_running == 0)
+    return true;
+  if (builds_running >= max_threads)
+    return false;
+
+  long avail = mem_available_kb ();
+  if (avail >= 0 && avail < BUILD_MIN_AVAIL_KB)
+    return false;
+
+  double load;
+  long cpus = thread::hardware_concurrency ();
+  if (cpus > 0 && getloadavg (&load, 1) == 1 && load > 2 * cpus)
+    return false;
+
+  return true;
+}
+
+// The queued job that should run next.  Called with build_mutex held.
+static build_job *
+next_build_job ()
+{
+  auto now = chrono::steady_clock::now ();
+  build_job *best = NULL;
+  unsigned best_running = 0;
+  double best_score = 0;
+  for (build_job *job : build_queue)
+    {
+      auto it = builds_by_client.find (job->client);
+      unsigned running = (it == builds_by_client.end ()) ? 0 : it->second;
+      double waited = chrono::duration<double> (now - job->queued).count ();
+      double score = job->expected - waited;
+      if (! best || running < best_running
+          || (running == best_running && (score < best_score
+                                           || (score == best_score && job->seq < best->seq))))
+        {
+          best = job;
+          best_running = running;
+          best_score = score;
+        }
+    }
+  return best;
+}
+
+static void
+build_start (build_job &job)
+{
+  unique_lock<mutex> lock (build_mutex);
+
+  auto it = build_times.find (job.key);
+  if (it != build_times.end ())
+    job.expected = it->second;
+  else if ((it = client_build_times.find (job.client)) != client_build_times.end ())
+    job.expected = it->second;
+  else
+    job.expected = BUILD_DEFAULT_TIME_S;
+  job.seq = build_seq++;
+  job.queued = chrono::steady_clock::now ();
+  build_queue.push_back (&job);
+
+  if (next_build_job () != &job || ! build_resources_available ())
+    log (_F("Request from %s queued (%zu waiting, %ld running)",
+            job.client.c_str (), build_queue.size (), builds_running));
+  while (next_build_job () != &job || ! build_resources_available ())
+    // Wake up now and then anyway, to recheck memory and load.
+    build_cv.wait_for (lock, chrono::seconds (1));
+
+  build_queue.erase (find (build_queue.begin (), build_queue.end (), &job));
+  builds_running++;
+  builds_by_client[job.client]++;
+  job.started = chrono::steady_clock::now ();
+  double waited = chrono::duration<double> (job.started - job.queued).count ();
+  log (_F("Starting build for %s after %.1fs in queue (%zu waiting, %ld running, expected %.1fs)",
+          job.client.c_str (), waited, build_queue.size (), builds_running, job.expected));
+
+  // Someone else may be at the head of the queue now.
+  build_cv.notify_all ();
+}
+
+static void
+build_finish (build_job &job)
+{
+  double secs = chrono::duration<double> (chrono::steady_clock::now () - job.started).count ();
+  lock_guard<mutex> lock (build_mutex);
+
+  builds_running--;
+  if (--builds_by_client[job.client] == 0)
+    builds_by_client.erase (job.client);
+  if (! job.key.empty ())
+    note_build_time (build_times, job.key, secs);
+  note_build_time (client_build_times, job.client, secs);
+  log (_F("Build for %s took %.1fs (%zu waiting, %ld running)",
+          job.client.c_str (), secs, build_queue.size (), builds_running));
+
+  build_cv.notify_all ();
+}
+
 /* Function:  void *handle_connection()
  *
  * Purpose: Handle a connection to a socket.  Copy in request zip
@@ -1978,6 +2389,7 @@ handle_connection (void *arg)
   char               responseFileName[PATH_MAX];
   string stapstderr; /* Cannot be global since we need a unique
                         copy for each connection.*/
+  string cache_key;
   vector<string>     argv;
   PRInt32            bytesRead;
   int		     retlen;
@@ -2128,24 +2540,48 @@ handle_connection (void *arg)
       goto cleanup;
     }
 
-  /* Handle the request zip file.  An error therein should still result
-     in a response zip file (containing stderr etc.) so we don't have to
-     have a result code here.  */
-  handleRequest(requestDirName, responseDirName, stapstderr);
-
-  /* Zip the response. */
-  int ziprc;
-  argv = { "zip", "-q", "-r", responseFileName, "." };
-  rc = spawn_and_wait (argv, &ziprc, NULL, NULL, NULL, responseDirName);
-  if (rc != PR_SUCCESS || ziprc != 0)
+  /* Serve identical requests from the cache.  */
+  if (! response_cache_get (requestDirName, responseFileName, cert, cache_key))
     {
-      server_error (_("Unable to compress server response"));
-      goto cleanup;
+      /* Handle the request zip file.  An error therein should still result
+	 in a response zip file (containing stderr etc.) so we don't have to
+	 have a result code here.  */
+      if (max_threads > 0)
+	{
+	  build_job job;
+	  char client[1024];
+	  if (PR_NetAddrToString (&addr, client, sizeof (client)) != PR_SUCCESS)
+	    strcpy (client, "unknown");
+	  job.client = client;
+	  job.key = cache_key.empty () ? request_hash (requestDirName, cert) : cache_key;
+
+	  build_start (job);
+	  handleRequest(requestDirName, responseDirName, stapstderr);
+	  build_finish (job);
+	}
+      else
+	handleRequest(requestDirName, responseDirName, stapstderr);
+
+      /* Zip the response. */
+      int ziprc;
+      argv = { "zip", "-q", "-r", responseFileName, "." };
+      rc = spawn_and_wait (argv, &ziprc, NULL, NULL, NULL, responseDirName);
+      response_cache_put (cache_key, responseDirName, responseFileName,
+			  rc == PR_SUCCESS && ziprc == 0);
+      if (rc != PR_SUCCESS || ziprc != 0)
+	{
+	  server_error (_("Unable to compress server response"));
+	  goto cleanup;
+	}
     }
 
   secStatus = writeDataToSocket (sslSocket, responseFileName);
 
 cleanup:
+  // Release anyone waiting on a build we didn't finish.
+  if (! cache_key.empty ())
+    response_cache_put (cache_key, responseDirName, responseFileName, false);
+
   if (sslSocket)
     if (PR_Close (sslSocket) != PR_SUCCESS)
       {
@@ -2253,17 +2689,18 @@ accept_connections (PRFileDesc *listenSocket, CERTCertificate *cert)
 
       /* Accepted the connection, now handle it. */
 
-      /* Wait for a thread to finish if there are none available */
+      /* Wait for a thread to finish if there are none available.
+         Builds are limited separately, see build_start.  */
       if(max_threads >0)
         {
           int idle_threads;
           sem_getvalue(&sem_client, &idle_threads);
           if(idle_threads <= 0)
             log(_("Server is overloaded. Processing times may be longer than normal."));
-          else if (idle_threads == max_threads)
+          else if (idle_threads == max_threads + max_queue)
             log(_("Processing 1 request..."));
           else
-            log(_F("Processing %d concurrent requests...", ((int)max_threads - idle_threads) + 1));
+            log(_F("Processing %d concurrent requests...", ((int)(max_threads + max_queue) - idle_threads) + 1));
 
           sem_wait(&sem_client);
         }
@@ -2379,9 +2816,9 @@ server_main (PRFileDesc *listenSocket)
    * If we got here from an interrupt, exit immediately if
    * the timeout is reached. Otherwise, wait indefinitiely
    * until the threads exit (or an interrupt is recieved).*/
-  if(idle_threads < max_threads)
-    log(_F("Waiting for %d outstanding requests to complete...", (int)max_threads - idle_threads));
-  while(idle_threads < max_threads)
+  if(idle_threads < max_threads + max_queue)
+    log(_F("Waiting for %d outstanding requests to complete...", (int)(max_threads + max_queue) - idle_threads));
+  while(idle_threads < max_threads + max_queue)
     {
       if(pending_interrupts && timeout++ > CONCURRENCY_TIMEOUT_S)
         {
@@ -2508,7 +2945,7 @@ listen ()
   log (_F("Using network address [%s]:%hu", buf, port));
 
   if (max_threads > 0)
-    log (_F("Using a maximum of %ld threads", max_threads));
+    log (_F("Using a maximum of %ld threads, queueing up to %ld more requests", max_threads, max_queue));
   else
     log (_("Concurrency disabled"));
 
@@ -2522,10 +2959,10 @@ listen ()
       goto done;
     }
 
-  /* Initialize semephore with the maximum number of threads
-   * defined by --max-threads. If it is not defined, the
-   * default is the number of processors */
-  sem_init(&sem_client, 0, max_threads);
+  /* Initialize semephore with the maximum number of connections:
+   * the threads defined by --max-threads (by default the number of
+   * processors) plus the requests which may wait for one of them. */
+  sem_init(&sem_client, 0, max_threads > 0 ? max_threads + max_queue : 0);
 
   // Loop forever. We check our certificate (and regenerate, if necessary) and then start the
   // server. The server will go down when our certificate is no longer valid (e.g. expired). We
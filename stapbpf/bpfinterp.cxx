@@ -18,6 +18,10 @@
  */
 
 #include <sys/time.h>
+#include <time.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
@@ -26,7 +30,13 @@
 #include <deque>
 #include <algorithm>
 #include <type_traits>
+#include <mutex>
+#include <unordered_map>
+#include <fstream>
+#include <sstream>
 #include <inttypes.h>
+#include <libelf.h>
+#include <gelf.h>
 #include "bpfinterp.h"
 #include "libbpf.h"
 #include "../bpf-internal.h"
@@ -164,6 +174,17 @@ foreach_state_add(const foreach_info &fi, foreach_state &s,
     }
 }
 
+// Saves a key for iteration in map order, without a sort column:
+void
+foreach_state_add_unsorted(const foreach_info &fi, foreach_state &s,
+                           uint64_t *kp)
+{
+  uint64_t *kp2 = (uint64_t *)malloc(fi.keysize);
+  memcpy(kp2, kp, fi.keysize);
+  s.keys.push_back(kp2);
+  s.int_sorted.push_back(std::pair<int64_t, uint64_t *>(0, kp2));
+}
+
 bool
 foreach_cmp_str(const std::pair<std::string, void *> &a,
                 const std::pair<std::string, void *> &b)
@@ -246,7 +267,7 @@ _foreach_state_next(const foreach_info &fi, /* XXX foreach_state &s, */
   if (sorted.empty())
     return -1;
 
-  if (fi.sort_direction > 0)
+  if (fi.sort_direction >= 0) // -- unsorted snapshots are in map order
     {
       std::pair<T,uint64_t*> item = sorted.front();
       convert_key(fi, item.second, (uint64_t *)next_key,
@@ -299,6 +320,102 @@ foreach_state_cleanup(foreach_state &s)
     free(ptr);
 }
 
+// A loop left with break never makes its final map_get_next_key
+// call, so its state stays on the stack.  Since loops nest, any state
+// above that of foreach_id belongs to such a loop and is dropped; with
+// including_self, the state of foreach_id itself is dropped as well
+// (the loop is starting over).  States of enclosing loops are kept.
+void
+foreach_stack_unwind(foreach_stack &st, uint64_t foreach_id,
+                     bool including_self)
+{
+  size_t n = st.size();
+  while (n > 0 && st[n-1].foreach_id != foreach_id)
+    n--;
+  if (n == 0) // -- no state for this loop
+    return;
+  if (including_self)
+    n--;
+  while (st.size() > n)
+    {
+      foreach_state_cleanup(st.back());
+      st.pop_back();
+    }
+}
+
+// Number of elements requested per BPF_MAP_LOOKUP_BATCH call:
+#define BPF_MAP_BATCH_SIZE 4096
+
+bool
+map_batch_supported(const bpf_map_def &attrs)
+{
+  // XXX: Per-cpu maps return ncpus values per key; since foreach
+  // does not yet iterate over them (PR24528), keep them on the
+  // bpf_get_next_key path.
+  return (attrs.type == BPF_MAP_TYPE_HASH
+          || attrs.type == BPF_MAP_TYPE_LRU_HASH
+          || attrs.type == BPF_MAP_TYPE_ARRAY);
+}
+
+// Takes a snapshot of the map with BPF_MAP_LOOKUP_BATCH, which
+// costs one syscall per batch rather than two per element.
+// Returns false if the kernel rejected the batch operation before
+// anything was added to s, in which case the caller should fall back
+// to bpf_get_next_key.
+bool
+foreach_state_fill_batch(const foreach_info &fi, foreach_state &s,
+                         int fd, const bpf_map_def &attrs,
+                         bool unsorted, bool use_val,
+                         bool key_long, bool val_long)
+{
+  unsigned batch_size = BPF_MAP_BATCH_SIZE;
+  size_t token_size = std::max<size_t>(attrs.key_size, sizeof(uint64_t));
+  std::vector<char> in_batch(token_size), out_batch(token_size);
+  std::vector<char> keys, values;
+  bool first = true;
+
+  while (true)
+    {
+      unsigned count = batch_size;
+      keys.resize((size_t)count * attrs.key_size);
+      values.resize((size_t)count * attrs.value_size);
+
+      int rc = bpf_lookup_batch(fd, first ? NULL : in_batch.data(),
+                                out_batch.data(), keys.data(),
+                                values.data(), &count);
+      if (rc && errno == ENOSPC && count == 0)
+        {
+          // A hash bucket did not fit into the batch; retry with more room.
+          batch_size *= 2;
+          continue;
+        }
+      if (rc && errno != ENOENT)
+        {
+          if (first)
+            return false;
+          stapbpf_abort("bpf_map_get_next_key BUG: batched map lookup failed");
+        }
+
+      for (unsigned k = 0; k < count; k++)
+        {
+          uint64_t *kp = (uint64_t *)&keys[(size_t)k * attrs.key_size];
+          uint64_t *vp = (uint64_t *)&values[(size_t)k * attrs.value_size];
+          if (unsorted)
+            foreach_state_add_unsorted(fi, s, kp);
+          else if (use_val)
+            foreach_state_add(fi, s, kp, vp, val_long);
+          else
+            foreach_state_add(fi, s, kp, kp, key_long);
+        }
+
+      if (rc) // ENOENT: this was the last batch
+        break;
+      in_batch.swap(out_batch);
+      first = false;
+    }
+  return true;
+}
+
 // Wrapper for bpf_get_next_key that includes logic for accessing
 // keys in ascending or descending order, or
 // (PR23858) in ascending or descending order by value.
@@ -356,6 +473,8 @@ map_get_next_key(int fd_idx, int64_t key, int64_t next_key,
   bool val_long = ctx->map_attrs[fd_idx].value_size != BPF_MAXSTRINGLEN;
   //bool val_str = !val_long;
 
+  foreach_stack_unwind(foreach_ctx, foreach_id, !key);
+
   // Check iteration limit
   if (limit == 0)
     {
@@ -381,8 +500,15 @@ map_get_next_key(int fd_idx, int64_t key, int64_t next_key,
       return -1;
     }
 
+  // Batched lookups snapshot the map even when no sorting is needed:
+  bool unsorted = fi.sort_direction == 0;
+  bool batch = ctx->map_batch && map_batch_supported(ctx->map_attrs[fd_idx]);
+  if (unsorted && batch && key
+      && (foreach_ctx.empty() || foreach_ctx.back().foreach_id != foreach_id))
+    batch = false; // -- snapshot was not taken; continue key by key
+
   // Handle fi.sort_direction==0, where no foreach_ctx is needed
-  if (fi.sort_direction == 0)
+  if (unsorted && !batch)
     {
       // handle scalar long values being passed directly
       if (key_long)
@@ -413,7 +539,7 @@ map_get_next_key(int fd_idx, int64_t key, int64_t next_key,
       return rc;
     }
 
-  // Sort the map on initial iteration
+  // Snapshot and sort the map on initial iteration
   if (!key)
     {
       // handle both uint64_t and string column types
@@ -423,11 +549,18 @@ map_get_next_key(int fd_idx, int64_t key, int64_t next_key,
       uint64_t *kp = (uint64_t *)_k;
       uint64_t *np = (uint64_t *)_n;
       foreach_state s;
+      s.foreach_id = foreach_id;
 
-      int rc = bpf_get_next_key(fd, 0, as_ptr(np));
+      int rc = -1;
+      if (!batch
+          || !foreach_state_fill_batch(fi, s, fd, ctx->map_attrs[fd_idx],
+                                       unsorted, use_val, key_long, val_long))
+        rc = bpf_get_next_key(fd, 0, as_ptr(np));
       while (!rc)
         {
-          if (use_val)
+          if (unsorted)
+            foreach_state_add_unsorted(fi, s, np);
+          else if (use_val)
             {
               char _v[BPF_MAXKEYLEN_PLUS];
               _v[BPF_MAXSTRINGLEN] = _v[BPF_MAXKEYLEN] = '\0';
@@ -446,7 +579,8 @@ map_get_next_key(int fd_idx, int64_t key, int64_t next_key,
           memcpy(kp, np, fi.keysize);
           rc = bpf_get_next_key(fd, as_ptr(kp), as_ptr(np));
         }
-      foreach_state_sort(s);
+      if (!unsorted)
+        foreach_state_sort(s);
       if (foreach_state_empty(s))
         return -1;
       foreach_ctx.push_back(s);
@@ -586,6 +720,15 @@ stapbpf_stat_get(bpf::globals::agg_idx agg_id, uint64_t idx,
   uint64_t *count_data = stapbpf_stat_get_percpu(sd["count"], idx, ctx);
   uint64_t *sum_data = stapbpf_stat_get_percpu(sd["sum"], idx, ctx);
 
+  // Each field of a wrapping (LRU) statistics array is evicted on its
+  // own; an element missing from either map is treated as evicted:
+  if (!count_data != !sum_data)
+    {
+      free(count_data);
+      free(sum_data);
+      count_data = sum_data = NULL;
+    }
+
   // TODO PR23476: Simplified code for now.
   agg.shift = 0;
   agg.count = 0;
@@ -659,6 +802,330 @@ bpf_get_target()
   return target_pid;
 }
 
+// Symbol tables used to print stacks collected by backtrace() and
+// ubacktrace(). They are loaded on first use and kept for the rest of
+// the run, with each resolved address cached; procfs probes run on
+// separate threads, hence the lock:
+struct stack_sym {
+  uint64_t addr;
+  uint64_t size;
+  std::string name;
+  bool operator<(const stack_sym &o) const { return addr < o.addr; }
+};
+
+struct stack_elf_syms {
+  std::vector<stack_sym> syms;
+  std::vector<GElf_Phdr> loads; // -- PT_LOAD segments, to map file offsets
+};
+
+struct stack_mapping {
+  uint64_t start, end, offset;
+  std::string path;
+  bool operator==(const stack_mapping &o) const
+  {
+    return start == o.start && end == o.end && offset == o.offset
+      && path == o.path;
+  }
+};
+
+// The executable mappings and resolved addresses of one process:
+struct stack_process {
+  std::vector<stack_mapping> mappings;
+  std::unordered_map<uint64_t, std::string> sym_cache;
+};
+
+static std::mutex stack_syms_lock;
+static std::vector<stack_sym> kernel_syms; // -- module in the name suffix
+static bool kernel_syms_loaded = false;
+static std::unordered_map<uint64_t, std::string> kernel_sym_cache;
+static std::unordered_map<std::string, stack_elf_syms> user_elf_syms;
+static std::unordered_map<uint64_t, stack_process> user_processes; // -- by tgid
+static time_t target_snapshot_time = 0;
+
+static void
+load_kernel_syms()
+{
+  kernel_syms_loaded = true;
+  std::ifstream syms("/proc/kallsyms");
+  std::string line;
+  while (std::getline(syms, line))
+    {
+      std::istringstream ss(line);
+      std::string addr, type, name, module;
+      if (!(ss >> addr >> type >> name))
+        continue;
+      if (type != "t" && type != "T" && type != "w" && type != "W")
+        continue;
+      if (!(ss >> module))
+        module = "[kernel]";
+      stack_sym sym = { strtoull(addr.c_str(), NULL, 16), 0,
+                        name + " " + module };
+      if (sym.addr != 0)
+        kernel_syms.push_back(sym);
+    }
+  std::sort(kernel_syms.begin(), kernel_syms.end());
+  // kallsyms has no sizes; assume each symbol extends to the next one:
+  for (size_t i = 0; i + 1 < kernel_syms.size(); i++)
+    kernel_syms[i].size = kernel_syms[i+1].addr - kernel_syms[i].addr;
+}
+
+// Returns the symbol containing addr, or NULL:
+static const stack_sym *
+find_stack_sym(const std::vector<stack_sym> &syms, uint64_t addr)
+{
+  stack_sym key = { addr, 0, "" };
+  auto it = std::upper_bound(syms.begin(), syms.end(), key);
+  if (it == syms.begin())
+    return NULL;
+  --it;
+  if (it->size != 0 && addr >= it->addr + it->size)
+    return NULL;
+  return &*it;
+}
+
+static std::string
+format_stack_sym(const stack_sym *sym, uint64_t addr, const std::string &module)
+{
+  char buf[64];
+  snprintf(buf, sizeof(buf), "+0x%" PRIx64 "/0x%" PRIx64,
+           addr - sym->addr, sym->size);
+  if (module.empty()) // -- kernel symbol names end with the module
+    {
+      size_t sp = sym->name.find(' ');
+      return sym->name.substr(0, sp) + buf + sym->name.substr(sp);
+    }
+  return sym->name + buf + " [" + module + "]";
+}
+
+static const std::string &
+kernel_stack_sym(uint64_t addr)
+{
+  auto it = kernel_sym_cache.find(addr);
+  if (it != kernel_sym_cache.end())
+    return it->second;
+
+  if (!kernel_syms_loaded)
+    load_kernel_syms();
+  const stack_sym *sym = find_stack_sym(kernel_syms, addr);
+  std::string &res = kernel_sym_cache[addr];
+  res = sym ? format_stack_sym(sym, addr, "") : "[unknown]";
+  return res;
+}
+
+static stack_elf_syms &
+load_user_elf_syms(const std::string &path)
+{
+  auto it = user_elf_syms.find(path);
+  if (it != user_elf_syms.end())
+    return it->second;
+
+  stack_elf_syms &es = user_elf_syms[path];
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return es;
+  Elf *elf = elf_begin(fd, ELF_C_READ, NULL);
+  if (elf)
+    {
+      size_t nphdrs = 0;
+      if (elf_getphdrnum(elf, &nphdrs) == 0)
+        for (size_t i = 0; i < nphdrs; i++)
+          {
+            GElf_Phdr phdr;
+            if (gelf_getphdr(elf, i, &phdr) && phdr.p_type == PT_LOAD)
+              es.loads.push_back(phdr);
+          }
+
+      // Prefer .symtab, falling back to .dynsym for stripped binaries:
+      Elf_Scn *symtab = NULL, *dynsym = NULL;
+      GElf_Shdr shdr;
+      for (Elf_Scn *scn = elf_nextscn(elf, NULL); scn;
+           scn = elf_nextscn(elf, scn))
+        if (gelf_getshdr(scn, &shdr))
+          {
+            if (shdr.sh_type == SHT_SYMTAB)
+              symtab = scn;
+            else if (shdr.sh_type == SHT_DYNSYM)
+              dynsym = scn;
+          }
+      Elf_Scn *scn = symtab ? symtab : dynsym;
+      Elf_Data *data = scn ? elf_getdata(scn, NULL) : NULL;
+      if (data && gelf_getshdr(scn, &shdr) && shdr.sh_entsize != 0)
+        {
+          size_t nsyms = shdr.sh_size / shdr.sh_entsize;
+          for (size_t i = 0; i < nsyms; i++)
+            {
+              GElf_Sym sym;
+              if (!gelf_getsym(data, i, &sym)
+                  || GELF_ST_TYPE(sym.st_info) != STT_FUNC
+                  || sym.st_value == 0)
+                continue;
+              const char *name = elf_strptr(elf, shdr.sh_link, sym.st_name);
+              if (name)
+                es.syms.push_back({ sym.st_value, sym.st_size, name });
+            }
+          std::sort(es.syms.begin(), es.syms.end());
+        }
+      elf_end(elf);
+    }
+  close(fd);
+  return es;
+}
+
+// Reads the executable mappings of pid, returning false if the
+// process is gone:
+static bool
+read_user_mappings(uint64_t pid, std::vector<stack_mapping> &mappings)
+{
+  std::ifstream maps("/proc/" + std::to_string(pid) + "/maps");
+  if (!maps)
+    return false;
+
+  std::string line;
+  while (std::getline(maps, line))
+    {
+      std::istringstream ss(line);
+      std::string range, perms, offset, dev, inode, path;
+      if (!(ss >> range >> perms >> offset >> dev >> inode >> path)
+          || path[0] != '/' || perms.find('x') == std::string::npos)
+        continue;
+      stack_mapping m;
+      m.start = strtoull(range.c_str(), NULL, 16);
+      m.end = strtoull(range.substr(range.find('-') + 1).c_str(), NULL, 16);
+      m.offset = strtoull(offset.c_str(), NULL, 16);
+      m.path = path;
+      mappings.push_back(m);
+    }
+  return !mappings.empty(); // -- a zombie has no mappings left
+}
+
+// Stacks are usually printed from end probes, by which time a -c
+// target has normally exited.  So stapbpf calls this periodically
+// while the script runs, keeping the target's last known mappings:
+void
+bpf_snapshot_target_mappings()
+{
+  if (target_pid <= 0)
+    return;
+
+  std::lock_guard<std::mutex> guard(stack_syms_lock);
+  time_t now = time(NULL);
+  if (now == target_snapshot_time)
+    return;
+  target_snapshot_time = now;
+
+  // A -c target is a fork of stapbpf until it execs the command:
+  std::string exe = "/proc/" + std::to_string(target_pid) + "/exe";
+  char path[PATH_MAX], self[PATH_MAX];
+  ssize_t len = readlink(exe.c_str(), path, sizeof(path) - 1);
+  ssize_t self_len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+  if (len < 0 || (len == self_len && memcmp(path, self, len) == 0))
+    return;
+
+  std::vector<stack_mapping> mappings;
+  if (!read_user_mappings(target_pid, mappings))
+    return;
+  stack_process &proc = user_processes[target_pid];
+  if (proc.mappings == mappings)
+    return;
+  proc.mappings.swap(mappings);
+  proc.sym_cache.clear();
+}
+
+// Returns the process a user stack was recorded in, reading its
+// mappings on first use, or NULL if they can't be found:
+static stack_process *
+user_stack_process(uint64_t tgid)
+{
+  auto it = user_processes.find(tgid);
+  if (it != user_processes.end())
+    return &it->second;
+
+  std::vector<stack_mapping> mappings;
+  if (!read_user_mappings(tgid, mappings))
+    return NULL;
+  stack_process &proc = user_processes[tgid];
+  proc.mappings.swap(mappings);
+  return &proc;
+}
+
+static const std::string &
+user_stack_sym(stack_process &proc, uint64_t addr)
+{
+  auto it = proc.sym_cache.find(addr);
+  if (it != proc.sym_cache.end())
+    return it->second;
+
+  std::string &res = proc.sym_cache[addr];
+  res = "[unknown]";
+  for (const stack_mapping &m : proc.mappings)
+    {
+      if (addr < m.start || addr >= m.end)
+        continue;
+
+      // Translate the address into the ELF file's own address space:
+      uint64_t file_ofs = addr - m.start + m.offset;
+      stack_elf_syms &es = load_user_elf_syms(m.path);
+      for (const GElf_Phdr &phdr : es.loads)
+        if (file_ofs >= phdr.p_offset
+            && file_ofs < phdr.p_offset + phdr.p_filesz)
+          {
+            uint64_t vaddr = file_ofs - phdr.p_offset + phdr.p_vaddr;
+            const stack_sym *sym = find_stack_sym(es.syms, vaddr);
+            if (sym)
+              res = format_stack_sym(sym, vaddr, m.path);
+            break;
+          }
+      if (res[0] == '[')
+        {
+          char buf[32];
+          snprintf(buf, sizeof(buf), "0x%" PRIx64, file_ofs);
+          res = "[" + m.path + "+" + buf + "]";
+        }
+      break;
+    }
+  return res;
+}
+
+// Prints the stack stored under id in the stack trace map, one frame
+// per line, in the same format as the kernel runtime's print_stack().
+// User stack ids carry the tgid of the process in their upper 32 bits
+// (see ubacktrace()) and are resolved against that process; if its
+// mappings are unknown, only the addresses are printed:
+uint64_t
+bpf_print_stackid(uint64_t map, int64_t id, uint64_t flags,
+                  bpf_transport_context *ctx)
+{
+  if (id < 0) // -- bpf_get_stackid() failed, nothing was recorded
+    return 0;
+
+  bool user = flags & BPF_F_USER_STACK;
+  uint64_t tgid = user ? (uint64_t)id >> 32 : 0;
+
+  std::vector<uint64_t> ips(ctx->map_attrs[map].value_size / sizeof(uint64_t));
+  uint32_t key = id & 0xffffffff;
+  if (bpf_lookup_elem((*ctx->map_fds)[map], &key, ips.data()) != 0)
+    return 0;
+
+  std::lock_guard<std::mutex> guard(stack_syms_lock);
+  stack_process *proc = user ? user_stack_process(tgid) : NULL;
+
+  for (uint64_t ip : ips)
+    {
+      if (ip == 0)
+        break;
+      if (user && !proc)
+        {
+          fprintf(ctx->output_f, " 0x%016" PRIx64 "\n", ip);
+          continue;
+        }
+      const std::string &sym = user ? user_stack_sym(*proc, ip)
+                                    : kernel_stack_sym(ip);
+      fprintf(ctx->output_f, " 0x%016" PRIx64 " : %s\n", ip, sym.c_str());
+    }
+  fflush(ctx->output_f);
+  return 0;
+}
+
 uint64_t
 bpf_set_procfs_value(char* msg, bpf_transport_context* ctx)
 {
@@ -816,15 +1283,284 @@ bpf_handle_transport_msg(void *buf, size_t size,
   return LIBBPF_PERF_EVENT_CONT;
 }
 
+
+// The interpreter does not execute struct bpf_insn directly. Each
+// program is first decoded into a direct-threaded form, in which every
+// instruction carries the address of its handler, so that dispatch is
+// a single indirect jump rather than a switch on the opcode. Jump
+// targets, 64-bit immediates, map indices and helper ids are resolved
+// during decoding as well. Since begin/end/timer/procfs probes are
+// interpreted many times, the decoded form is cached per program.
+
+#define __BPF_THREADED_OP_MAPPER(FN) \
+  FN(ldx_b) FN(ldx_h) FN(ldx_w) FN(ldx_dw) \
+  FN(st_b) FN(st_h) FN(st_w) FN(st_dw) \
+  FN(stx_b) FN(stx_h) FN(stx_w) FN(stx_dw) \
+  FN(add64_x) FN(add64_k) FN(sub64_x) FN(sub64_k) \
+  FN(and64_x) FN(and64_k) FN(or64_x) FN(or64_k) \
+  FN(lsh64_x) FN(lsh64_k) FN(rsh64_x) FN(rsh64_k) \
+  FN(xor64_x) FN(xor64_k) FN(mul64_x) FN(mul64_k) \
+  FN(mov64_x) FN(mov64_k) FN(arsh64_x) FN(arsh64_k) \
+  FN(div64_x) FN(div64_k) FN(mod64_x) FN(mod64_k) FN(neg64) \
+  FN(add32_x) FN(add32_k) FN(sub32_x) FN(sub32_k) \
+  FN(and32_x) FN(and32_k) FN(or32_x) FN(or32_k) \
+  FN(lsh32_x) FN(lsh32_k) FN(rsh32_x) FN(rsh32_k) \
+  FN(xor32_x) FN(xor32_k) FN(mul32_x) FN(mul32_k) \
+  FN(mov32_x) FN(mov32_k) FN(arsh32_x) FN(arsh32_k) \
+  FN(div32_x) FN(div32_k) FN(mod32_x) FN(mod32_k) FN(neg32) \
+  FN(ld_imm64) FN(ld_map_invalid) FN(ld_imm64_invalid) \
+  FN(jeq_x) FN(jeq_k) FN(jne_x) FN(jne_k) \
+  FN(jgt_x) FN(jgt_k) FN(jge_x) FN(jge_k) \
+  FN(jsgt_x) FN(jsgt_k) FN(jsge_x) FN(jsge_k) \
+  FN(jset_x) FN(jset_k) FN(ja) \
+  FN(call_map_lookup_elem) FN(call_map_update_elem) \
+  FN(call_map_delete_elem) FN(call_ktime_get_ns) \
+  FN(call_perf_event_output) FN(call_trace_printk) \
+  FN(call_sprintf) FN(call_text_str) FN(call_string_quoted) \
+  FN(call_str_concat) FN(call_map_get_next_key) FN(call_stat_get) \
+  FN(call_gettimeofday_ns) FN(call_get_target) \
+  FN(call_set_procfs_value) FN(call_append_procfs_value) \
+  FN(call_get_procfs_value) FN(call_get_stackid) \
+  FN(call_print_stackid) FN(call_unknown) \
+  FN(exit) FN(end) FN(unknown)
+
+enum bpf_threaded_op {
+#define __BPF_THREADED_OP_ENUM(x) bpf_op_##x,
+  __BPF_THREADED_OP_MAPPER(__BPF_THREADED_OP_ENUM)
+#undef __BPF_THREADED_OP_ENUM
+  bpf_op_max
+};
+
+struct bpf_threaded_insn {
+  const void *handler;   // -- address of the handler label in bpf_interpret
+  uint8_t dst_reg;
+  uint8_t src_reg;
+  int16_t off;
+  uint64_t imm;          // -- sign-extended imm, or the full LD_IMM64 value
+  const bpf_threaded_insn *target; // -- resolved jump target
+};
+
+typedef std::vector<bpf_threaded_insn> bpf_threaded_prog;
+
+// Programs are identified by their (immutable) instruction buffer.
+// procfs probes run on separate threads, hence the lock:
+static std::mutex threaded_progs_lock;
+static std::unordered_map<const struct bpf_insn *,
+                          bpf_threaded_prog> threaded_progs;
+
+static bpf_threaded_op
+bpf_threaded_call_op(int32_t func_id)
+{
+  switch (func_id)
+    {
+    case BPF_FUNC_map_lookup_elem:       return bpf_op_call_map_lookup_elem;
+    case BPF_FUNC_map_update_elem:       return bpf_op_call_map_update_elem;
+    case BPF_FUNC_map_delete_elem:       return bpf_op_call_map_delete_elem;
+    case BPF_FUNC_ktime_get_ns:          return bpf_op_call_ktime_get_ns;
+    case BPF_FUNC_perf_event_output:     return bpf_op_call_perf_event_output;
+    case BPF_FUNC_trace_printk:          return bpf_op_call_trace_printk;
+    case bpf::BPF_FUNC_sprintf:          return bpf_op_call_sprintf;
+    case bpf::BPF_FUNC_text_str:         return bpf_op_call_text_str;
+    case bpf::BPF_FUNC_string_quoted:    return bpf_op_call_string_quoted;
+    case bpf::BPF_FUNC_str_concat:       return bpf_op_call_str_concat;
+    case bpf::BPF_FUNC_map_get_next_key: return bpf_op_call_map_get_next_key;
+    case bpf::BPF_FUNC_stapbpf_stat_get: return bpf_op_call_stat_get;
+    case bpf::BPF_FUNC_gettimeofday_ns:  return bpf_op_call_gettimeofday_ns;
+    case bpf::BPF_FUNC_get_target:       return bpf_op_call_get_target;
+    case bpf::BPF_FUNC_set_procfs_value: return bpf_op_call_set_procfs_value;
+    case bpf::BPF_FUNC_append_procfs_value:
+      return bpf_op_call_append_procfs_value;
+    case bpf::BPF_FUNC_get_procfs_value: return bpf_op_call_get_procfs_value;
+    case BPF_FUNC_get_stackid:           return bpf_op_call_get_stackid;
+    case bpf::BPF_FUNC_print_stackid:    return bpf_op_call_print_stackid;
+    default:                             return bpf_op_call_unknown;
+    }
+}
+
+// Selects the handler for a single instruction. Malformed instructions
+// are mapped to handlers that report the problem when (and only when)
+// they are actually executed, as the switch-based interpreter did.
+static bpf_threaded_op
+bpf_threaded_op_for(size_t ninsns, const struct bpf_insn insns[], size_t k,
+                    size_t nmaps)
+{
+  const struct bpf_insn *i = &insns[k];
+  bool x = i->code & BPF_X;
+
+  switch (i->code)
+    {
+    case BPF_LDX | BPF_MEM | BPF_B:  return bpf_op_ldx_b;
+    case BPF_LDX | BPF_MEM | BPF_H:  return bpf_op_ldx_h;
+    case BPF_LDX | BPF_MEM | BPF_W:  return bpf_op_ldx_w;
+    case BPF_LDX | BPF_MEM | BPF_DW: return bpf_op_ldx_dw;
+
+    case BPF_ST | BPF_MEM | BPF_B:   return bpf_op_st_b;
+    case BPF_ST | BPF_MEM | BPF_H:   return bpf_op_st_h;
+    case BPF_ST | BPF_MEM | BPF_W:   return bpf_op_st_w;
+    case BPF_ST | BPF_MEM | BPF_DW:  return bpf_op_st_dw;
+    case BPF_STX | BPF_MEM | BPF_B:  return bpf_op_stx_b;
+    case BPF_STX | BPF_MEM | BPF_H:  return bpf_op_stx_h;
+    case BPF_STX | BPF_MEM | BPF_W:  return bpf_op_stx_w;
+    case BPF_STX | BPF_MEM | BPF_DW: return bpf_op_stx_dw;
+
+    case BPF_ALU64 | BPF_ADD | BPF_X:
+    case BPF_ALU64 | BPF_ADD | BPF_K:  return x ? bpf_op_add64_x : bpf_op_add64_k;
+    case BPF_ALU64 | BPF_SUB | BPF_X:
+    case BPF_ALU64 | BPF_SUB | BPF_K:  return x ? bpf_op_sub64_x : bpf_op_sub64_k;
+    case BPF_ALU64 | BPF_AND | BPF_X:
+    case BPF_ALU64 | BPF_AND | BPF_K:  return x ? bpf_op_and64_x : bpf_op_and64_k;
+    case BPF_ALU64 | BPF_OR  | BPF_X:
+    case BPF_ALU64 | BPF_OR  | BPF_K:  return x ? bpf_op_or64_x : bpf_op_or64_k;
+    case BPF_ALU64 | BPF_LSH | BPF_X:
+    case BPF_ALU64 | BPF_LSH | BPF_K:  return x ? bpf_op_lsh64_x : bpf_op_lsh64_k;
+    case BPF_ALU64 | BPF_RSH | BPF_X:
+    case BPF_ALU64 | BPF_RSH | BPF_K:  return x ? bpf_op_rsh64_x : bpf_op_rsh64_k;
+    case BPF_ALU64 | BPF_XOR | BPF_X:
+    case BPF_ALU64 | BPF_XOR | BPF_K:  return x ? bpf_op_xor64_x : bpf_op_xor64_k;
+    case BPF_ALU64 | BPF_MUL | BPF_X:
+    case BPF_ALU64 | BPF_MUL | BPF_K:  return x ? bpf_op_mul64_x : bpf_op_mul64_k;
+    case BPF_ALU64 | BPF_MOV | BPF_X:
+    case BPF_ALU64 | BPF_MOV | BPF_K:  return x ? bpf_op_mov64_x : bpf_op_mov64_k;
+    case BPF_ALU64 | BPF_ARSH | BPF_X:
+    case BPF_ALU64 | BPF_ARSH | BPF_K: return x ? bpf_op_arsh64_x : bpf_op_arsh64_k;
+    case BPF_ALU64 | BPF_DIV | BPF_X:
+    case BPF_ALU64 | BPF_DIV | BPF_K:  return x ? bpf_op_div64_x : bpf_op_div64_k;
+    case BPF_ALU64 | BPF_MOD | BPF_X:
+    case BPF_ALU64 | BPF_MOD | BPF_K:  return x ? bpf_op_mod64_x : bpf_op_mod64_k;
+    case BPF_ALU64 | BPF_NEG:          return bpf_op_neg64;
+
+    case BPF_ALU | BPF_ADD | BPF_X:
+    case BPF_ALU | BPF_ADD | BPF_K:  return x ? bpf_op_add32_x : bpf_op_add32_k;
+    case BPF_ALU | BPF_SUB | BPF_X:
+    case BPF_ALU | BPF_SUB | BPF_K:  return x ? bpf_op_sub32_x : bpf_op_sub32_k;
+    case BPF_ALU | BPF_AND | BPF_X:
+    case BPF_ALU | BPF_AND | BPF_K:  return x ? bpf_op_and32_x : bpf_op_and32_k;
+    case BPF_ALU | BPF_OR  | BPF_X:
+    case BPF_ALU | BPF_OR  | BPF_K:  return x ? bpf_op_or32_x : bpf_op_or32_k;
+    case BPF_ALU | BPF_LSH | BPF_X:
+    case BPF_ALU | BPF_LSH | BPF_K:  return x ? bpf_op_lsh32_x : bpf_op_lsh32_k;
+    case BPF_ALU | BPF_RSH | BPF_X:
+    case BPF_ALU | BPF_RSH | BPF_K:  return x ? bpf_op_rsh32_x : bpf_op_rsh32_k;
+    case BPF_ALU | BPF_XOR | BPF_X:
+    case BPF_ALU | BPF_XOR | BPF_K:  return x ? bpf_op_xor32_x : bpf_op_xor32_k;
+    case BPF_ALU | BPF_MUL | BPF_X:
+    case BPF_ALU | BPF_MUL | BPF_K:  return x ? bpf_op_mul32_x : bpf_op_mul32_k;
+    case BPF_ALU | BPF_MOV | BPF_X:
+    case BPF_ALU | BPF_MOV | BPF_K:  return x ? bpf_op_mov32_x : bpf_op_mov32_k;
+    case BPF_ALU | BPF_ARSH | BPF_X:
+    case BPF_ALU | BPF_ARSH | BPF_K: return x ? bpf_op_arsh32_x : bpf_op_arsh32_k;
+    case BPF_ALU | BPF_DIV | BPF_X:
+    case BPF_ALU | BPF_DIV | BPF_K:  return x ? bpf_op_div32_x : bpf_op_div32_k;
+    case BPF_ALU | BPF_MOD | BPF_X:
+    case BPF_ALU | BPF_MOD | BPF_K:  return x ? bpf_op_mod32_x : bpf_op_mod32_k;
+    case BPF_ALU | BPF_NEG:          return bpf_op_neg32;
+
+    case BPF_LD | BPF_IMM | BPF_DW:
+      if (k + 1 >= ninsns) // -- truncated LD_IMM64
+        return bpf_op_ld_imm64_invalid;
+      switch (i->src_reg)
+        {
+        case 0:
+          return bpf_op_ld_imm64;
+        case BPF_PSEUDO_MAP_FD:
+          // TODO: Signal a proper error for an invalid map index.
+          return (uint64_t)(int64_t)i->imm >= nmaps
+            ? bpf_op_ld_map_invalid : bpf_op_ld_imm64;
+        default:
+          return bpf_op_ld_imm64_invalid;
+        }
+
+    case BPF_JMP | BPF_JEQ | BPF_X:
+    case BPF_JMP | BPF_JEQ | BPF_K:  return x ? bpf_op_jeq_x : bpf_op_jeq_k;
+    case BPF_JMP | BPF_JNE | BPF_X:
+    case BPF_JMP | BPF_JNE | BPF_K:  return x ? bpf_op_jne_x : bpf_op_jne_k;
+    case BPF_JMP | BPF_JGT | BPF_X:
+    case BPF_JMP | BPF_JGT | BPF_K:  return x ? bpf_op_jgt_x : bpf_op_jgt_k;
+    case BPF_JMP | BPF_JGE | BPF_X:
+    case BPF_JMP | BPF_JGE | BPF_K:  return x ? bpf_op_jge_x : bpf_op_jge_k;
+    case BPF_JMP | BPF_JSGT | BPF_X:
+    case BPF_JMP | BPF_JSGT | BPF_K: return x ? bpf_op_jsgt_x : bpf_op_jsgt_k;
+    case BPF_JMP | BPF_JSGE | BPF_X:
+    case BPF_JMP | BPF_JSGE | BPF_K: return x ? bpf_op_jsge_x : bpf_op_jsge_k;
+    case BPF_JMP | BPF_JSET | BPF_X:
+    case BPF_JMP | BPF_JSET | BPF_K: return x ? bpf_op_jset_x : bpf_op_jset_k;
+    case BPF_JMP | BPF_JA:           return bpf_op_ja;
+
+    case BPF_JMP | BPF_CALL:
+      return bpf_threaded_call_op(i->imm);
+
+    case BPF_JMP | BPF_EXIT:
+      return bpf_op_exit;
+
+    default:
+      return bpf_op_unknown;
+    }
+}
+
+// Returns the direct-threaded form of insns[], decoding it on first use.
+// The extra instruction at the end of the decoded program (bpf_op_end)
+// is the target of control flow that leaves the program.
+static const bpf_threaded_prog &
+bpf_threaded_decode(size_t ninsns, const struct bpf_insn insns[],
+                    size_t nmaps, const void *const handlers[])
+{
+  std::lock_guard<std::mutex> guard(threaded_progs_lock);
+
+  auto it = threaded_progs.find(insns);
+  if (it != threaded_progs.end())
+    return it->second;
+
+  bpf_threaded_prog &prog = threaded_progs[insns];
+  prog.resize(ninsns + 1);
+
+  for (size_t k = 0; k < ninsns; k++)
+    {
+      const struct bpf_insn *i = &insns[k];
+      bpf_threaded_insn &t = prog[k];
+      bpf_threaded_op op = bpf_threaded_op_for(ninsns, insns, k, nmaps);
+
+      t.handler = handlers[op];
+      t.dst_reg = i->dst_reg;
+      t.src_reg = i->src_reg;
+      t.off = i->off;
+      t.imm = (uint64_t)(int64_t)i->imm;
+      t.target = nullptr;
+
+      if (op == bpf_op_ld_imm64 && i->src_reg == 0)
+        t.imm = (uint32_t)i->imm | ((uint64_t)i[1].imm << 32);
+
+      if (BPF_CLASS(i->code) == BPF_JMP
+          && op != bpf_op_exit && BPF_OP(i->code) != BPF_CALL)
+        {
+          // Jumps outside the program terminate it, as before:
+          int64_t dest = (int64_t)k + 1 + i->off;
+          if (dest < 0 || dest > (int64_t)ninsns)
+            dest = ninsns;
+          t.target = &prog[dest];
+        }
+    }
+
+  bpf_threaded_insn &end = prog[ninsns];
+  memset(&end, 0, sizeof(end));
+  end.handler = handlers[bpf_op_end];
+
+  return prog;
+}
+
 uint64_t
 bpf_interpret(size_t ninsns, const struct bpf_insn insns[],
               bpf_transport_context *ctx)
 {
+  static const void *const handlers[bpf_op_max] = {
+#define __BPF_THREADED_OP_LABEL(x) &&op_##x,
+    __BPF_THREADED_OP_MAPPER(__BPF_THREADED_OP_LABEL)
+#undef __BPF_THREADED_OP_LABEL
+  };
+
   uint64_t result = 0; // return value
   uint64_t stack[65536 / 8]; // see MAX_BPF_USER_STACK in bpf-internal.h
   uint64_t regs[MAX_BPF_REG];
   memset(regs, 0x0, sizeof(uint64_t) * MAX_BPF_REG);
-  const struct bpf_insn *i = insns;
   static std::vector<uint64_t *> map_values;
 
   // Multiple threads accessing strings can cause concurrency issues for
@@ -842,316 +1578,278 @@ bpf_interpret(size_t ninsns, const struct bpf_insn insns[],
 
   regs[BPF_REG_10] = (uintptr_t)stack + sizeof(stack);
 
-  while ((size_t)(i - insns) < ninsns)
+  const bpf_threaded_insn *i
+    = bpf_threaded_decode(ninsns, insns, map_fds.size(), handlers).data();
+  uint64_t dr;
+  bpf_perf_event_ret tr;
+
+#define DISPATCH() goto *i->handler
+#define NEXT() do { i++; DISPATCH(); } while (0)
+#define JUMP_IF(cond) do { i = (cond) ? i->target : i + 1; DISPATCH(); } while (0)
+#define DR regs[i->dst_reg]
+#define SR regs[i->src_reg]
+#define IMM i->imm
+#define ALU64_OP(name, op) \
+  op_##name##64_x: DR op SR; NEXT(); \
+  op_##name##64_k: DR op IMM; NEXT();
+#define ALU32_OP(name, op) \
+  op_##name##32_x: DR = (uint32_t)(DR op SR); NEXT(); \
+  op_##name##32_k: DR = (uint32_t)(DR op IMM); NEXT();
+#define JMP_OP(name, cmp, type) \
+  op_##name##_x: JUMP_IF((type)DR cmp (type)SR); \
+  op_##name##_k: JUMP_IF((type)DR cmp (type)IMM);
+#define CALL_RETURN(val) \
+  do { \
+    dr = (val); \
+    regs[0] = dr; \
+    regs[1] = 0xea7bee75; \
+    regs[2] = 0xea7bee75; \
+    regs[3] = 0xea7bee75; \
+    regs[4] = 0xea7bee75; \
+    regs[5] = 0xea7bee75; \
+    NEXT(); \
+  } while (0)
+
+  DISPATCH();
+
+ op_ldx_b:  DR = *(uint8_t *)((uintptr_t)SR + i->off);  NEXT();
+ op_ldx_h:  DR = *(uint16_t *)((uintptr_t)SR + i->off); NEXT();
+ op_ldx_w:  DR = *(uint32_t *)((uintptr_t)SR + i->off); NEXT();
+ op_ldx_dw: DR = *(uint64_t *)((uintptr_t)SR + i->off); NEXT();
+
+ op_st_b:   *(uint8_t *)((uintptr_t)DR + i->off) = IMM;  NEXT();
+ op_st_h:   *(uint16_t *)((uintptr_t)DR + i->off) = IMM; NEXT();
+ op_st_w:   *(uint32_t *)((uintptr_t)DR + i->off) = IMM; NEXT();
+ op_st_dw:  *(uint64_t *)((uintptr_t)DR + i->off) = IMM; NEXT();
+ op_stx_b:  *(uint8_t *)((uintptr_t)DR + i->off) = SR;  NEXT();
+ op_stx_h:  *(uint16_t *)((uintptr_t)DR + i->off) = SR; NEXT();
+ op_stx_w:  *(uint32_t *)((uintptr_t)DR + i->off) = SR; NEXT();
+ op_stx_dw: *(uint64_t *)((uintptr_t)DR + i->off) = SR; NEXT();
+
+  ALU64_OP(add, +=)
+  ALU64_OP(sub, -=)
+  ALU64_OP(and, &=)
+  ALU64_OP(or, |=)
+  ALU64_OP(lsh, <<=)
+  ALU64_OP(rsh, >>=)
+  ALU64_OP(xor, ^=)
+  ALU64_OP(mul, *=)
+  ALU64_OP(mov, =)
+ op_arsh64_x: DR = (int64_t)DR >> SR;  NEXT();
+ op_arsh64_k: DR = (int64_t)DR >> IMM; NEXT();
+ op_neg64:    DR = -SR; NEXT();
+ op_div64_x:
+  if (SR == 0)
     {
-      uint64_t dr, sr, si, s1;
-      bpf_perf_event_ret tr;
-
-      dr = regs[i->dst_reg];
-      sr = regs[i->src_reg];
-      si = i->imm;
-      s1 = i->code & BPF_X ? sr : si;
-
-      switch (i->code)
-	{
-	case BPF_LDX | BPF_MEM | BPF_B:
-	  dr = *(uint8_t *)((uintptr_t)sr + i->off);
-	  break;
-	case BPF_LDX | BPF_MEM | BPF_H:
-	  dr = *(uint16_t *)((uintptr_t)sr + i->off);
-	  break;
-	case BPF_LDX | BPF_MEM | BPF_W:
-	  dr = *(uint32_t *)((uintptr_t)sr + i->off);
-	  break;
-	case BPF_LDX | BPF_MEM | BPF_DW:
-	  dr = *(uint64_t *)((uintptr_t)sr + i->off);
-	  break;
-
-	case BPF_ST | BPF_MEM | BPF_B:
-	  sr = si;
-	  /* Fallthrough */
-	case BPF_STX | BPF_MEM | BPF_B:
-	  *(uint8_t *)((uintptr_t)dr + i->off) = sr;
-	  goto nowrite;
-	case BPF_ST | BPF_MEM | BPF_H:
-	  sr = si;
-	  /* Fallthrough */
-	case BPF_STX | BPF_MEM | BPF_H:
-	  *(uint16_t *)((uintptr_t)dr + i->off) = sr;
-	  goto nowrite;
-	case BPF_ST | BPF_MEM | BPF_W:
-	  sr = si;
-	  /* Fallthrough */
-	case BPF_STX | BPF_MEM | BPF_W:
-	  *(uint32_t *)((uintptr_t)dr + i->off) = sr;
-	  goto nowrite;
-	case BPF_ST | BPF_MEM | BPF_DW:
-	  sr = si;
-	  /* Fallthrough */
-	case BPF_STX | BPF_MEM | BPF_DW:
-	  *(uint64_t *)((uintptr_t)dr + i->off) = sr;
-	  goto nowrite;
-
-	case BPF_ALU64 | BPF_ADD | BPF_X:
-	case BPF_ALU64 | BPF_ADD | BPF_K:  dr += s1; break;
-	case BPF_ALU64 | BPF_SUB | BPF_X:
-	case BPF_ALU64 | BPF_SUB | BPF_K:  dr -= s1; break;
-	case BPF_ALU64 | BPF_AND | BPF_X:
-	case BPF_ALU64 | BPF_AND | BPF_K:  dr &= s1; break;
-	case BPF_ALU64 | BPF_OR  | BPF_X:
-	case BPF_ALU64 | BPF_OR  | BPF_K:  dr |= s1; break;
-	case BPF_ALU64 | BPF_LSH | BPF_X:
-	case BPF_ALU64 | BPF_LSH | BPF_K:  dr <<= s1; break;
-	case BPF_ALU64 | BPF_RSH | BPF_X:
-	case BPF_ALU64 | BPF_RSH | BPF_K:  dr >>= s1; break;
-	case BPF_ALU64 | BPF_XOR | BPF_X:
-	case BPF_ALU64 | BPF_XOR | BPF_K:  dr ^= s1; break;
-	case BPF_ALU64 | BPF_MUL | BPF_X:
-	case BPF_ALU64 | BPF_MUL | BPF_K:  dr *= s1; break;
-	case BPF_ALU64 | BPF_MOV | BPF_X:
-	case BPF_ALU64 | BPF_MOV | BPF_K:  dr = s1; break;
-	case BPF_ALU64 | BPF_ARSH | BPF_X:
-	case BPF_ALU64 | BPF_ARSH | BPF_K: dr = (int64_t)dr >> s1; break;
-	case BPF_ALU64 | BPF_NEG:	   dr = -sr; break;
-	case BPF_ALU64 | BPF_DIV | BPF_X:
-	case BPF_ALU64 | BPF_DIV | BPF_K:
-	  if (s1 == 0)
-            {
-              // TODO: Signal a proper error.
-              result = 0; goto cleanup;
-            }
-	  dr /= s1;
-	  break;
-	case BPF_ALU64 | BPF_MOD | BPF_X:
-	case BPF_ALU64 | BPF_MOD | BPF_K:
-	  if (s1 == 0)
-            {
-              // TODO: Signal a proper error.
-              result = 0; goto cleanup;
-            }
-	  dr %= s1;
-	  break;
-
-	case BPF_ALU | BPF_ADD | BPF_X:
-	case BPF_ALU | BPF_ADD | BPF_K:  dr = (uint32_t)(dr + s1); break;
-	case BPF_ALU | BPF_SUB | BPF_X:
-	case BPF_ALU | BPF_SUB | BPF_K:  dr = (uint32_t)(dr - s1); break;
-	case BPF_ALU | BPF_AND | BPF_X:
-	case BPF_ALU | BPF_AND | BPF_K:  dr = (uint32_t)(dr & s1); break;
-	case BPF_ALU | BPF_OR  | BPF_X:
-	case BPF_ALU | BPF_OR  | BPF_K:  dr = (uint32_t)(dr | s1); break;
-	case BPF_ALU | BPF_LSH | BPF_X:
-	case BPF_ALU | BPF_LSH | BPF_K:
-          // signal to coverity that we really do want a 32-bit result
-          // coverity[overflow_before_widen:SUPPRESS]
-          dr = (uint64_t)((uint32_t)dr << s1); break;
-	case BPF_ALU | BPF_RSH | BPF_X:
-	case BPF_ALU | BPF_RSH | BPF_K:  dr = (uint32_t)dr >> s1; break;
-	case BPF_ALU | BPF_XOR | BPF_X:
-	case BPF_ALU | BPF_XOR | BPF_K:  dr = (uint32_t)(dr ^ s1); break;
-	case BPF_ALU | BPF_MUL | BPF_X:
-	case BPF_ALU | BPF_MUL | BPF_K:  dr = (uint32_t)(dr * s1); break;
-	case BPF_ALU | BPF_MOV | BPF_X:
-	case BPF_ALU | BPF_MOV | BPF_K:  dr = (uint32_t)s1; break;
-	case BPF_ALU | BPF_ARSH | BPF_X:
-	case BPF_ALU | BPF_ARSH | BPF_K: dr = (int32_t)dr >> s1; break;
-	case BPF_ALU | BPF_NEG:		 dr = -(uint32_t)sr; break;
-	case BPF_ALU | BPF_DIV | BPF_X:
-	case BPF_ALU | BPF_DIV | BPF_K:
-	  if ((uint32_t)s1 == 0)
-            {
-              // TODO: Signal a proper error.
-              result = 0; goto cleanup;
-            }
-	  dr = (uint32_t)dr / (uint32_t)s1;
-	  break;
-	case BPF_ALU | BPF_MOD | BPF_X:
-	case BPF_ALU | BPF_MOD | BPF_K:
-	  if ((uint32_t)s1 == 0)
-            {
-              // TODO: Signal a proper error.
-              result = 0; goto cleanup;
-            }
-	  dr = (uint32_t)dr % (uint32_t)s1;
-	  break;
-
-	case BPF_LD | BPF_IMM | BPF_DW:
-	  switch (i->src_reg)
-	    {
-	    case 0:
-	      dr = (uint32_t)si | ((uint64_t)i[1].imm << 32);
-	      break;
-	    case BPF_PSEUDO_MAP_FD:
-	      if (si >= map_fds.size())
-                {
-                  // TODO: Signal a proper error.
-                  result = 0;
-                  goto cleanup;
-                }
-	      dr = si;
-	      break;
-	    default:
-	      stapbpf_just_abort();
-	    }
-	  regs[i->dst_reg] = dr;
-	  i += 2;
-	  continue;
-
-	case BPF_JMP | BPF_JEQ | BPF_X:
-	case BPF_JMP | BPF_JEQ | BPF_K:
-	  if (dr == s1)
-	    goto dojmp;
-	  goto nowrite;
-	case BPF_JMP | BPF_JNE | BPF_X:
-	case BPF_JMP | BPF_JNE | BPF_K:
-	  if (dr != s1)
-	    goto dojmp;
-	  goto nowrite;
-	case BPF_JMP | BPF_JGT | BPF_X:
-	case BPF_JMP | BPF_JGT | BPF_K:
-	  if (dr > s1)
-	    goto dojmp;
-	  goto nowrite;
-	case BPF_JMP | BPF_JGE | BPF_X:
-	case BPF_JMP | BPF_JGE | BPF_K:
-	  if (dr >= s1)
-	    goto dojmp;
-	  goto nowrite;
-	case BPF_JMP | BPF_JSGT | BPF_X:
-	case BPF_JMP | BPF_JSGT | BPF_K:
-	  if ((int64_t)dr > (int64_t)s1)
-	    goto dojmp;
-	  goto nowrite;
-	case BPF_JMP | BPF_JSGE | BPF_X:
-	case BPF_JMP | BPF_JSGE | BPF_K:
-	  if ((int64_t)dr >= (int64_t)s1)
-	    goto dojmp;
-	  goto nowrite;
-	case BPF_JMP | BPF_JSET | BPF_X:
-	case BPF_JMP | BPF_JSET | BPF_K:
-	  if (dr & s1)
-	    goto dojmp;
-	  goto nowrite;
-	case BPF_JMP | BPF_JA:
-	dojmp:
-	  i += 1 + i->off;
-	  continue;
-
-	case BPF_JMP | BPF_CALL:
-	  switch (si)
-	    {
-	    case BPF_FUNC_map_lookup_elem:
-	      {
-                // allocate correctly sized buffer and store it in map_values
-                uint64_t *lookup_tmp = (uint64_t *)malloc(map_attrs[regs[1]].value_size);
-                map_values.push_back(lookup_tmp);
-
-	        int res = bpf_lookup_elem(map_fds[regs[1]], as_ptr(regs[2]),
-			                  as_ptr(lookup_tmp));
-
-	        if (res)
-		  // element could not be found
-	          dr = 0;
-	        else
-	          dr = as_int(lookup_tmp);
-	      }
-	      break;
-	    case BPF_FUNC_map_update_elem:
-	      dr = bpf_update_elem(map_fds[regs[1]], as_ptr(regs[2]),
-			           as_ptr(regs[3]), regs[4]);
-	      break;
-	    case BPF_FUNC_map_delete_elem:
-	      dr = bpf_delete_elem(map_fds[regs[1]], as_ptr(regs[2]));
-	      break;
-	    case BPF_FUNC_ktime_get_ns:
-              dr = bpf_ktime_get_ns();
-              break;
-            case BPF_FUNC_perf_event_output:
-              /* XXX ignored, but could be checked: regs[1], regs[2], regs[3] */
-              tr = bpf_handle_transport_msg
-                ((void *)regs[4], (size_t)regs[5], ctx);
-              /* Normalize return value to match the helper API.
-                 XXX: May want to look at errno as well? */
-              dr = (tr != LIBBPF_PERF_EVENT_ERROR) ? 0 : -1;
-              break;
-	    case BPF_FUNC_trace_printk:
-              /* XXX no longer need this code after PR22330 */
+      // TODO: Signal a proper error.
+      result = 0; goto cleanup;
+    }
+  DR /= SR;
+  NEXT();
+ op_div64_k:
+  if (IMM == 0)
+    {
+      // TODO: Signal a proper error.
+      result = 0; goto cleanup;
+    }
+  DR /= IMM;
+  NEXT();
+ op_mod64_x:
+  if (SR == 0)
+    {
+      // TODO: Signal a proper error.
+      result = 0; goto cleanup;
+    }
+  DR %= SR;
+  NEXT();
+ op_mod64_k:
+  if (IMM == 0)
+    {
+      // TODO: Signal a proper error.
+      result = 0; goto cleanup;
+    }
+  DR %= IMM;
+  NEXT();
+
+  ALU32_OP(add, +)
+  ALU32_OP(sub, -)
+  ALU32_OP(and, &)
+  ALU32_OP(or, |)
+  ALU32_OP(xor, ^)
+  ALU32_OP(mul, *)
+ op_lsh32_x:
+  // signal to coverity that we really do want a 32-bit result
+  // coverity[overflow_before_widen:SUPPRESS]
+  DR = (uint64_t)((uint32_t)DR << SR); NEXT();
+ op_lsh32_k:
+  // coverity[overflow_before_widen:SUPPRESS]
+  DR = (uint64_t)((uint32_t)DR << IMM); NEXT();
+ op_rsh32_x:  DR = (uint32_t)DR >> SR;  NEXT();
+ op_rsh32_k:  DR = (uint32_t)DR >> IMM; NEXT();
+ op_mov32_x:  DR = (uint32_t)SR;  NEXT();
+ op_mov32_k:  DR = (uint32_t)IMM; NEXT();
+ op_arsh32_x: DR = (int32_t)DR >> SR;  NEXT();
+ op_arsh32_k: DR = (int32_t)DR >> IMM; NEXT();
+ op_neg32:    DR = -(uint32_t)SR; NEXT();
+ op_div32_x:
+  if ((uint32_t)SR == 0)
+    {
+      // TODO: Signal a proper error.
+      result = 0; goto cleanup;
+    }
+  DR = (uint32_t)DR / (uint32_t)SR;
+  NEXT();
+ op_div32_k:
+  if ((uint32_t)IMM == 0)
+    {
+      // TODO: Signal a proper error.
+      result = 0; goto cleanup;
+    }
+  DR = (uint32_t)DR / (uint32_t)IMM;
+  NEXT();
+ op_mod32_x:
+  if ((uint32_t)SR == 0)
+    {
+      // TODO: Signal a proper error.
+      result = 0; goto cleanup;
+    }
+  DR = (uint32_t)DR % (uint32_t)SR;
+  NEXT();
+ op_mod32_k:
+  if ((uint32_t)IMM == 0)
+    {
+      // TODO: Signal a proper error.
+      result = 0; goto cleanup;
+    }
+  DR = (uint32_t)DR % (uint32_t)IMM;
+  NEXT();
+
+ op_ld_imm64:
+  // -- also covers BPF_PSEUDO_MAP_FD, whose index was validated when decoding
+  DR = IMM;
+  i += 2;
+  DISPATCH();
+ op_ld_map_invalid:
+  // TODO: Signal a proper error.
+  result = 0;
+  goto cleanup;
+ op_ld_imm64_invalid:
+  stapbpf_just_abort();
+
+  JMP_OP(jeq, ==, uint64_t)
+  JMP_OP(jne, !=, uint64_t)
+  JMP_OP(jgt, >, uint64_t)
+  JMP_OP(jge, >=, uint64_t)
+  JMP_OP(jsgt, >, int64_t)
+  JMP_OP(jsge, >=, int64_t)
+ op_jset_x: JUMP_IF(DR & SR);
+ op_jset_k: JUMP_IF(DR & IMM);
+ op_ja:
+  i = i->target;
+  DISPATCH();
+
+ op_call_map_lookup_elem:
+  {
+    // allocate correctly sized buffer and store it in map_values
+    uint64_t *lookup_tmp = (uint64_t *)malloc(map_attrs[regs[1]].value_size);
+    map_values.push_back(lookup_tmp);
+
+    int res = bpf_lookup_elem(map_fds[regs[1]], as_ptr(regs[2]),
+                              as_ptr(lookup_tmp));
+
+    // element could not be found if res != 0
+    CALL_RETURN(res ? 0 : as_int(lookup_tmp));
+  }
+ op_call_map_update_elem:
+  CALL_RETURN(bpf_update_elem(map_fds[regs[1]], as_ptr(regs[2]),
+                              as_ptr(regs[3]), regs[4]));
+ op_call_map_delete_elem:
+  CALL_RETURN(bpf_delete_elem(map_fds[regs[1]], as_ptr(regs[2])));
+ op_call_ktime_get_ns:
+  CALL_RETURN(bpf_ktime_get_ns());
+ op_call_perf_event_output:
+  /* XXX ignored, but could be checked: regs[1], regs[2], regs[3] */
+  tr = bpf_handle_transport_msg((void *)regs[4], (size_t)regs[5], ctx);
+  /* Normalize return value to match the helper API.
+     XXX: May want to look at errno as well? */
+  CALL_RETURN((tr != LIBBPF_PERF_EVENT_ERROR) ? 0 : -1);
+ op_call_trace_printk:
+  /* XXX no longer need this code after PR22330 */
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wformat-nonliteral"
-              // regs[2] is the strlen(regs[1]) - not used by printf(3);
-              // instead we assume regs[1] string is \0 terminated
-	      dr = fprintf(output_f, remove_tag(as_str(regs[1])).c_str(),
-                           /*regs[2],*/ regs[3], regs[4], regs[5]);
-              fflush(output_f);
+  // regs[2] is the strlen(regs[1]) - not used by printf(3);
+  // instead we assume regs[1] string is \0 terminated
+  dr = fprintf(output_f, remove_tag(as_str(regs[1])).c_str(),
+               /*regs[2],*/ regs[3], regs[4], regs[5]);
+  fflush(output_f);
 #pragma GCC diagnostic pop
-	      break;
-            case bpf::BPF_FUNC_sprintf:
-              dr = bpf_sprintf(strings, as_str(regs[1]),
-                               regs[3], regs[4], regs[5]);
-              break;
-            case bpf::BPF_FUNC_text_str:
-              dr = bpf_text_str(strings, as_str(regs[1]), false);
-              break;
-            case bpf::BPF_FUNC_string_quoted:
-              dr = bpf_text_str(strings, as_str(regs[1]), true);
-              break;
-            case bpf::BPF_FUNC_str_concat:
-              dr = bpf_str_concat(strings, as_str(regs[1]), 
-                                  as_str(regs[2]));
-              break;
-            case bpf::BPF_FUNC_map_get_next_key:
-              dr = map_get_next_key(regs[1], regs[2], regs[3],
-                                    regs[4], regs[5],
-                                    ctx, foreach_ctxs[regs[1]],
-                                    strings, map_values);
-              break;
-            case bpf::BPF_FUNC_stapbpf_stat_get:
-              dr = stapbpf_stat_get((bpf::globals::agg_idx)regs[1], regs[2],
-                                     bpf::globals::deintern_sc_type(regs[3]), ctx);
-              break;
-            case bpf::BPF_FUNC_gettimeofday_ns:
-              dr = bpf_gettimeofday_ns();
-              break;
-            case bpf::BPF_FUNC_get_target:
-              dr = bpf_get_target();
-              break;
-            case bpf::BPF_FUNC_set_procfs_value:
-              dr = bpf_set_procfs_value(as_str(regs[1]), ctx);
-              break;
-            case bpf::BPF_FUNC_append_procfs_value:
-              dr = bpf_append_procfs_value(as_str(regs[1]), ctx);
-              break;
-            case bpf::BPF_FUNC_get_procfs_value:
-              dr = bpf_get_procfs_value(ctx);
-              break;
-	    default:
-	      stapbpf_abort("unknown helper function");
-	    }
-	  regs[0] = dr;
-	  regs[1] = 0xea7bee75;
-	  regs[2] = 0xea7bee75;
-	  regs[3] = 0xea7bee75;
-	  regs[4] = 0xea7bee75;
-          regs[5] = 0xea7bee75;
-	  goto nowrite;
-
-	case BPF_JMP | BPF_EXIT:
-	  result = regs[0];
-          goto cleanup;
-
-	default:
-	  stapbpf_abort("unknown bpf opcode");
-	}
-
-      regs[i->dst_reg] = dr;
-    nowrite:
-      i++;
-    }
+  CALL_RETURN(dr);
+ op_call_sprintf:
+  CALL_RETURN(bpf_sprintf(strings, as_str(regs[1]),
+                          regs[3], regs[4], regs[5]));
+ op_call_text_str:
+  CALL_RETURN(bpf_text_str(strings, as_str(regs[1]), false));
+ op_call_string_quoted:
+  CALL_RETURN(bpf_text_str(strings, as_str(regs[1]), true));
+ op_call_str_concat:
+  CALL_RETURN(bpf_str_concat(strings, as_str(regs[1]), as_str(regs[2])));
+ op_call_map_get_next_key:
+  CALL_RETURN(map_get_next_key(regs[1], regs[2], regs[3],
+                               regs[4], regs[5],
+                               ctx, foreach_ctxs[regs[1]],
+                               strings, map_values));
+ op_call_stat_get:
+  CALL_RETURN(stapbpf_stat_get((bpf::globals::agg_idx)regs[1], regs[2],
+                               bpf::globals::deintern_sc_type(regs[3]), ctx));
+ op_call_gettimeofday_ns:
+  CALL_RETURN(bpf_gettimeofday_ns());
+ op_call_get_target:
+  CALL_RETURN(bpf_get_target());
+ op_call_set_procfs_value:
+  CALL_RETURN(bpf_set_procfs_value(as_str(regs[1]), ctx));
+ op_call_append_procfs_value:
+  CALL_RETURN(bpf_append_procfs_value(as_str(regs[1]), ctx));
+ op_call_get_procfs_value:
+  CALL_RETURN(bpf_get_procfs_value(ctx));
+ op_call_get_stackid:
+  // There is no stack to speak of in userspace probes:
+  CALL_RETURN((uint64_t)-EOPNOTSUPP);
+ op_call_print_stackid:
+  CALL_RETURN(bpf_print_stackid(regs[1], regs[2], regs[3], ctx));
+ op_call_unknown:
+  stapbpf_abort("unknown helper function");
+
+ op_exit:
+  result = regs[0];
+  goto cleanup;
+
+ op_end:
   result = 0;
+  goto cleanup;
+
+ op_unknown:
+  stapbpf_abort("unknown bpf opcode");
+
+#undef DISPATCH
+#undef NEXT
+#undef JUMP_IF
+#undef DR
+#undef SR
+#undef IMM
+#undef ALU64_OP
+#undef ALU32_OP
+#undef JMP_OP
+#undef CALL_RETURN
+
  cleanup:
   for (uint64_t *ptr : map_values)
     free(ptr);
   map_values.clear(); // XXX: avoid double free
 
+  // Free the states of any foreach loops left with break:
+  for (size_t m = 0; m < map_fds.size(); m++)
+    for (foreach_state &s : foreach_ctxs[m])
+      foreach_state_cleanup(s);
+
   return result;
 }
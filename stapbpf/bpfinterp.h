@@ -46,6 +46,7 @@ struct bpf_transport_context {
   std::vector<std::string> *interned_strings;
   std::unordered_map<bpf::globals::agg_idx, bpf::globals::stats_map> *aggregates;
   std::vector<bpf::globals::foreach_info> *foreach_loop_info;
+  bool map_batch; // -- kernel supports BPF_MAP_LOOKUP_BATCH
   // XXX: Could be refactored into a single global struct bpf_global_context.
   
   // Data for procfs probes. Multiple threads will be accessing this variable.
@@ -78,7 +79,7 @@ struct bpf_transport_context {
     : cpu(cpu), pmu_fd(pmu_fd), ncpus(ncpus),
       map_attrs(map_attrs), map_fds(map_fds), output_f(output_f),
       interned_strings(interned_strings), aggregates(aggregates),
-      foreach_loop_info(foreach_loop_info),
+      foreach_loop_info(foreach_loop_info), map_batch(false),
       in_printf(false), format_no(-1), expected_args(0), error(error) {}
 };
 
@@ -89,6 +90,8 @@ uint64_t bpf_interpret(size_t ninsns,
                        const struct bpf_insn insns[],
                        bpf_transport_context *ctx);
 
+void bpf_snapshot_target_mappings();
+
 extern "C" {
 extern int target_pid;
 };
@@ -1,4 +1,5 @@
 /* eBPF mini library */
+#include "config.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <linux/unistd.h>
@@ -90,6 +91,35 @@ int bpf_get_next_key(int fd, void *key, void *next_key)
 	return syscall(__NR_bpf, BPF_MAP_GET_NEXT_KEY, &attr, sizeof(attr));
 }
 
+/* Reads up to *count elements starting after the position described by
+ * in_batch (NULL to start from the beginning). On return, *count holds
+ * the number of elements copied and out_batch the position to resume
+ * from. Fails with ENOENT once the last batch has been returned. */
+int bpf_lookup_batch(int fd, void *in_batch, void *out_batch, void *keys,
+		     void *values, unsigned *count)
+{
+#ifdef HAVE_BPF_MAP_LOOKUP_BATCH
+	union bpf_attr attr;
+        memset(&attr, 0, sizeof(union bpf_attr));
+	attr.batch.map_fd = fd;
+	attr.batch.in_batch = ptr_to_u64(in_batch);
+	attr.batch.out_batch = ptr_to_u64(out_batch);
+	attr.batch.keys = ptr_to_u64(keys);
+	attr.batch.values = ptr_to_u64(values);
+	attr.batch.count = *count;
+
+	int rc = syscall(__NR_bpf, BPF_MAP_LOOKUP_BATCH, &attr, sizeof(attr));
+	*count = attr.batch.count;
+	return rc;
+#else
+	(void) fd; (void) in_batch; (void) out_batch;
+	(void) keys; (void) values;
+	*count = 0;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
 #define ROUND_UP(x, n) (((x) + (n) - 1u) & ~((n) - 1u))
 
 char bpf_log_buf[LOG_BUF_SIZE];
@@ -213,6 +243,46 @@ bpf_perf_event_read_simple(void *mmap_mem, size_t mmap_size, size_t page_size,
         return ret;
 }
 
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+/* Consumes the records available in a BPF_MAP_TYPE_RINGBUF, based on
+ * ringbuf_process_ring() in the kernel's tools/lib/bpf/ringbuf.c.
+ * consumer_mem is the read/write consumer page of the map, producer_mem
+ * the read-only producer page followed by the (doubly mapped) data. */
+enum bpf_perf_event_ret
+bpf_ringbuf_read_simple(void *consumer_mem, void *producer_mem,
+                        size_t size, size_t page_size,
+                        bpf_ringbuf_print_t fn, void *private_data)
+{
+        __u64 *consumer_pos = consumer_mem;
+        __u64 *producer_pos = producer_mem;
+        __u8 *data = (__u8 *)producer_mem + page_size;
+        __u64 cons = __atomic_load_n(consumer_pos, __ATOMIC_ACQUIRE);
+        __u64 prod = __atomic_load_n(producer_pos, __ATOMIC_ACQUIRE);
+        int ret = LIBBPF_PERF_EVENT_CONT;
+
+        while (cons < prod) {
+                __u32 *hdr = (__u32 *)(data + (cons & (size - 1)));
+                __u32 len = __atomic_load_n(hdr, __ATOMIC_ACQUIRE);
+
+                /* record not yet committed */
+                if (len & BPF_RINGBUF_BUSY_BIT)
+                        break;
+
+                __u32 rec_size = len & ~(BPF_RINGBUF_BUSY_BIT
+                                         | BPF_RINGBUF_DISCARD_BIT);
+                void *rec = (__u8 *)hdr + BPF_RINGBUF_HDR_SZ;
+                cons += ROUND_UP(rec_size + BPF_RINGBUF_HDR_SZ, 8);
+
+                if (!(len & BPF_RINGBUF_DISCARD_BIT))
+                        ret = fn(rec, rec_size, private_data);
+                __atomic_store_n(consumer_pos, cons, __ATOMIC_RELEASE);
+                if (ret != LIBBPF_PERF_EVENT_CONT)
+                        break;
+        }
+        return ret;
+}
+#endif
+
 int bpf_obj_get(const char *pathname)
 {
 	union bpf_attr attr;
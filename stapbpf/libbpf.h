@@ -10,6 +10,8 @@ int bpf_update_elem(int fd, void *key, void *value, unsigned long long flags);
 int bpf_lookup_elem(int fd, void *key, void *value);
 int bpf_delete_elem(int fd, void *key);
 int bpf_get_next_key(int fd, void *key, void *next_key);
+int bpf_lookup_batch(int fd, void *in_batch, void *out_batch, void *keys,
+		     void *values, unsigned *count);
 
 int bpf_prog_load(enum bpf_prog_type prog_type,
 		  const struct bpf_insn *insns, int insn_len,
@@ -47,6 +49,13 @@ bpf_perf_event_read_simple(void *mmap_mem, size_t mmap_size, size_t page_size,
                            void **copy_mem, size_t *copy_size,
                            bpf_perf_event_print_t fn, void *private_data);
 
+typedef enum bpf_perf_event_ret
+        (*bpf_ringbuf_print_t)(void *data, size_t size, void *private_data);
+enum bpf_perf_event_ret
+bpf_ringbuf_read_simple(void *consumer_mem, void *producer_mem,
+                        size_t size, size_t page_size,
+                        bpf_ringbuf_print_t fn, void *private_data);
+
 /* create RAW socket and bind to interface 'name' */
 int open_raw_sock(const char *name);
 
@@ -121,6 +121,7 @@ std::mutex procfs_lock;
 
 // Sized by the contents of the "maps" section.
 static bpf_map_def *map_attrs;
+static bool stack_map_p = false; // -- backtrace()/ubacktrace() are in use
 static std::vector<int> map_fds;
 
 // PR24543: Some perf constructs must be anchored to a single CPU.
@@ -139,6 +140,15 @@ static int perf_event_page_size;
 static int perf_event_page_count = 8;
 static int perf_event_mmap_size;
 
+// Number of possible CPUs, which sizes the per-cpu transport and aggregates:
+static unsigned num_cpus;
+
+// Additional info for the ring buffer transport, which replaces the
+// per-cpu perf_events when the perf_event_map is a BPF_MAP_TYPE_RINGBUF:
+static bool ringbuf_transport = false;
+static void *ringbuf_consumer; // -- consumer position page, read/write
+static void *ringbuf_producer; // -- producer position page + data, read-only
+
 // Table of interned strings:
 static std::vector<std::string> interned_strings;
 
@@ -386,6 +396,9 @@ instantiate_maps (Elf64_Shdr *shdr, Elf_Data *data)
 
   map_attrs = attrs;
   map_fds.assign(n, -1);
+  for (i = 0; i < n; ++i)
+    if (attrs[i].type == BPF_MAP_TYPE_STACK_TRACE)
+      stack_map_p = true;
 
   // XXX: PR24324 -- This overhead space calculation was too
   // conservative and caused resource exhaustion errors, disabling it
@@ -446,6 +459,22 @@ instantiate_maps (Elf64_Shdr *shdr, Elf_Data *data)
               (unsigned long long) curr_rlimit.rlim_max);
     }
 
+  // TODO: perf_event buffers can only be created for currently
+  // active CPUs. For now we imitate Certain Other Tools and
+  // create perf_events for CPUs that are active at startup time
+  // (while sizing the perf_event_map according to total CPUs).
+  // But for full coverage, we really need to listen to CPUs
+  // coming on/offline and adjust accordingly.
+  long ncpus_ = sysconf(_SC_NPROCESSORS_CONF);
+  unsigned ncpus = ncpus_ > 0 ? ncpus_ : 1;
+  if (ncpus_ < 0)
+    fprintf(stderr, "WARNING: could not get number of CPUs, falling back to 1: %s\n", strerror(errno));
+  else if (ncpus_ == 0)
+    fprintf(stderr, "WARNING: could not get number of CPUs, falling back to 1\n"); // XXX no errno
+  //unsigned ncpus = get_nprocs_conf();
+  mark_active_cpus((unsigned)ncpus);
+  num_cpus = ncpus;
+
   /* Now create the maps: */
   for (i = 0; i < n; ++i)
     {
@@ -458,23 +487,16 @@ instantiate_maps (Elf64_Shdr *shdr, Elf_Data *data)
           /* XXX: Assume our only perf_event_map is the percpu transport one: */
           assert(i == bpf::globals::perf_event_map_idx);
           assert(attrs[i].max_entries == bpf::globals::NUM_CPUS_PLACEHOLDER);
-
-          // TODO: perf_event buffers can only be created for currently
-          // active CPUs. For now we imitate Certain Other Tools and
-          // create perf_events for CPUs that are active at startup time
-          // (while sizing the perf_event_map according to total CPUs).
-          // But for full coverage, we really need to listen to CPUs
-          // coming on/offline and adjust accordingly.
-          long ncpus_ = sysconf(_SC_NPROCESSORS_CONF);
-          unsigned ncpus = ncpus_ > 0 ? ncpus_ : 1;
-          if (ncpus_ < 0)
-            fprintf(stderr, "WARNING: could not get number of CPUs, falling back to 1: %s\n", strerror(errno));
-          else if (ncpus_ == 0)
-            fprintf(stderr, "WARNING: could not get number of CPUs, falling back to 1\n"); // XXX no errno
-          //unsigned ncpus = get_nprocs_conf();
-          mark_active_cpus((unsigned)ncpus);
           attrs[i].max_entries = ncpus;
         }
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+      /* The ring buffer transport is sized by the translator: */
+      else if (map_type == BPF_MAP_TYPE_RINGBUF)
+        {
+          assert(i == bpf::globals::perf_event_map_idx);
+          ringbuf_transport = true;
+        }
+#endif
 
       if (verbose > 2)
         fprintf(stderr, "creating map type %u entry %zu: key_size %u, value_size %u, "
@@ -1341,6 +1363,10 @@ init_internal_globals()
   keys.push_back(globals::EXIT);
   keys.push_back(globals::ERRORS);
 
+  // Older .bo files lack the DROPS slot:
+  if (map_attrs[globals::internal_map_idx].max_entries > globals::DROPS)
+    keys.push_back(globals::DROPS);
+
   int64_t val = 0;
 
   for (int key: keys)
@@ -1349,13 +1375,92 @@ init_internal_globals()
       fatal("Error updating pid: %s\n", strerror(errno));
 }
 
+// Check whether the kernel supports BPF_MAP_LOOKUP_BATCH, which lets
+// foreach loops read a map in a few syscalls. On a supporting kernel,
+// a batched lookup of an empty map fails with ENOENT.
+static bool
+probe_map_batch()
+{
+  int fd = bpf_create_map(BPF_MAP_TYPE_HASH, sizeof(int64_t),
+                          sizeof(int64_t), 1, 0);
+  if (fd < 0)
+    return false;
+
+  int64_t key, val;
+  uint64_t token;
+  unsigned count = 1;
+  int rc = bpf_lookup_batch(fd, NULL, &token, &key, &val, &count);
+  bool supported = rc == 0 || errno == ENOENT;
+  close(fd);
+
+  if (verbose > 1)
+    fprintf(stderr, "batched map lookups %s\n",
+            supported ? "available" : "unavailable");
+  return supported;
+}
+
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+// Map the ring buffer used for message transport. Messages from all
+// CPUs arrive through it, but printf sequences are still reassembled
+// in a per-CPU bpf_transport_context.
+static void
+init_ringbuf_transport()
+{
+  using namespace bpf;
+
+  int fd = map_fds[globals::perf_event_map_idx];
+  size_t size = map_attrs[globals::perf_event_map_idx].max_entries;
+  int page_size = getpagesize();
+
+  for (unsigned cpu = 0; cpu < num_cpus; cpu++)
+    {
+      perf_fds.push_back(-1);
+      if (!cpu_online[cpu]) // -- skip inactive CPUs.
+        {
+          transport_contexts.push_back(nullptr);
+          continue;
+        }
+
+      bpf_transport_context *ctx
+        = new bpf_transport_context(cpu, fd, num_cpus, map_attrs, &map_fds,
+                                    output_f, &interned_strings, &aggregates,
+                                    &foreach_loop_info, &error);
+      transport_contexts.push_back(ctx);
+    }
+
+  ringbuf_consumer = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, 0);
+  if (ringbuf_consumer == MAP_FAILED)
+    fatal("error mmapping consumer page for ring buffer fd %d: %s\n",
+          fd, strerror(errno));
+
+  // The kernel maps the data area twice, so records never wrap:
+  ringbuf_producer = mmap(NULL, page_size + 2 * size, PROT_READ,
+                          MAP_SHARED, fd, page_size);
+  if (ringbuf_producer == MAP_FAILED)
+    fatal("error mmapping producer pages for ring buffer fd %d: %s\n",
+          fd, strerror(errno));
+
+  if (verbose > 2)
+    fprintf(stderr, "Initialized ring buffer output of %zu bytes\n", size);
+}
+#endif
+
 // PR22330: Initialize perf_event_map and perf_fds.
 static void
 init_perf_transport()
 {
   using namespace bpf;
 
-  unsigned ncpus = map_attrs[globals::perf_event_map_idx].max_entries;
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+  if (ringbuf_transport)
+    {
+      init_ringbuf_transport();
+      return;
+    }
+#endif
+
+  unsigned ncpus = num_cpus;
 
   for (unsigned cpu = 0; cpu < ncpus; cpu++)
     {
@@ -1790,6 +1895,23 @@ get_error_count()
   return val;
 }
 
+static int64_t
+get_drop_count()
+{
+  int key = bpf::globals::DROPS;
+  int64_t val = 0;
+
+  // Older .bo files lack the DROPS slot:
+  if (map_attrs[bpf::globals::internal_map_idx].max_entries <= (unsigned)key)
+    return 0;
+
+  if (bpf_lookup_elem
+       (map_fds[bpf::globals::internal_map_idx], &key, &val) != 0)
+    fatal("error during bpf map lookup: %s\n", strerror(errno));
+
+  return val;
+}
+
 // XXX: based on perf_event_sample
 // in kernel tools/testing/selftests/bpf/trace_helpers.c
 struct perf_event_sample {
@@ -1848,8 +1970,7 @@ perf_event_loop(pthread_t main_thread)
   void *data = NULL;
   size_t len = 0;
 
-  unsigned ncpus
-    = map_attrs[bpf::globals::perf_event_map_idx].max_entries;
+  unsigned ncpus = num_cpus;
   unsigned n_active_cpus
     = count_active_cpus();
   struct pollfd *pmu_fds
@@ -1879,6 +2000,8 @@ perf_event_loop(pthread_t main_thread)
       int ready = poll(pmu_fds, n_active_cpus, 1000); // XXX: Consider setting timeout -1 (unlimited).
       if (ready < 0 && errno == EINTR)
         goto signal_exit;
+      if (stack_map_p)
+        bpf_snapshot_target_mappings();
       if (ready < 0)
         fatal("Error checking for perf events: %s\n", strerror(errno));
       for (unsigned i = 0; i < n_active_cpus; i++)
@@ -1921,6 +2044,79 @@ perf_event_loop(pthread_t main_thread)
   return;
 }
 
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+static enum bpf_perf_event_ret
+ringbuf_handle(void *data, size_t size, void *private_data)
+{
+  (void) private_data;
+
+  // Each message is prefixed by the CPU that sent it:
+  uint64_t cpu;
+  if (size < sizeof(cpu))
+    {
+      fprintf(stderr, "WARNING: truncated ring buffer record of size %zu\n", size);
+      return LIBBPF_PERF_EVENT_CONT;
+    }
+  memcpy(&cpu, data, sizeof(cpu));
+  if (cpu >= transport_contexts.size() || transport_contexts[cpu] == nullptr)
+    {
+      fprintf(stderr, "WARNING: ring buffer record from unexpected cpu %" PRIu64 "\n", cpu);
+      return LIBBPF_PERF_EVENT_CONT;
+    }
+
+  return bpf_handle_transport_msg((char *)data + sizeof(cpu),
+                                  size - sizeof(cpu),
+                                  transport_contexts[cpu]);
+}
+
+// Listen for messages on the ring buffer. Unlike perf_event_loop(),
+// there is a single fd to wait on regardless of the number of CPUs.
+static void
+ringbuf_event_loop(pthread_t main_thread)
+{
+  struct pollfd pfd;
+  pfd.fd = map_fds[bpf::globals::perf_event_map_idx];
+  pfd.events = POLLIN;
+  size_t size = map_attrs[bpf::globals::perf_event_map_idx].max_entries;
+  bool already_warned = false;
+
+  for (;;)
+    {
+      if (verbose > 3)
+        fprintf(stderr, "Polling for ring buffer data...\n");
+      int ready = poll(&pfd, 1, 1000); // XXX: Consider setting timeout -1 (unlimited).
+      if (ready < 0 && errno == EINTR)
+        break;
+      if (stack_map_p)
+        bpf_snapshot_target_mappings();
+      if (ready < 0)
+        fatal("Error checking for ring buffer data: %s\n", strerror(errno));
+      if (ready == 0)
+        continue;
+
+      enum bpf_perf_event_ret ret
+        = bpf_ringbuf_read_simple(ringbuf_consumer, ringbuf_producer,
+                                  size, getpagesize(),
+                                  ringbuf_handle, NULL);
+      if (ret == LIBBPF_PERF_EVENT_DONE)
+        {
+          // Saw STP_EXIT message. If the exit flag is set,
+          // wake up main thread to begin program shutdown.
+          if (get_exit_status())
+            break;
+          continue;
+        }
+      if (ret != LIBBPF_PERF_EVENT_CONT && !already_warned)
+        {
+          fprintf(stderr, "WARNING: could not read from ring buffer\n");
+          already_warned = true;
+        }
+    }
+
+  pthread_kill(main_thread, SIGINT);
+}
+#endif
+
 
 static void
 procfs_read_event_loop (procfsprobe_data* data, bpf_transport_context* uctx)
@@ -2250,11 +2446,11 @@ main(int argc, char **argv)
   // XXX Done before begin probes, after load_bpf_file() sets __name__.
 
   // Create a bpf_transport_context for userspace programs:
-  unsigned ncpus = map_attrs[bpf::globals::perf_event_map_idx].max_entries;
-  bpf_transport_context uctx(default_cpu, -1/*pmu_fd*/, ncpus,
+  bpf_transport_context uctx(default_cpu, -1/*pmu_fd*/, num_cpus,
                              map_attrs, &map_fds, output_f,
                              &interned_strings, &aggregates,
                              &foreach_loop_info, &error);
+  uctx.map_batch = probe_map_batch();
 
   if (create_group_fds() < 0)
     fatal("Error creating perf event group: %s\n", strerror(errno));
@@ -2293,6 +2489,11 @@ main(int argc, char **argv)
   // PR26109: Only continue startup if begin probes did not exit.
   if (!get_exit_status()) { // may already be set by begin probe
     // PR22330: Listen for perf_events:
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+    if (ringbuf_transport)
+      std::thread(ringbuf_event_loop, pthread_self()).detach();
+    else
+#endif
     std::thread(perf_event_loop, pthread_self()).detach();
 
     // Spawn all procfs threads.
@@ -2356,6 +2557,10 @@ main(int argc, char **argv)
   fclose(kmsg);
 
   int error_count = get_error_count();
+  int64_t drop_count = get_drop_count();
+
+  if (drop_count > 0)
+    fprintf(stderr, "\033[0;33m" "WARNING:" "\033[0m" " Number of dropped transport messages: %" PRId64 "\n", drop_count);
 
   if (error_count > 0) {
     // TODO: Need better color configuration. Borrow staprun's dbug, warn, err macros?
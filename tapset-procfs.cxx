@@ -26,6 +26,7 @@ static const string TOK_READ("read");
 static const string TOK_WRITE("write");
 static const string TOK_MAXSIZE("maxsize");
 static const string TOK_UMASK("umask");
+static const string TOK_PAGED("paged");
 
 // ------------------------------------------------------------------------
 // procfs file derived probes
@@ -36,12 +37,13 @@ struct procfs_derived_probe: public derived_probe
 {
   string path;
   bool write;
+  bool paged;
   bool target_symbol_seen;
   int64_t maxsize_val;
   int64_t umask; 
   string variable_name;
 
-  procfs_derived_probe (systemtap_session &, probe* p, probe_point* l, string ps, bool w, int64_t m, int64_t umask); 
+  procfs_derived_probe (systemtap_session &, probe* p, probe_point* l, string ps, bool w, bool pg, int64_t m, int64_t umask); 
   void join_group (systemtap_session& s);
 
   // Set up this procfs probe to use a static C variable as input
@@ -118,24 +120,27 @@ sort_for_bpf(systemtap_session& s __attribute__ ((unused)),
 struct procfs_var_expanding_visitor: public var_expanding_visitor
 {
   procfs_var_expanding_visitor(systemtap_session& s,
-                               string path, bool write_probe);
+                               string path, bool write_probe,
+                               bool paged_probe);
 
   string path;
   bool write_probe;
+  bool paged_probe;
   bool target_symbol_seen;
 
   void visit_target_symbol (target_symbol* e);
+  void visit_cursor (target_symbol* e);
 };
 
 
 procfs_derived_probe::procfs_derived_probe (systemtap_session &s, probe* p,
                                             probe_point* l, string ps, bool w,
-					    int64_t m, int64_t umask):  
-    derived_probe(p, l), path(ps), write(w), target_symbol_seen(false),
-    maxsize_val(m), umask(umask) 
+					    bool pg, int64_t m, int64_t umask):  
+    derived_probe(p, l), path(ps), write(w), paged(pg),
+    target_symbol_seen(false), maxsize_val(m), umask(umask) 
 {
   // Expand local variables in the probe body
-  procfs_var_expanding_visitor v (s, path, write);
+  procfs_var_expanding_visitor v (s, path, write, paged);
   var_expand_const_fold_loop (s, this->body, v);
   target_symbol_seen = v.target_symbol_seen;
   if (path.compare("__stdin") == 0) s.read_stdin = true;
@@ -329,6 +334,9 @@ procfs_derived_probe_group::emit_module_decls (systemtap_session& s)
             s.op->line() << " .write_probes=stap_procfs_write_probes.path_"
                          << write_index++ << ",";
 
+          if (pset->read_probe != NULL && pset->read_probe->paged)
+            s.op->line() << " .paged=1,";
+
           s.op->line() << " .num_write_probes="
                        << pset->write_probes.size() << ",";
 
@@ -374,6 +382,7 @@ procfs_derived_probe_group::emit_module_decls (systemtap_session& s)
       s.op->newline() << "pdata.buffer = spp->buffer;";
       s.op->newline() << "pdata.bufsize = spp->bufsize;";
       s.op->newline() << "pdata.count = spp->count;";
+      s.op->newline() << "pdata.cursor = &spp->cursor;";
       s.op->newline() << "if (c->ips.procfs_data == NULL)";
       s.op->newline(1) << "c->ips.procfs_data = &pdata;";
       s.op->newline(-1) << "else {";
@@ -430,6 +439,7 @@ procfs_derived_probe_group::emit_module_decls (systemtap_session& s)
 
       s.op->newline() << "pdata.buffer = (char *)buf;";
       s.op->newline() << "pdata.count = count;";
+      s.op->newline() << "pdata.cursor = NULL;";
 
       s.op->newline() << "if (c->ips.procfs_data == NULL)";
       s.op->newline(1) << "c->ips.procfs_data = &pdata;";
@@ -507,9 +517,10 @@ procfs_derived_probe_group::emit_module_exit (systemtap_session& s)
 
 procfs_var_expanding_visitor::procfs_var_expanding_visitor (systemtap_session& s,
 							    string path,
-							    bool write_probe):
+							    bool write_probe,
+							    bool paged_probe):
   var_expanding_visitor (s), path (path), write_probe (write_probe),
-  target_symbol_seen (false)
+  paged_probe (paged_probe), target_symbol_seen (false)
 {
   // procfs probes can also handle '.='.
   valid_ops.insert (".=");
@@ -523,6 +534,18 @@ procfs_var_expanding_visitor::visit_target_symbol (target_symbol* e)
     {
       assert(e->name.size() > 0 && e->name[0] == '$');
 
+      if (e->name == "$cursor")
+        {
+          if (! paged_probe)
+            throw SEMANTIC_ERROR (_("procfs $cursor variable is only available in a procfs read.paged probe"),
+                                  e->tok);
+          e->assert_no_components("procfs");
+          if (e->addressof)
+            throw SEMANTIC_ERROR(_("cannot take address of procfs variable"), e->tok);
+          visit_cursor (e);
+          return;
+        }
+
       if (e->name != "$value")
         throw SEMANTIC_ERROR (_("invalid target symbol for procfs probe, $value expected"),
                               e->tok);
@@ -653,6 +676,67 @@ procfs_var_expanding_visitor::visit_target_symbol (target_symbol* e)
 }
 
 
+// The $cursor of a paged read probe is a plain long kept per open
+// file, so the script can remember where in its data the next page
+// should start.
+void
+procfs_var_expanding_visitor::visit_cursor (target_symbol* e)
+{
+  bool lvalue = is_active_lvalue(e);
+  if (lvalue && *op != "=")
+    throw SEMANTIC_ERROR (_("Only the following assign operator is"
+                            " implemented on procfs $cursor: '='"), e->tok);
+
+  target_symbol_seen = true;
+
+  functiondecl *fdecl = new functiondecl;
+  fdecl->synthetic = true;
+  fdecl->tok = e->tok;
+  embeddedcode *ec = new embeddedcode;
+  ec->tok = e->tok;
+
+  string fname = "__private_" + detox_path(string(e->tok->location.file->name));
+  string locvalue = "CONTEXT->ips.procfs_data";
+
+  if (! lvalue)
+    {
+      fname += "_procfs_cursor_get";
+      ec->code = string("    struct _stp_procfs_data *data = (struct _stp_procfs_data *)(") + locvalue + string("); /* pure */\n")
+        + string("    STAP_RETVALUE = *data->cursor;\n");
+    }
+  else
+    {
+      fname += "_procfs_cursor_set";
+      ec->code = string("    struct _stp_procfs_data *data = (struct _stp_procfs_data *)(") + locvalue + string(");\n")
+        + string("    *data->cursor = STAP_ARG_value;\n");
+    }
+  fname += lex_cast(++tick);
+
+  fdecl->unmangled_name = fdecl->name = fname;
+  fdecl->body = ec;
+  fdecl->type = pe_long;
+
+  if (lvalue)
+    {
+      vardecl *v = new vardecl;
+      v->type = pe_long;
+      v->name = "value";
+      v->tok = e->tok;
+      fdecl->formal_args.push_back(v);
+    }
+  fdecl->join (sess);
+
+  functioncall* n = new functioncall;
+  n->tok = e->tok;
+  n->function = fname;
+
+  if (lvalue)
+    provide_lvalue_call (n);
+
+  provide (n);
+}
+
+
 struct procfs_builder: public derived_probe_builder
 {
   procfs_builder() {}
@@ -678,6 +762,7 @@ procfs_builder::build(systemtap_session & sess,
   bool has_read = (parameters.find(TOK_READ) != parameters.end());
   bool has_write = (parameters.find(TOK_WRITE) != parameters.end());
   bool has_umask = (parameters.find(TOK_UMASK) != parameters.end()); 
+  bool has_paged = (parameters.find(TOK_PAGED) != parameters.end());
   int64_t maxsize_val = 0;
   int64_t umask_val;
   if(has_umask)  
@@ -746,8 +831,12 @@ procfs_builder::build(systemtap_session & sess,
   if (!(has_read ^ has_write))
     throw SEMANTIC_ERROR (_("need read/write component"), location->components.front()->tok);
 
+  if (has_paged && sess.runtime_mode == systemtap_session::bpf_runtime)
+    throw SEMANTIC_ERROR (_("procfs read.paged probes are not supported in the bpf runtime"),
+                          location->components.front()->tok);
+
   finished_results.push_back(new procfs_derived_probe(sess, base, location,
-                                                      path, has_write,
+                                                      path, has_write, has_paged,
 						      maxsize_val, umask_val));
 }
 
@@ -767,6 +856,16 @@ register_tapset_procfs(systemtap_session& s)
   root->bind_str(TOK_PROCFS)->bind(TOK_READ)->bind_num(TOK_MAXSIZE)->bind(builder);
   root->bind_str(TOK_PROCFS)->bind_num(TOK_UMASK)->bind(TOK_READ)->bind_num(TOK_MAXSIZE)->bind(builder);
 
+  // Paged read probes are called again for every page of output.
+  root->bind(TOK_PROCFS)->bind(TOK_READ)->bind(TOK_PAGED)->bind(builder);
+  root->bind(TOK_PROCFS)->bind_num(TOK_UMASK)->bind(TOK_READ)->bind(TOK_PAGED)->bind(builder);
+  root->bind(TOK_PROCFS)->bind(TOK_READ)->bind_num(TOK_MAXSIZE)->bind(TOK_PAGED)->bind(builder);
+  root->bind(TOK_PROCFS)->bind_num(TOK_UMASK)->bind(TOK_READ)->bind_num(TOK_MAXSIZE)->bind(TOK_PAGED)->bind(builder);
+  root->bind_str(TOK_PROCFS)->bind(TOK_READ)->bind(TOK_PAGED)->bind(builder);
+  root->bind_str(TOK_PROCFS)->bind_num(TOK_UMASK)->bind(TOK_READ)->bind(TOK_PAGED)->bind(builder);
+  root->bind_str(TOK_PROCFS)->bind(TOK_READ)->bind_num(TOK_MAXSIZE)->bind(TOK_PAGED)->bind(builder);
+  root->bind_str(TOK_PROCFS)->bind_num(TOK_UMASK)->bind(TOK_READ)->bind_num(TOK_MAXSIZE)->bind(TOK_PAGED)->bind(builder);
+
   root->bind(TOK_PROCFS)->bind(TOK_WRITE)->bind(builder);
   root->bind(TOK_PROCFS)->bind_num(TOK_UMASK)->bind(TOK_WRITE)->bind(builder);
   root->bind_str(TOK_PROCFS)->bind(TOK_WRITE)->bind(builder);
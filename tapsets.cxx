@@ -444,6 +444,10 @@ struct generic_kprobe_derived_probe: public derived_probe
   bool has_maxactive;
   int64_t maxactive_val;
 
+  // Whether addr is the entry of a kernel function with an ftrace site,
+  // so that the runtime may attach it as an fprobe rather than a kprobe.
+  bool ftrace_entry;
+
   // PR18889: For modules, we have to probe using "symbol+offset"
   // instead of using an address, otherwise we can't probe the init
   // section. 'symbol_name' is the closest known symbol to 'addr' and
@@ -471,7 +475,7 @@ generic_kprobe_derived_probe::generic_kprobe_derived_probe(probe *base,
   derived_probe (base, location, true /* .components soon rewritten */ ),
   module(module), section(section), addr(addr), has_return(has_return),
   has_maxactive(has_maxactive), maxactive_val(maxactive_val),
-  symbol_name(symbol_name), offset(offset),
+  ftrace_entry(false), symbol_name(symbol_name), offset(offset),
   saved_longs(0), saved_strings(0), entry_handler(0)
 {
 }
@@ -5604,6 +5608,11 @@ dwarf_derived_probe::dwarf_derived_probe(interned_string funcname,
         throw SEMANTIC_ERROR (_("missing relocation basis"), tok);
       if (section != "" && dwfl_addr == addr) // addr should be an offset
         throw SEMANTIC_ERROR (_("inconsistent relocation address"), tok);
+
+      if (q.has_kernel && !q.has_return
+          && (q.has_function_str || q.has_function_num)
+          && q.dw.mod_info->ftrace_entry_p (dwfl_addr))
+        ftrace_entry = true;
     }
 
   // XXX: hack for strange g++/gcc's
@@ -6350,6 +6359,8 @@ generic_kprobe_derived_probe_group::emit_module_decls (systemtap_session& s)
         }
       if (p->locations[0]->optional)
         s.op->line() << " .optional_p=1,";
+      if (p->ftrace_entry)
+        s.op->line() << " .ftrace_p=1,";
       s.op->line() << " .address=(unsigned long)0x" << hex << p->addr << dec << "ULL,";
       s.op->line() << " .module=\"" << p->module << "\",";
       s.op->line() << " .section=\"" << p->section << "\",";
@@ -6375,18 +6386,12 @@ generic_kprobe_derived_probe_group::emit_module_decls (systemtap_session& s)
 
   s.op->newline(-1) << "};";
 
-  // Emit the kprobes callback function
+  // Emit the kprobes callback function, whose body is shared with
+  // function-entry probes attached as fprobes (see stapkp_init_fprobes).
   s.op->newline();
-  s.op->newline() << "static int enter_kprobe_probe (struct kprobe *inst,";
-  s.op->line() << " struct pt_regs *regs) {";
-  // NB: as of PR5673, the kprobe|kretprobe union struct is in BSS
-  s.op->newline(1) << "int kprobe_idx = ((uintptr_t)inst-(uintptr_t)stap_kprobes)/sizeof(struct stap_kprobe);";
-  // Check that the index is plausible
-  s.op->newline() << "struct stap_kprobe_probe *skp = &stap_kprobe_probes[";
-  s.op->line() << "((kprobe_idx >= 0 && kprobe_idx < " << probes_by_module.size() << ")?";
-  s.op->line() << "kprobe_idx:0)"; // NB: at least we avoid memory corruption
-  // XXX: it would be nice to give a more verbose error though; BUG_ON later?
-  s.op->line() << "];";
+  s.op->newline() << "static int enter_kprobe_common (struct stap_kprobe_probe *skp,";
+  s.op->line() << " unsigned long addr, struct pt_regs *regs) {";
+  s.op->indent(1);
   common_probe_entryfn_prologue (s, "STAP_SESSION_RUNNING", "", "skp->probe",
 				 "stp_probe_type_kprobe");
   s.op->newline() << "c->kregs = regs;";
@@ -6397,7 +6402,7 @@ generic_kprobe_derived_probe_group::emit_module_decls (systemtap_session& s)
   s.op->newline() << "{";
   s.op->indent(1);
   s.op->newline() << "unsigned long kprobes_ip = REG_IP(c->kregs);";
-  s.op->newline() << "SET_REG_IP(regs, (unsigned long) inst->addr);";
+  s.op->newline() << "SET_REG_IP(regs, addr);";
   s.op->newline() << "(*skp->probe->ph) (c);";
   s.op->newline() << "SET_REG_IP(regs, kprobes_ip);";
   s.op->newline(-1) << "}";
@@ -6406,6 +6411,20 @@ generic_kprobe_derived_probe_group::emit_module_decls (systemtap_session& s)
   s.op->newline() << "return 0;";
   s.op->newline(-1) << "}";
 
+  s.op->newline();
+  s.op->newline() << "static int enter_kprobe_probe (struct kprobe *inst,";
+  s.op->line() << " struct pt_regs *regs) {";
+  // NB: as of PR5673, the kprobe|kretprobe union struct is in BSS
+  s.op->newline(1) << "int kprobe_idx = ((uintptr_t)inst-(uintptr_t)stap_kprobes)/sizeof(struct stap_kprobe);";
+  // Check that the index is plausible
+  s.op->newline() << "struct stap_kprobe_probe *skp = &stap_kprobe_probes[";
+  s.op->line() << "((kprobe_idx >= 0 && kprobe_idx < " << probes_by_module.size() << ")?";
+  s.op->line() << "kprobe_idx:0)"; // NB: at least we avoid memory corruption
+  // XXX: it would be nice to give a more verbose error though; BUG_ON later?
+  s.op->line() << "];";
+  s.op->newline() << "return enter_kprobe_common (skp, (unsigned long) inst->addr, regs);";
+  s.op->newline(-1) << "}";
+
   // Same for kretprobes
   s.op->newline();
   s.op->newline() << "static int enter_kretprobe_common (struct kretprobe_instance *inst,";
@@ -9470,6 +9489,104 @@ module_info::update_symtab(cu_function_cache_t *funcs)
   funcs->insert(new_funcs.begin(), new_funcs.end());
 }
 
+// The kernel's ftrace call sites (__fentry__/mcount calls or patchable
+// function entries) are listed in vmlinux between __start_mcount_loc
+// and __stop_mcount_loc.  Collect them, so that function-entry probes
+// can tell whether the kernel could attach them through ftrace.
+void
+module_info::get_ftrace_sites()
+{
+  if (ftrace_status != info_unknown)
+    return;
+  ftrace_status = info_absent;
+
+  Dwarf_Addr start = 0, stop = 0;
+  int syments = dwfl_module_getsymtab(mod);
+  for (int i = 1; i < syments && !(start && stop); ++i)
+    {
+      GElf_Sym sym;
+      const char *n = dwfl_module_getsym (mod, i, &sym, NULL);
+      if (n && strcmp (n, "__start_mcount_loc") == 0)
+        start = sym.st_value;
+      else if (n && strcmp (n, "__stop_mcount_loc") == 0)
+        stop = sym.st_value;
+    }
+  if (start == 0 || stop <= start)
+    return;
+
+  Dwarf_Addr elf_bias;
+  Elf* elf = dwfl_module_getelf (mod, &elf_bias);
+  if (elf == NULL)
+    return;
+  start -= elf_bias;
+  stop -= elf_bias;
+
+  Elf_Scn *scn = NULL;
+  while ((scn = elf_nextscn (elf, scn)) != NULL)
+    {
+      GElf_Shdr shdr_mem;
+      GElf_Shdr *shdr = gelf_getshdr (scn, &shdr_mem);
+      if (shdr == NULL || shdr->sh_type == SHT_NOBITS
+          || start < shdr->sh_addr || stop > shdr->sh_addr + shdr->sh_size)
+        continue;
+
+      // NB: a debuginfo-only vmlinux has no contents here.
+      Elf_Data *data = elf_rawdata (scn, NULL);
+      if (data == NULL || data->d_buf == NULL
+          || data->d_size < stop - shdr->sh_addr)
+        break;
+
+      size_t n = (stop - start) / gelf_fsize (elf, ELF_T_ADDR, 1, EV_CURRENT);
+      vector<GElf_Addr> buf (n);
+      bool elf64 = gelf_getclass (elf) == ELFCLASS64;
+      Elf_Data dst =
+        {
+          buf.data(), ELF_T_ADDR, EV_CURRENT,
+          gelf_fsize (elf, ELF_T_ADDR, n, EV_CURRENT), 0, 0
+        };
+      Elf_Data src =
+        {
+          (char *) data->d_buf + (start - shdr->sh_addr), ELF_T_ADDR,
+          EV_CURRENT, dst.d_size, 0, 0
+        };
+      if (gelf_xlatetom (elf, &dst, &src,
+                         elf_getident (elf, NULL)[EI_DATA]) == NULL)
+        break;
+
+      ftrace_sites.reserve (n);
+      for (size_t i = 0; i < n; ++i)
+        {
+          GElf_Addr site = elf64 ? ((Elf64_Addr *) buf.data())[i]
+                                 : ((Elf32_Addr *) buf.data())[i];
+          // Sites left for the kernel to relocate read as zero.
+          if (site != 0)
+            ftrace_sites.push_back (site + elf_bias);
+        }
+      sort (ftrace_sites.begin(), ftrace_sites.end());
+      ftrace_status = ftrace_sites.empty() ? info_absent : info_present;
+      break;
+    }
+}
+
+// Whether entrypc is the start of a function with an ftrace site near
+// its start, which the kernel's ftrace_location() maps it to.
+bool
+module_info::ftrace_entry_p(Dwarf_Addr entrypc)
+{
+  get_symtab();
+  get_ftrace_sites();
+  if (!sym_table || ftrace_status != info_present)
+    return false;
+
+  func_info *fi = sym_table->get_func_containing_address (entrypc);
+  if (!fi || fi->addr != entrypc)
+    return false;
+
+  auto it = lower_bound (ftrace_sites.begin(), ftrace_sites.end(), entrypc);
+  return (it != ftrace_sites.end() && *it - entrypc < 16
+          && sym_table->get_func_containing_address (*it) == fi);
+}
+
 module_info::~module_info()
 {
   if (sym_table)
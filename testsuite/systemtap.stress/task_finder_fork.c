@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/* Fork and reap the given number of children (each of which just
+   exits), then report how many forks per second that came to. */
+int
+main(int argc, char **argv)
+{
+    struct timespec start, end;
+    double elapsed;
+    long i, n;
+
+    if (argc != 2) {
+	fprintf(stderr, "Usage: %s count\n", argv[0]);
+	return 1;
+    }
+    n = atol(argv[1]);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < n; i++) {
+	pid_t pid = fork();
+	if (pid < 0) {
+	    perror("fork");
+	    return 1;
+	}
+	if (pid == 0)
+	    _exit(0);
+	if (waitpid(pid, NULL, 0) < 0) {
+	    perror("waitpid");
+	    return 1;
+	}
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    elapsed = (end.tv_sec - start.tv_sec)
+	+ (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("forks: %ld rate: %.0f\n", n, elapsed > 0 ? n / elapsed : 0.0);
+    return 0;
+}
@@ -22,11 +22,14 @@
 #include "dwflpp.h"
 #include "stapregex.h"
 #include "stringtable.h"
+#include "hash.h"
 
 #include <byteswap.h>
 #include <cstdlib>
 #include <iostream>
 #include <set>
+#include <deque>
+#include <iomanip>
 #include <sstream>
 #include <string>
 #include <cassert>
@@ -41,6 +44,7 @@ extern "C" {
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
 #include <unistd.h>
+#include <utime.h>
 }
 
 // Max unwind table size (debug or eh) per module. Somewhat arbitrary
@@ -6689,6 +6693,15 @@ c_unparser::visit_hist_op (hist_op*)
 
 typedef map<Dwarf_Addr,const char*> addrmap_t; // NB: plain map, sorted by address
 
+// One block of the precomputed line index, see dump_line_index().
+struct unwindsym_line_block
+{
+  Dwarf_Addr addr;
+  unsigned line;
+  unsigned file;
+  unsigned offset; // -- of the block's remaining rows in line_deltas
+};
+
 struct unwindsym_dump_context
 {
   systemtap_session& session;
@@ -6721,6 +6734,10 @@ struct unwindsym_dump_context
   size_t debug_line_len;
   void *debug_line_str;
   size_t debug_line_str_len;
+  Dwarf_Addr dwbias; // -- only valid with debug_frame_hdr or need_lines
+  vector<unwindsym_line_block> line_blocks;
+  string line_deltas;
+  vector<string> line_files;
 
   set<string> undone_unwindsym_modules;
 };
@@ -7227,6 +7244,150 @@ dump_line_tables_check (void *data, size_t data_len)
   return DWARF_CB_OK;
 }
 
+static void
+append_uleb128 (string& out, uint64_t value)
+{
+  do
+    {
+      uint8_t byte = value & 0x7f;
+      value >>= 7;
+      if (value != 0)
+        byte |= 0x80;
+      out += (char) byte;
+    }
+  while (value != 0);
+}
+
+static void
+append_sleb128 (string& out, int64_t value)
+{
+  bool more;
+  do
+    {
+      uint8_t byte = value & 0x7f;
+      value >>= 7;
+      more = !((value == 0 && !(byte & 0x40)) || (value == -1 && (byte & 0x40)));
+      if (more)
+        byte |= 0x80;
+      out += (char) byte;
+    }
+  while (more);
+}
+
+#define LINE_INDEX_BLOCK_ROWS 32
+
+// Flatten the module's line tables into rows sorted by address, so the
+// runtime doesn't have to run the .debug_line state machine for every
+// [u]symline() call.  A row covers addresses up to the next one, and
+// line 0 marks the gaps between sequences.  Every LINE_INDEX_BLOCK_ROWS
+// rows start a block, which the runtime binary-searches; the rest of a
+// block's rows are delta-encoded in line_deltas as
+//   uleb128 (addr delta << 1 | file changed), sleb128 line delta
+// followed by the uleb128 file index if it changed.
+static void
+dump_line_index (Dwfl_Module *m, unwindsym_dump_context *c)
+{
+  Dwarf_Addr bias;
+  Dwarf *dw = dwfl_module_getdwarf (m, &bias);
+  if (dw == NULL)
+    return;
+
+  // NB: as in the runtime's state machine, the last row at an address
+  // wins, but the end of one sequence doesn't hide the start of another.
+  map<Dwarf_Addr, pair<unsigned,int> > rows; // -- addr -> (file, line)
+  map<string,unsigned> files;
+  Dwarf_Off off = 0, next_off;
+  size_t cuhl;
+  while (dwarf_nextcu (dw, off, &next_off, &cuhl, NULL, NULL, NULL) == 0)
+    {
+      Dwarf_Die cudie;
+      Dwarf_Lines *lines;
+      size_t nlines;
+      if (dwarf_offdie (dw, off + cuhl, &cudie) != NULL
+          && dwarf_getsrclines (&cudie, &lines, &nlines) == 0)
+        for (size_t i = 0; i < nlines; i++)
+          {
+            Dwarf_Line *line = dwarf_onesrcline (lines, i);
+            Dwarf_Addr addr;
+            int lineno;
+            bool end_sequence;
+            if (line == NULL
+                || dwarf_lineaddr (line, &addr) != 0
+                || dwarf_lineno (line, &lineno) != 0
+                || dwarf_lineendsequence (line, &end_sequence) != 0)
+              continue;
+
+            const char *src = NULL;
+            if (!end_sequence && lineno > 0)
+              src = dwarf_linesrc (line, NULL, NULL);
+            if (src == NULL)
+              {
+                rows.insert (make_pair (addr, make_pair (0U, 0)));
+                continue;
+              }
+            unsigned file = files.insert (make_pair (string (src),
+                                                     (unsigned) files.size ())).first->second;
+            rows[addr] = make_pair (file, lineno);
+          }
+      off = next_off;
+    }
+  if (rows.empty ())
+    return;
+
+  c->line_files.resize (files.size ());
+  for (map<string,unsigned>::iterator it = files.begin (); it != files.end (); it++)
+    c->line_files[it->second] = it->first;
+
+  unsigned nrows = 0, prev_file = 0;
+  int prev_line = 0;
+  Dwarf_Addr prev_addr = 0;
+  for (map<Dwarf_Addr, pair<unsigned,int> >::iterator it = rows.begin ();
+       it != rows.end (); it++)
+    {
+      int line = it->second.second;
+      unsigned file = line ? it->second.first : prev_file;
+      // a row that doesn't change anything just extends the previous one
+      if (nrows > 0 && line == prev_line && file == prev_file)
+        continue;
+
+      if (nrows % LINE_INDEX_BLOCK_ROWS == 0)
+        {
+          unwindsym_line_block b = { it->first, (unsigned) line, file,
+                                     (unsigned) c->line_deltas.size () };
+          c->line_blocks.push_back (b);
+        }
+      else
+        {
+          append_uleb128 (c->line_deltas,
+                          ((it->first - prev_addr) << 1) | (file != prev_file));
+          append_sleb128 (c->line_deltas, (int64_t) line - prev_line);
+          if (file != prev_file)
+            append_uleb128 (c->line_deltas, file);
+        }
+      prev_addr = it->first;
+      prev_line = line;
+      prev_file = file;
+      nrows++;
+    }
+
+  // every sequence should have ended with a gap, but make sure the
+  // last row doesn't cover the rest of the address space
+  if (prev_line != 0)
+    {
+      if (nrows % LINE_INDEX_BLOCK_ROWS == 0)
+        {
+          unwindsym_line_block b = { prev_addr + 1, 0, prev_file,
+                                     (unsigned) c->line_deltas.size () };
+          c->line_blocks.push_back (b);
+        }
+      else
+        {
+          append_uleb128 (c->line_deltas, 1 << 1);
+          append_sleb128 (c->line_deltas, - (int64_t) prev_line);
+        }
+    }
+}
+
 static void
 dump_line_tables (Dwfl_Module *m, unwindsym_dump_context *c,
                   const char *, Dwarf_Addr)
@@ -7279,6 +7440,12 @@ dump_line_tables (Dwfl_Module *m, unwindsym_dump_context *c,
   // kernel addresses if there is no unwind data
   if (c->debug_line_len > 0 && !c->session.need_unwind)
     find_debug_frame_offset (m, c);
+
+  // The runtime looks addresses up in raw .debug_line terms, which for
+  // relocatable kernel modules differ from libdw's relocated ones, so
+  // those keep decoding .debug_line at run time.
+  if (ehdr->e_type != ET_REL)
+    dump_line_index (m, c);
 }
 
 /* Some architectures create special local symbols that are not
@@ -7566,24 +7733,40 @@ dump_unwindsym_cxt_table(systemtap_session& session, ostream& output,
     }
 
   // if it is the debug_line data, do not need the unwind flags to be defined
-  if((table == "debug_line") || (table == "debug_line_str"))
+  bool line_data = (table == "debug_line" || table == "debug_line_str"
+                    || table == "line_deltas");
+  if (line_data)
     output << "#if defined(STP_NEED_LINE_DATA)\n";
   else
     output << "#if defined(STP_USE_DWARF_UNWINDER) && defined(STP_NEED_UNWIND_DATA)\n";
-  output << "static uint8_t _stp_module_" << modindex << "_" << table;
+  string sym = "_stp_module_" + lex_cast(modindex) + "_" + table;
   if (!secname.empty())
-    output << "_" << secindex;
-  output << "[] = \n";
-  output << "  {";
-  for (size_t i = 0; i < len; i++)
-    {
-      int h = ((uint8_t *)data)[i];
-      output << h << ","; // decimal is less wordy than hex
-      if ((i + 1) % 16 == 0)
-	output << "\n" << "   ";
-    }
-  output << "};\n";
-  if ((table == "debug_line") || (table == "debug_line_str"))
+    sym += "_" + lex_cast(secindex);
+
+  // Rather than spelling the table out as a C array literal, which
+  // gcc would have to lex and parse byte by byte, write it next to
+  // stap_symbols.c and pull it into the object with .incbin.  The
+  // directive names the blob relative to that directory (the module
+  // makefile hands it to the assembler with -I), and the symbol stays
+  // local to stap_symbols.o.
+  string blob = sym + ".bin";
+  string blob_path = session.tmpdir + "/" + blob;
+  ofstream blob_out (blob_path.c_str(), ios::binary);
+  blob_out.write ((const char *) data, len);
+  blob_out.close ();
+  if (!blob_out)
+    throw runtime_error (_F("error writing unwind data to %s", blob_path.c_str()));
+
+  output << "__asm__ (" << lex_cast_qstring (".pushsection .data\n") << "\n"
+	 << "         " << lex_cast_qstring (".balign 8\n") << "\n"
+	 << "         " << lex_cast_qstring (".local " + sym + "\n") << "\n"
+	 << "         " << lex_cast_qstring (".type " + sym + ", %object\n") << "\n"
+	 << "         " << lex_cast_qstring (".size " + sym + ", " + lex_cast(len) + "\n") << "\n"
+	 << "         " << lex_cast_qstring (sym + ":\n") << "\n"
+	 << "         " << lex_cast_qstring (".incbin \"" + blob + "\"\n") << "\n"
+	 << "         " << lex_cast_qstring (".popsection\n") << ");\n";
+  output << "extern uint8_t " << sym << "[];\n";
+  if (line_data)
     output << "#endif /* STP_NEED_LINE_DATA */\n";
   else
     output << "#endif /* STP_USE_DWARF_UNWINDER && STP_NEED_UNWIND_DATA */\n";
@@ -7627,6 +7810,35 @@ dump_unwindsym_cxt (Dwfl_Module *m,
   dump_unwindsym_cxt_table(c->session, c->output, modname, stpmod_idx, "", 0,
 			   "debug_line_str", debug_line_str, debug_line_str_len);
 
+  void *line_deltas = NULL;
+  size_t line_deltas_len = 0;
+  if (!c->line_blocks.empty ())
+    {
+      line_deltas = (void *) c->line_deltas.data ();
+      line_deltas_len = c->line_deltas.size ();
+      dump_unwindsym_cxt_table(c->session, c->output, modname, stpmod_idx, "", 0,
+			       "line_deltas", line_deltas, line_deltas_len);
+    }
+  if (line_deltas != NULL)
+    {
+      c->output << "#if defined(STP_NEED_LINE_DATA)\n";
+      c->output << "static struct _stp_line_block _stp_module_" << stpmod_idx
+                << "_line_blocks[] = {\n";
+      for (unsigned i = 0; i < c->line_blocks.size (); i++)
+        {
+          const unwindsym_line_block& b = c->line_blocks[i];
+          c->output << "  { 0x" << hex << b.addr << dec << ", " << b.line
+                    << ", " << b.file << ", " << b.offset << " },\n";
+        }
+      c->output << "};\n";
+      c->output << "static const char *_stp_module_" << stpmod_idx
+                << "_line_files[] = {\n";
+      for (unsigned i = 0; i < c->line_files.size (); i++)
+        c->output << "  " << lex_cast_qstring (c->line_files[i]) << ",\n";
+      c->output << "};\n";
+      c->output << "#endif /* STP_NEED_LINE_DATA */\n";
+    }
+
   if (c->session.need_unwind && debug_frame == NULL && eh_frame == NULL)
     {
       // There would be only a small benefit to warning.  A user
@@ -7718,10 +7930,8 @@ dump_unwindsym_cxt (Dwfl_Module *m,
 		    << "_debug_frame_hdr_" << secidx << ",\n";
           c->output << ".debug_hdr_len = " << debug_frame_hdr_len << ", \n";
 
-	  Dwarf_Addr dwbias = 0;
-	  dwfl_module_getdwarf (m, &dwbias);
 	  c->output << ".sec_load_offset = 0x"
-		    << hex << debug_frame_off - dwbias << dec << "\n";
+		    << hex << debug_frame_off - c->dwbias << dec << "\n";
 
 	  c->output << "#else\n";
 	  c->output << ".debug_hdr = NULL,\n";
@@ -7738,10 +7948,8 @@ dump_unwindsym_cxt (Dwfl_Module *m,
           if (c->session.need_lines && secname == ".text")
             {
               c->output << "#if defined(STP_NEED_LINE_DATA)\n";
-              Dwarf_Addr dwbias = 0;
-              dwfl_module_getdwarf (m, &dwbias);
               c->output << ".sec_load_offset = 0x"
-                        << hex << debug_frame_off - dwbias << dec << "\n";
+                        << hex << debug_frame_off - c->dwbias << dec << "\n";
               c->output << "#else\n";
             }
 	  c->output << ".sec_load_offset = 0\n";
@@ -7849,6 +8057,18 @@ dump_unwindsym_cxt (Dwfl_Module *m,
   if (debug_line != NULL)
     c->output << "#endif /* STP_NEED_LINE_DATA */\n";
 
+  if (line_deltas != NULL)
+    {
+      c->output << "#if defined(STP_NEED_LINE_DATA)\n";
+      c->output << ".line_blocks = _stp_module_" << stpmod_idx << "_line_blocks,\n";
+      c->output << ".num_line_blocks = " << c->line_blocks.size () << ",\n";
+      c->output << ".line_deltas = _stp_module_" << stpmod_idx << "_line_deltas,\n";
+      c->output << ".line_deltas_len = " << line_deltas_len << ",\n";
+      c->output << ".line_files = _stp_module_" << stpmod_idx << "_line_files,\n";
+      c->output << ".num_line_files = " << c->line_files.size () << ",\n";
+      c->output << "#endif /* STP_NEED_LINE_DATA */\n";
+    }
+
   c->output << ".sections = _stp_module_" << stpmod_idx << "_sections" << ",\n";
   c->output << ".num_sections = sizeof(_stp_module_" << stpmod_idx << "_sections)/"
             << "sizeof(struct _stp_section),\n";
@@ -7962,6 +8182,236 @@ static void dump_kallsyms(unwindsym_dump_context *c)
   c->stp_module_index++;
 }
 
+// The data extracted for a module by dump_unwindsyms() is cached by
+// build-id.  Cache files hold each table as a 64-bit length followed by
+// its bytes, with ~0 marking a missing table.  Tables read back from
+// the cache live in an unwindsym_cache_data until they are emitted.
+typedef deque<string> unwindsym_cache_data;
+
+#define UNWINDSYM_CACHE_MAGIC "stap-unwindsym-2"
+
+static void
+unwindsym_cache_put (ostream& o, uint64_t x)
+{
+  o.write ((const char *) &x, sizeof(x));
+}
+
+static void
+unwindsym_cache_put (ostream& o, const void *data, size_t len)
+{
+  unwindsym_cache_put (o, data ? (uint64_t) len : ~(uint64_t) 0);
+  if (data)
+    o.write ((const char *) data, len);
+}
+
+static bool
+unwindsym_cache_get (istream& i, uint64_t& x)
+{
+  return (bool) i.read ((char *) &x, sizeof(x));
+}
+
+static bool
+unwindsym_cache_get (istream& i, unwindsym_cache_data& storage,
+                     void *& data, size_t& len)
+{
+  uint64_t n;
+  if (!unwindsym_cache_get (i, n))
+    return false;
+  if (n == ~(uint64_t) 0)
+    {
+      data = NULL;
+      len = 0;
+      return true;
+    }
+  if (n > MAX_UNWIND_TABLE_SIZE) // -- corrupt entry
+    return false;
+
+  storage.push_back (string (n, '\0'));
+  string& buf = storage.back ();
+  if (n > 0 && !i.read (&buf[0], n))
+    return false;
+  data = &buf[0];
+  len = n;
+  return true;
+}
+
+static void
+add_unwindsyms_to_cache (unwindsym_dump_context *c, const string& path)
+{
+  // Write to a private file first, since another stap may be reading
+  // the same entry:
+  string tmp_path = path + ".tmp" + lex_cast (getpid ());
+  ofstream o (tmp_path.c_str (), ios::binary);
+  o << UNWINDSYM_CACHE_MAGIC << "\n";
+
+  unwindsym_cache_put (o, c->seclist.size ());
+  for (unsigned secidx = 0; secidx < c->seclist.size (); secidx++)
+    {
+      const string& secname = c->seclist[secidx].first;
+      unwindsym_cache_put (o, secname.data (), secname.size ());
+      unwindsym_cache_put (o, c->seclist[secidx].second);
+
+      const addrmap_t& addrmap = c->addrmap[secidx];
+      unwindsym_cache_put (o, addrmap.size ());
+      for (addrmap_t::const_iterator it = addrmap.begin ();
+           it != addrmap.end (); it++)
+        {
+          unwindsym_cache_put (o, it->first);
+          unwindsym_cache_put (o, it->second, strlen (it->second));
+        }
+    }
+
+  unwindsym_cache_put (o, c->debug_frame, c->debug_len);
+  unwindsym_cache_put (o, c->debug_frame_hdr, c->debug_frame_hdr_len);
+  unwindsym_cache_put (o, c->eh_frame, c->eh_len);
+  unwindsym_cache_put (o, c->eh_frame_hdr, c->eh_frame_hdr_len);
+  unwindsym_cache_put (o, c->debug_line, c->debug_line_len);
+  unwindsym_cache_put (o, c->debug_line_str, c->debug_line_str_len);
+  unwindsym_cache_put (o, c->debug_frame_off);
+  unwindsym_cache_put (o, c->eh_addr);
+  unwindsym_cache_put (o, c->eh_frame_hdr_addr);
+  unwindsym_cache_put (o, c->dwbias);
+
+  unwindsym_cache_put (o, c->line_blocks.size ());
+  for (unsigned i = 0; i < c->line_blocks.size (); i++)
+    {
+      unwindsym_cache_put (o, c->line_blocks[i].addr);
+      unwindsym_cache_put (o, c->line_blocks[i].line);
+      unwindsym_cache_put (o, c->line_blocks[i].file);
+      unwindsym_cache_put (o, c->line_blocks[i].offset);
+    }
+  unwindsym_cache_put (o, c->line_deltas.data (), c->line_deltas.size ());
+  unwindsym_cache_put (o, c->line_files.size ());
+  for (unsigned i = 0; i < c->line_files.size (); i++)
+    unwindsym_cache_put (o, c->line_files[i].data (), c->line_files[i].size ());
+  o.close ();
+
+  if (!o || rename (tmp_path.c_str (), path.c_str ()) != 0)
+    {
+      if (c->session.verbose > 1)
+        clog << _F("failed to add unwind data to cache %s", path.c_str ()) << endl;
+      unlink (tmp_path.c_str ());
+    }
+}
+
+static bool
+get_unwindsyms_from_cache (unwindsym_dump_context *c, const string& path,
+                           unwindsym_cache_data& storage)
+{
+  if (c->session.poison_cache)
+    return false;
+
+  ifstream i (path.c_str (), ios::binary);
+  string magic;
+  if (!getline (i, magic))
+    return false; // -- not in the cache
+  if (magic != UNWINDSYM_CACHE_MAGIC)
+    goto corrupt;
+
+  {
+    c->seclist.clear ();
+    c->addrmap.clear ();
+    uint64_t nsecs;
+    if (!unwindsym_cache_get (i, nsecs))
+      goto corrupt;
+    for (unsigned secidx = 0; secidx < nsecs; secidx++)
+      {
+        void *secname, *symname;
+        size_t secname_len, symname_len;
+        uint64_t size, nsyms, addr;
+        if (!unwindsym_cache_get (i, storage, secname, secname_len)
+            || !unwindsym_cache_get (i, size)
+            || !unwindsym_cache_get (i, nsyms))
+          goto corrupt;
+        c->seclist.push_back (make_pair (string ((const char *) secname,
+                                                 secname_len),
+                                         (unsigned) size));
+        addrmap_t& addrmap = c->addrmap[secidx];
+        for (uint64_t j = 0; j < nsyms; j++)
+          {
+            if (!unwindsym_cache_get (i, addr)
+                || !unwindsym_cache_get (i, storage, symname, symname_len))
+              goto corrupt;
+            addrmap[addr] = (const char *) symname; // -- NUL-terminated
+          }
+      }
+
+    void *debug_frame_hdr;
+    size_t debug_frame_hdr_len;
+    uint64_t debug_frame_off, eh_addr, eh_frame_hdr_addr, dwbias;
+    if (!unwindsym_cache_get (i, storage, c->debug_frame, c->debug_len)
+        || !unwindsym_cache_get (i, storage, debug_frame_hdr, debug_frame_hdr_len)
+        || !unwindsym_cache_get (i, storage, c->eh_frame, c->eh_len)
+        || !unwindsym_cache_get (i, storage, c->eh_frame_hdr, c->eh_frame_hdr_len)
+        || !unwindsym_cache_get (i, storage, c->debug_line, c->debug_line_len)
+        || !unwindsym_cache_get (i, storage, c->debug_line_str, c->debug_line_str_len)
+        || !unwindsym_cache_get (i, debug_frame_off)
+        || !unwindsym_cache_get (i, eh_addr)
+        || !unwindsym_cache_get (i, eh_frame_hdr_addr)
+        || !unwindsym_cache_get (i, dwbias))
+      goto corrupt;
+
+    c->line_blocks.clear ();
+    c->line_deltas.clear ();
+    c->line_files.clear ();
+    uint64_t nblocks, nfiles;
+    void *line_deltas, *file;
+    size_t line_deltas_len, file_len;
+    if (!unwindsym_cache_get (i, nblocks))
+      goto corrupt;
+    for (uint64_t j = 0; j < nblocks; j++)
+      {
+        uint64_t addr, line, file, offset;
+        if (!unwindsym_cache_get (i, addr)
+            || !unwindsym_cache_get (i, line)
+            || !unwindsym_cache_get (i, file)
+            || !unwindsym_cache_get (i, offset))
+          goto corrupt;
+        unwindsym_line_block b = { addr, (unsigned) line, (unsigned) file,
+                                   (unsigned) offset };
+        c->line_blocks.push_back (b);
+      }
+    if (!unwindsym_cache_get (i, storage, line_deltas, line_deltas_len)
+        || !unwindsym_cache_get (i, nfiles))
+      goto corrupt;
+    if (line_deltas)
+      c->line_deltas.assign ((const char *) line_deltas, line_deltas_len);
+    for (uint64_t j = 0; j < nfiles; j++)
+      {
+        if (!unwindsym_cache_get (i, storage, file, file_len))
+          goto corrupt;
+        c->line_files.push_back (string ((const char *) file, file_len));
+      }
+
+    // dump_unwindsym_cxt() frees the debug_frame_hdr:
+    c->debug_frame_hdr = NULL;
+    c->debug_frame_hdr_len = 0;
+    if (debug_frame_hdr)
+      {
+        c->debug_frame_hdr = malloc (debug_frame_hdr_len);
+        if (c->debug_frame_hdr == NULL && debug_frame_hdr_len > 0)
+          goto corrupt;
+        memcpy (c->debug_frame_hdr, debug_frame_hdr, debug_frame_hdr_len);
+        c->debug_frame_hdr_len = debug_frame_hdr_len;
+      }
+    c->debug_frame_off = debug_frame_off;
+    c->eh_addr = eh_addr;
+    c->eh_frame_hdr_addr = eh_frame_hdr_addr;
+    c->dwbias = dwbias;
+
+    // Touch the entry, since clean_cache() evicts the oldest by mtime.
+    if (utime (path.c_str (), NULL) < 0 && c->session.verbose > 1)
+      clog << _F("unwind data cache utime error: %s", strerror (errno)) << endl;
+    return true;
+  }
+
+corrupt:
+  if (c->session.verbose > 1)
+    clog << _F("ignoring corrupt unwind data cache entry %s", path.c_str ()) << endl;
+  unlink (path.c_str ());
+  return false;
+}
+
 static int
 dump_unwindsyms (Dwfl_Module *m,
                  void **userdata __attribute__ ((unused)),
@@ -8000,6 +8450,30 @@ dump_unwindsyms (Dwfl_Module *m,
   c->build_id_bits = NULL;
   res = dump_build_id (m, c, name, base);
 
+  // Shared libraries in particular tend to be needed by many scripts,
+  // so keep what we extract from user-space modules in the cache:
+  string cache_path;
+  unwindsym_cache_data cached;
+  if (res == DWARF_CB_OK && c->build_id_len > 0 && is_user_module (modname)
+      && c->session.use_cache)
+    {
+      ostringstream build_id;
+      for (int j = 0; j < c->build_id_len; j++)
+        build_id << hex << setw(2) << setfill('0')
+                 << (unsigned) c->build_id_bits[j];
+      cache_path = find_unwindsym_hash (c->session, modname, build_id.str());
+    }
+  if (cache_path != "" && get_unwindsyms_from_cache (c, cache_path, cached))
+    {
+      if (c->session.verbose > 1)
+        clog << _F("Pass 3: using cached %s for %s", cache_path.c_str(),
+                   modname.c_str()) << endl;
+      res = dump_unwindsym_cxt (m, c, name, base);
+      if (res == DWARF_CB_OK)
+        c->stp_module_index++;
+      return res;
+    }
+
   c->seclist.clear();
   if (res == DWARF_CB_OK)
     res = dump_section_list(m, c, name, base);
@@ -8030,11 +8504,21 @@ dump_unwindsyms (Dwfl_Module *m,
   c->debug_line_len = 0;
   c->debug_line_str = NULL;
   c->debug_line_str_len = 0;
+  c->line_blocks.clear();
+  c->line_deltas.clear();
+  c->line_files.clear();
   if (res == DWARF_CB_OK && c->session.need_lines)
     // we dont set res = dump_line_tables() because unwindsym stuff should still
     // get dumped to the output even if gathering debug_line data fails
     (void) dump_line_tables (m, c, name, base);
 
+  c->dwbias = 0;
+  if (res == DWARF_CB_OK && (c->debug_frame_hdr || c->session.need_lines))
+    dwfl_module_getdwarf (m, &c->dwbias);
+
+  if (res == DWARF_CB_OK && cache_path != "")
+    add_unwindsyms_to_cache (c, cache_path);
+
   /* And finally dump everything collected in the output. */
   if (res == DWARF_CB_OK)
     res = dump_unwindsym_cxt (m, c, name, base);
@@ -8203,6 +8687,10 @@ emit_symbol_data (systemtap_session& s)
 				 0, /* debug_line_len */
 				 NULL, /* debug_line_str */
 				 0, /* debug_line_str_len */
+				 0, /* dwbias */
+				 vector<unwindsym_line_block>(), /* line_blocks */
+				 "", /* line_deltas */
+				 vector<string>(), /* line_files */
 				 s.unwindsym_modules };
 
   // Micro optimization, mainly to speed up tiny regression tests
@@ -8328,6 +8816,15 @@ emit_symbol_data_done (unwindsym_dump_context *ctx, systemtap_session& s)
   ctx->output << "};\n";
   ctx->output << "const unsigned _stp_num_modules = ARRAY_SIZE(_stp_modules);\n";
 
+  // Reserve room for the runtime's sorted section and module name
+  // indexes, two copies of each; see runtime/sym.c.
+  ctx->output << "struct _stp_section_ref _stp_section_index [2 * (0\n";
+  for (unsigned i=0; i<ctx->stp_module_index; i++)
+    ctx->output << "+ ARRAY_SIZE(_stp_module_" << i << "_sections)\n";
+  ctx->output << "+ ARRAY_SIZE(_stp_module_self_sections))];\n";
+  ctx->output << "const unsigned _stp_section_index_max = ARRAY_SIZE(_stp_section_index) / 2;\n";
+  ctx->output << "struct _stp_module *_stp_modules_by_name [2 * ARRAY_SIZE(_stp_modules)];\n";
+
   ctx->output << "unsigned long _stp_kretprobe_trampoline = ";
   // Special case for -1, which is invalid in hex if host width > target width.
   if (ctx->stp_kretprobe_trampoline_addr == (unsigned long) -1)
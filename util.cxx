@@ -1085,9 +1085,10 @@ stap_system_read(int verbose, const vector<string>& args, ostream& out)
 
 
 std::pair<bool,int>
-stap_fork_read(int verbose, ostream& out)
+stap_fork_pipe(int verbose, pid_t& child)
 {
   int pipefd[2];
+  child = -1;
   if (pipe(pipefd) != 0)
     return make_pair(false, -1);
 
@@ -1096,7 +1097,7 @@ stap_fork_read(int verbose, ostream& out)
   if (verbose > 1)
     clog << _("Forking subprocess...") << endl;
 
-  pid_t child = fork();
+  child = fork();
   PROBE1(stap, stap_system__fork, child);
   // child < 0: fork failure
   if (child < 0)
@@ -1117,10 +1118,22 @@ stap_fork_read(int verbose, ostream& out)
 
   // child > 0: we're the parent
   spawned_pids.insert(child);
+  close(pipefd[1]);
+  fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+  return make_pair(false, pipefd[0]);
+}
+
+
+std::pair<bool,int>
+stap_fork_read(int verbose, ostream& out)
+{
+  pid_t child;
+  pair<bool,int> ret = stap_fork_pipe(verbose, child);
+  if (ret.first || ret.second < 0)
+    return ret;
 
   // read everything from the child
-  close(pipefd[1]);
-  stdio_filebuf<char> in(pipefd[0], ios_base::in);
+  stdio_filebuf<char> in(ret.second, ios_base::in);
   out << &in;
   return make_pair(false, stap_waitpid(verbose, child));
 }
@@ -117,6 +117,7 @@ inline int stap_system(int verbose, const std::vector<std::string>& args,
                        bool null_out=false, bool null_err=false)
 { return stap_system(verbose, args.front(), args, null_out, null_err); }
 int stap_system_read(int verbose, const std::vector<std::string>& args, std::ostream& out);
+std::pair<bool,int> stap_fork_pipe(int verbose, pid_t& child);
 std::pair<bool,int> stap_fork_read(int verbose, std::ostream& out);
 int kill_stap_spawn(int sig);
 bool is_build_id(const std::string& str);